@@ -0,0 +1,366 @@
+#include "VFS.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include <filesystem>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+
+// Benchmark suite for AbstractFileIO, MapStream and hashing.
+//
+// Usage: vfs_bench [--out <file.json>] [--dir <scratch dir>] [--max-entries <n>] [--trace <trace.json>]
+//
+// Every benchmark times single operations (or small batches of very cheap ones) and reports
+// the p50/p99 latency in nanoseconds next to the throughput. Results are written as JSON,
+// so that runs of different releases on the same machine can be compared. With --trace the
+// events of a build with VFS_ENABLE_TRACING are written as Chrome trace JSON as well.
+
+struct Options
+{
+	std::string outPath = "vfs_bench.json";
+	std::string dir = (std::filesystem::temp_directory_path() / "VFS" / "bench").string();
+	uint64_t maxEntries = 10000000;
+	std::string tracePath;
+};
+
+struct Result
+{
+	std::string name;
+	std::vector<std::pair<std::string, uint64_t>> params;
+	uint64_t nOps = 0;
+	uint64_t bytesPerOp = 0;
+	double seconds = 0.0;
+	std::vector<double> latencies; // Nanoseconds per operation
+};
+
+class Timer
+{
+public:
+	Timer() : m_begin(std::chrono::steady_clock::now()) {}
+public:
+	double ns() const { return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - m_begin).count(); }
+	double seconds() const { return ns() / 1e9; }
+private:
+	std::chrono::steady_clock::time_point m_begin;
+};
+
+double percentile(std::vector<double>& sorted, double p)
+{
+	if (sorted.empty())
+		return 0.0;
+	// Nearest rank
+	uint64_t rank = (uint64_t)std::ceil(p * sorted.size());
+	return sorted[std::min<uint64_t>(std::max<uint64_t>(rank, 1), sorted.size()) - 1];
+}
+
+void report(std::vector<Result>& results, Result&& result)
+{
+	std::sort(result.latencies.begin(), result.latencies.end());
+
+	std::cout << std::left << std::setw(28) << result.name;
+	for (auto& param : result.params)
+		std::cout << " " << param.first << "=" << param.second;
+	std::cout << ": p50 " << (uint64_t)percentile(result.latencies, 0.50) << "ns, p99 " << (uint64_t)percentile(result.latencies, 0.99)
+		<< "ns, " << result.nOps / result.seconds << " ops/s" << std::endl;
+
+	results.push_back(std::move(result));
+}
+
+void writeJson(const std::string& path, std::vector<Result>& results)
+{
+	std::ostringstream json;
+	json << std::fixed << std::setprecision(1);
+	json << "{\n";
+	json << "  \"suite\": \"vfs_bench\",\n";
+	json << "  \"version\": 1,\n";
+	json << "  \"hardware_concurrency\": " << std::thread::hardware_concurrency() << ",\n";
+	json << "  \"results\": [";
+	for (uint64_t i = 0; i < results.size(); ++i)
+	{
+		auto& result = results[i];
+		double opsPerSec = result.nOps / result.seconds;
+
+		json << (i > 0 ? ",\n" : "\n") << "    { \"name\": \"" << result.name << "\"";
+		for (auto& param : result.params)
+			json << ", \"" << param.first << "\": " << param.second;
+		json << ", \"ops\": " << result.nOps;
+		json << ", \"seconds\": " << std::setprecision(6) << result.seconds << std::setprecision(1);
+		json << ", \"ops_per_sec\": " << opsPerSec;
+		if (result.bytesPerOp > 0)
+			json << ", \"mib_per_sec\": " << opsPerSec * result.bytesPerOp / (1 << 20);
+		json << ", \"p50_ns\": " << percentile(result.latencies, 0.50);
+		json << ", \"p99_ns\": " << percentile(result.latencies, 0.99);
+		json << ", \"max_ns\": " << (result.latencies.empty() ? 0.0 : result.latencies.back());
+		json << " }";
+	}
+	json << "\n  ]\n}\n";
+
+	std::ofstream(path) << json.str();
+}
+
+// Runs func(thread, latencies) on nThreads threads and merges the latencies of all of them
+Result runThreads(const std::string& name, uint64_t nThreads, const std::function<void(uint64_t, std::vector<double>&)>& func)
+{
+	std::vector<std::vector<double>> latencies(nThreads);
+	std::vector<std::thread> threads;
+	Timer timer;
+	for (uint64_t i = 0; i < nThreads; ++i)
+		threads.emplace_back(func, i, std::ref(latencies[i]));
+	for (auto& thread : threads)
+		thread.join();
+
+	Result result;
+	result.name = name;
+	result.params = { { "threads", nThreads } };
+	result.seconds = timer.seconds();
+	for (auto& threadLatencies : latencies)
+		result.latencies.insert(result.latencies.end(), threadLatencies.begin(), threadLatencies.end());
+	result.nOps = result.latencies.size();
+	return result;
+}
+
+void benchAFIO(const Options& options, std::vector<Result>& results)
+{
+	constexpr uint64_t fileSize = 64ull << 20;
+	constexpr uint64_t blockSize = 4096;
+	constexpr uint64_t nOpsPerThread = 4096;
+
+	for (uint64_t nThreads : { 1, 2, 4, 8 })
+	{
+		// Every thread works on a file of its own, the streams are shared through one AbstractFileIO
+		auto afio = VFS::AbstractFileIO::create(nThreads);
+		std::vector<std::string> paths;
+		std::vector<char> block(1 << 20, 'x');
+		for (uint64_t i = 0; i < nThreads; ++i)
+		{
+			paths.push_back(options.dir + "/afio" + std::to_string(i) + ".bin");
+			afio->make(paths.back());
+			for (uint64_t offset = 0; offset < fileSize; offset += block.size())
+				afio->write(paths.back(), block.data(), block.size(), offset);
+		}
+
+		auto run = [&](const std::string& name, bool isWrite, bool isRandom)
+		{
+			Result result = runThreads(name, nThreads, [&](uint64_t self, std::vector<double>& latencies)
+				{
+					std::mt19937_64 rng(self);
+					std::vector<char> buffer(blockSize, (char)self);
+					latencies.reserve(nOpsPerThread);
+					for (uint64_t i = 0; i < nOpsPerThread; ++i)
+					{
+						uint64_t offset = (isRandom ? rng() % (fileSize / blockSize) : i) * blockSize;
+						Timer timer;
+						if (isWrite)
+							afio->write(paths[self], buffer.data(), blockSize, offset);
+						else
+							afio->read(paths[self], buffer.data(), blockSize, offset);
+						latencies.push_back(timer.ns());
+					}
+				});
+			result.params.push_back({ "block_size", blockSize });
+			result.bytesPerOp = blockSize;
+			report(results, std::move(result));
+		};
+		run("afio.read.sequential", false, false);
+		run("afio.read.random", false, true);
+		run("afio.write.sequential", true, false);
+		run("afio.write.random", true, true);
+
+		afio->closeMatchingStreams(options.dir);
+		for (auto& path : paths)
+			std::filesystem::remove(path);
+	}
+}
+
+void benchMapStream(const Options& options, std::vector<Result>& results)
+{
+	constexpr uint64_t nSampleOps = 1000;
+
+	// Big-endian keys sort in numeric order
+	auto makeKey = [](uint64_t n)
+	{
+		uint64_t key = 0;
+		for (uint64_t i = 0; i < sizeof(key); ++i)
+			((unsigned char*)&key)[i] = (unsigned char)(n >> (8 * (sizeof(key) - 1 - i)));
+		return key;
+	};
+
+	auto afio = VFS::AbstractFileIO::create(4);
+	uint64_t keySize = sizeof(uint64_t);
+	uint64_t valSize = sizeof(uint64_t);
+
+	for (uint64_t nEntries = 1000; nEntries <= options.maxEntries; nEntries *= 10)
+	{
+		// The map is built in one pass with even keys, odd keys are never present
+		auto path = options.dir + "/mapstream" + std::to_string(nEntries) + ".msf";
+		{
+			VFS::MapStreamBuilder builder(path, afio, keySize, valSize);
+			for (uint64_t n = 0; n < nEntries; ++n)
+			{
+				uint64_t key = makeKey(2 * n);
+				builder.add(&key, &n);
+			}
+		}
+
+		{
+			VFS::MapStream ms(path, afio, keySize, valSize);
+			std::mt19937_64 rng(nEntries);
+			uint64_t nOps = std::min(nEntries, nSampleOps);
+
+			auto run = [&](const std::string& name, const std::function<void()>& op, uint64_t count)
+			{
+				Result result;
+				result.name = name;
+				result.params = { { "entries", nEntries } };
+				result.latencies.reserve(count);
+				Timer total;
+				for (uint64_t i = 0; i < count; ++i)
+				{
+					Timer timer;
+					op();
+					result.latencies.push_back(timer.ns());
+				}
+				result.seconds = total.seconds();
+				result.nOps = count;
+				report(results, std::move(result));
+			};
+
+			run("mapstream.find.hit", [&]()
+				{
+					uint64_t key = makeKey(2 * (rng() % nEntries));
+					volatile uint64_t index = ms.find(&key);
+					(void)index;
+				}, nOps * 10);
+			run("mapstream.find.miss", [&]()
+				{
+					uint64_t key = makeKey(2 * (rng() % nEntries) + 1);
+					volatile uint64_t index = ms.find(&key);
+					(void)index;
+				}, nOps * 10);
+			// New keys go to the unsorted tail, every insert searches it for a duplicate first
+			uint64_t nInserted = 0;
+			run("mapstream.insert", [&]()
+				{
+					uint64_t key = makeKey(2 * (nInserted++ * (nEntries / nOps)) + 1);
+					ms.insert(&key, &nInserted);
+				}, nOps);
+			run("mapstream.optimize", [&]() { ms.optimize(); }, 1);
+			run("mapstream.erase", [&]()
+				{
+					uint64_t key = makeKey(2 * (rng() % nEntries));
+					ms.erase(&key);
+				}, nOps);
+			run("mapstream.flush", [&]() { ms.flush(); }, 1);
+		}
+
+		afio->closeMatchingStreams(path);
+		std::filesystem::remove(path);
+	}
+}
+
+void benchHash(std::vector<Result>& results)
+{
+	// Cheap operations are timed in batches, the latency is that of the batch divided by its size
+	constexpr uint64_t batchSize = 256;
+	constexpr uint64_t nBatches = 2000;
+
+	auto run = [&](const std::string& name, uint64_t param, uint64_t bytesPerOp, const std::function<void(uint64_t)>& op)
+	{
+		Result result;
+		result.name = name;
+		if (param > 0)
+			result.params = { { "size", param } };
+		result.bytesPerOp = bytesPerOp;
+		result.latencies.reserve(nBatches);
+		Timer total;
+		for (uint64_t batch = 0; batch < nBatches; ++batch)
+		{
+			Timer timer;
+			for (uint64_t i = 0; i < batchSize; ++i)
+				op(batch * batchSize + i);
+			result.latencies.push_back(timer.ns() / batchSize);
+		}
+		result.seconds = total.seconds();
+		result.nOps = nBatches * batchSize;
+		report(results, std::move(result));
+	};
+
+	std::mt19937_64 rng(42);
+	for (uint64_t size : { 8, 32, 128, 1024 })
+	{
+		std::vector<std::string> strings(batchSize);
+		for (auto& str : strings)
+		{
+			str.resize(size);
+			for (auto& c : str)
+				c = 'a' + rng() % 26;
+		}
+
+		volatile VFS::Hash sink = 0;
+		run("hash.make", size, size, [&](uint64_t i) { sink = sink + VFS::makeHash(strings[i % batchSize]); });
+	}
+
+	// Paths of depth 2 to 8 with names as found below /usr
+	std::vector<std::string> paths(4096);
+	uint64_t nPathBytes = 0;
+	for (auto& path : paths)
+	{
+		uint64_t depth = 2 + rng() % 7;
+		for (uint64_t i = 0; i < depth; ++i)
+		{
+			path += (i > 0 ? "/" : "");
+			uint64_t length = 3 + rng() % 14;
+			for (uint64_t j = 0; j < length; ++j)
+				path += (char)('a' + rng() % 26);
+		}
+		nPathBytes += path.size();
+	}
+
+	run("hashpath.parse", 0, nPathBytes / paths.size(), [&](uint64_t i)
+		{
+			VFS::HashPath path(paths[i % paths.size()]);
+			volatile VFS::Hash sink = path.hash();
+			(void)sink;
+		});
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string arg = argv[i];
+		if (arg == "--out")
+			options.outPath = argv[i + 1];
+		else if (arg == "--dir")
+			options.dir = argv[i + 1];
+		else if (arg == "--max-entries")
+			options.maxEntries = std::stoull(argv[i + 1]);
+		else if (arg == "--trace")
+			options.tracePath = argv[i + 1];
+		else
+			std::cout << "Unknown option: " << arg << std::endl;
+	}
+	std::filesystem::create_directories(options.dir);
+
+	std::vector<Result> results;
+	benchAFIO(options, results);
+	benchMapStream(options, results);
+	benchHash(results);
+
+	writeJson(options.outPath, results);
+	std::cout << "Wrote " << results.size() << " results to " << options.outPath << std::endl;
+	if (!options.tracePath.empty() && VFS::Trace::dump(options.tracePath))
+		std::cout << "Wrote trace to " << options.tracePath << std::endl;
+
+	return 0;
+}
\ No newline at end of file
@@ -4,6 +4,47 @@
 
 #include <filesystem>
 #include <unordered_map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+static std::atomic<uint64_t> g_nAllocations = 0;
+
+void* operator new(std::size_t size)
+{
+	++g_nAllocations;
+	if (void* ptr = std::malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	++g_nAllocations;
+	return std::malloc(size ? size : 1);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+std::string testPath(const std::string& name)
+{
+	auto dir = std::filesystem::temp_directory_path() / "VFS";
+	std::filesystem::create_directories(dir);
+	return (dir / name).string();
+}
 
 void compareInputStrings()
 {
@@ -27,75 +68,86 @@ void compareInputStrings()
 	};
 }
 
-void scanDrivePathsAndCompare()
+void scanDrivePathsAndCompare(const std::string& rootPath = "/")
 {
-	std::unordered_map<VFS::Hash, std::string> hashMap;
-
-	uint64_t nClashes = 0;
-	uint64_t nScanned = 0;
-	uint64_t nSameName = 0;
-
-	auto checkName = [&nScanned, &hashMap, &nClashes, &nSameName](const std::string& name)
+	std::vector<std::string> names;
+	std::vector<std::string> paths;
 	{
-		++nScanned;
-
-		auto hash = VFS::makeHash(name);
-
-		auto mapIt = hashMap.find(hash);
-		if (mapIt != hashMap.end())
+		std::unordered_map<std::string, bool> uniqueNames;
+		std::error_code ec;
+		auto it = std::filesystem::recursive_directory_iterator(rootPath, std::filesystem::directory_options::skip_permission_denied, ec);
+		while (!ec && it != std::filesystem::recursive_directory_iterator())
 		{
-			if (name != mapIt->second)
-			{
-				std::cout << "  Found clash: '" << name << "' && '" << mapIt->second << "' --> " << hash << std::endl;
-				++nClashes;
-			}
-			else
+			auto path = it->path().u8string();
+			auto name = it->path().filename().u8string();
+			paths.push_back(path);
+			if (uniqueNames.insert(std::make_pair(name, true)).second)
+				names.push_back(name);
+
+			it.increment(ec);
+			if (ec)
 			{
-				++nSameName;
+				// Skip entries that vanished or cannot be read instead of aborting the scan
+				ec.clear();
+				it.pop();
 			}
-			return;
 		}
+	}
 
-		hashMap.insert(std::make_pair(hash, name));
-	};
+	std::vector<char> bigBuffer(64 << 20);
+	for (uint64_t i = 0; i < bigBuffer.size(); ++i)
+		bigBuffer[i] = (char)(i * 2654435761u >> 13);
 
-	auto scanDrive = [checkName](const std::string& drivepath)
+	auto countClashes = [](const std::vector<std::string>& strings, VFS::HashVersion version)
 	{
-		try
+		std::unordered_map<VFS::Hash, const std::string*> hashMap;
+		uint64_t nClashes = 0;
+		for (auto& str : strings)
 		{
-			auto it = std::filesystem::recursive_directory_iterator(drivepath, std::filesystem::directory_options::skip_permission_denied);
-			while (it != std::filesystem::recursive_directory_iterator())
-			{
-				checkName(it->path().filename().u8string());
-				try
-				{
-					++it;
-				}
-				catch (...)
-				{
-					;
-				}
-			}
+			auto result = hashMap.insert(std::make_pair(VFS::makeHash(str, version), &str));
+			if (!result.second && *result.first->second != str)
+				++nClashes;
 		}
-		catch (...)
+		return nClashes;
+	};
+
+	// Hashes the whole set repeatedly for at least half a second
+	auto measureGBps = [](const std::vector<std::string>& strings, VFS::HashVersion version)
+	{
+		uint64_t nBytes = 0;
+		volatile VFS::Hash sink = 0;
+		auto begin = std::chrono::steady_clock::now();
+		double seconds = 0.0;
+		do
 		{
-			;
-		}
+			for (auto& str : strings)
+				sink = sink + VFS::makeHash(str, version);
+			for (auto& str : strings)
+				nBytes += str.size();
+			seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		} while (seconds < 0.5);
+		return nBytes / seconds / 1e9;
 	};
 
-	std::error_code ec;
-	std::cout << "Scanning drive 'C:\\' ..." << std::endl;
-	scanDrive("C:\\");
-	std::cout << "Scanning drive 'D:\\' ..." << std::endl;
-	scanDrive("D:\\");
-	std::cout << "Scanning drive 'E:\\' ..." << std::endl;
-	scanDrive("E:\\");
+	std::cout << "Scanned '" << rootPath << "': " << paths.size() << " paths, " << names.size() << " unique names" << std::endl;
+
+	struct { const char* name; VFS::HashVersion version; } versions[] = {
+		{ "Legacy", VFS::HashVersion::Legacy },
+		{ "V1", VFS::HashVersion::V1 }
+	};
+	for (auto& v : versions)
+	{
+		volatile VFS::Hash sink = 0;
+		auto begin = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < 8; ++i)
+			sink = sink + VFS::makeHash(bigBuffer.data(), bigBuffer.size(), v.version);
+		double bigSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
 
-	std::cout << "////////////////////////////////////////////////////////////" << std::endl;
-	std::cout << "-- Scanned " << nScanned << " file-/dirnames." << std::endl;
-	std::cout << "-- Found " << nClashes << " clashes." << std::endl;
-	std::cout << "-- #DiffHashes: " << hashMap.size() << std::endl;
-	std::cout << "-- #SameName: " << nSameName << std::endl;
+		std::cout << "-- " << v.name << ":" << std::endl;
+		std::cout << "   Name clashes: " << countClashes(names, v.version) << ", path clashes: " << countClashes(paths, v.version) << std::endl;
+		std::cout << "   Names: " << measureGBps(names, v.version) << " GB/s, paths: " << measureGBps(paths, v.version) << " GB/s, "
+			<< "64 MiB buffer: " << bigBuffer.size() * 8 / bigSeconds / 1e9 << " GB/s" << std::endl;
+	}
 }
 
 void testAFIO()
@@ -119,6 +171,25 @@ void testAFIO()
 	std::cout << "Text read from file1.txt: " << buff << std::endl;
 }
 
+void testCloseMatchingStreams()
+{
+	auto afio = VFS::AbstractFileIO::create(8);
+	auto dir = testPath("CloseMatching");
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir + "/sub");
+
+	char byte = 0;
+	for (auto& name : { "/file", "/file.tmp", "/sub/file", "/sub.tmp" })
+	{
+		afio->make(dir + name);
+		afio->write(dir + name, &byte, 1);
+	}
+
+	std::cout << "Closed file: " << afio->closeMatchingStreams(dir + "/file") << " (Should be 1!)" << std::endl;
+	std::cout << "Closed sub: " << afio->closeMatchingStreams(dir + "/sub") << " (Should be 1!)" << std::endl;
+	std::cout << "Closed dir: " << afio->closeMatchingStreams(dir + "/") << " (Should be 2!)" << std::endl;
+}
+
 void testMapStream()
 {
 	auto afio = VFS::AbstractFileIO::create(2);
@@ -163,13 +234,1495 @@ void testMapStream()
 	std::cout << "Found key at index " << index << " with value " << retrievedValue << std::endl;
 }
 
-int main()
+void testWriteAheadLog()
 {
-	//compareInputStrings();
+	auto afio = VFS::AbstractFileIO::create(2);
+	auto msPath = testPath("WriteAheadLogTest.msf");
+	auto walPath = msPath + ".wal";
+	uint64_t keySize = sizeof(uint64_t);
+	uint64_t valSize = sizeof(uint64_t);
 
-	//scanDrivePathsAndCompare();
+	afio->remove(msPath);
+	afio->remove(walPath);
 
-	//testAFIO();
+	{
+		auto wal = VFS::WriteAheadLog::create(walPath, afio);
+		VFS::MapStream ms(msPath, afio, keySize, valSize, wal);
+
+		for (uint64_t key = 0; key < 1000; ++key)
+		{
+			uint64_t value = key * key;
+			ms.insert(&key, &value);
+		}
+		for (uint64_t key = 0; key < 1000; key += 6)
+			ms.erase(&key);
+		ms.optimize(); // Checkpoints the log and replaces the file with the merged copy
+
+		// Snapshot the optimized map as the state before the 'crash'
+		afio->sync(msPath);
+		std::filesystem::copy_file(msPath, msPath + ".before", std::filesystem::copy_options::overwrite_existing);
+
+		for (uint64_t key = 1000; key < 2000; ++key)
+		{
+			uint64_t value = key * key;
+			ms.insert(&key, &value);
+		}
+		for (uint64_t key = 1002; key < 2000; key += 6)
+			ms.erase(&key);
+		ms.flush();
+
+		// Keep the log as it would be found after a crash, plus a torn record at its end
+		std::filesystem::copy_file(walPath, walPath + ".crashed", std::filesystem::copy_options::overwrite_existing);
+		std::ofstream(walPath + ".crashed", std::ios::binary | std::ios::app) << "torn record";
+	}
+
+	afio->closeMatchingStreams(msPath);
+	std::filesystem::copy_file(msPath + ".before", msPath, std::filesystem::copy_options::overwrite_existing);
+	std::filesystem::copy_file(walPath + ".crashed", walPath, std::filesystem::copy_options::overwrite_existing);
+
+	auto wal = VFS::WriteAheadLog::create(walPath, afio);
+	VFS::MapStream ms(msPath, afio, keySize, valSize, wal);
+
+	std::cout << "Replayed " << wal->getStats().nReplayed << " transactions." << std::endl;
+
+	uint64_t nFoundErased = 0;
+	uint64_t nFoundNotErased = 0;
+	uint64_t nWrongValues = 0;
+	for (uint64_t key = 0; key < 2000; ++key)
+	{
+		uint64_t index = ms.find(&key);
+		if (index == -1)
+			continue;
+
+		++*((key % 6 == 0) ? &nFoundErased : &nFoundNotErased);
+
+		uint64_t value;
+		ms.getValue(index, &value);
+		if (value != key * key)
+			++nWrongValues;
+	}
+
+	std::cout << "Found " << nFoundErased << " deleted keys. (Should be 0!)" << std::endl;
+	std::cout << "Found " << nFoundNotErased << " non-deleted keys. (Should be 1666!)" << std::endl;
+	std::cout << "Found " << nWrongValues << " wrong values. (Should be 0!)" << std::endl;
+	std::cout << "Optimization after replay: " << ms.currOptimization() << " (Should be 0.5!)" << std::endl;
+
+	// A log that cannot be synced rejects the transaction, the target file stays untouched
+	if (std::filesystem::exists("/dev/full"))
+	{
+		auto fullPath = testPath("WriteAheadLogFull.wal");
+		auto targetPath = testPath("WriteAheadLogFull.bin");
+		std::filesystem::remove(fullPath);
+		std::filesystem::create_symlink("/dev/full", fullPath);
+		afio->make(targetPath);
+
+		bool isCommitted;
+		{
+			auto fullWal = VFS::WriteAheadLog::create(fullPath, afio);
+			VFS::WriteAheadLog::Transaction txn;
+			uint64_t value = 42;
+			txn.write(targetPath, &value, sizeof(value), 0);
+			isCommitted = fullWal->commit(txn);
+		}
+		std::filesystem::remove(fullPath);
+
+		std::cout << "Committed to full log: " << isCommitted << " (Should be 0!), target size: "
+			<< std::filesystem::file_size(targetPath) << " (Should be 0!)" << std::endl;
+	}
+
+	// A garbage size in a torn tail ends the replay, it is not allocated
+	{
+		auto garbagePath = testPath("WriteAheadLogGarbage.wal");
+		uint64_t garbage[2] = { 0x7fffffffffffull, 0 };
+		std::ofstream(garbagePath, std::ios::binary | std::ios::trunc).write((const char*)garbage, sizeof(garbage));
+		auto garbageWal = VFS::WriteAheadLog::create(garbagePath, afio);
+		std::cout << "Replayed from garbage log: " << garbageWal->getStats().nReplayed << " (Should be 0!)" << std::endl;
+	}
+
+	// A log that cannot be created fails every commit
+	{
+		auto missingWal = VFS::WriteAheadLog::create(testPath("missing/dir/WriteAheadLog.wal"), afio);
+		VFS::WriteAheadLog::Transaction txn;
+		uint64_t value = 42;
+		txn.write(testPath("WriteAheadLogFull.bin"), &value, sizeof(value), 0);
+		std::cout << "Committed without log file: " << missingWal->commit(txn) << " (Should be 0!)" << std::endl;
+
+		// The map keeps the counts of the file when its commits fail
+		auto failedPath = testPath("WriteAheadLogFailed.msf");
+		afio->remove(failedPath);
+		VFS::MapStream failed(failedPath, afio, keySize, valSize, missingWal);
+		uint64_t key = 1;
+		bool isInserted = failed.insert(&key, &key);
+		std::cout << "Inserted without log file: " << isInserted << " (Should be 0!), count: " << failed.count()
+			<< " (Should be 0!), found: " << (failed.find(&key) != -1) << " (Should be 0!)" << std::endl;
+	}
+}
+
+void benchWriteAheadLog()
+{
+	constexpr uint64_t nThreads = 8;
+	constexpr uint64_t nCommitsPerThread = 250;
+
+	auto afio = VFS::AbstractFileIO::create(nThreads);
+
+	for (uint64_t windowUs : { 0, 50, 200, 1000, 5000 })
+	{
+		auto walPath = testPath("WriteAheadLogBench.wal");
+		auto wal = VFS::WriteAheadLog::create(walPath, afio, windowUs);
+
+		std::vector<std::string> paths;
+		for (uint64_t i = 0; i < nThreads; ++i)
+		{
+			paths.push_back(testPath("WriteAheadLogBench" + std::to_string(i) + ".bin"));
+			afio->make(paths.back());
+		}
+
+		auto begin = std::chrono::steady_clock::now();
+
+		std::vector<std::thread> threads;
+		for (uint64_t i = 0; i < nThreads; ++i)
+		{
+			threads.emplace_back([&wal, &paths, i]()
+				{
+					VFS::WriteAheadLog::Transaction txn;
+					for (uint64_t j = 0; j < nCommitsPerThread; ++j)
+					{
+						txn.write(paths[i], &j, sizeof(j), j * sizeof(j));
+						wal->commit(txn);
+					}
+				}
+			);
+		}
+		for (auto& thread : threads)
+			thread.join();
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		auto stats = wal->getStats();
+
+		std::cout << "Window " << windowUs << "us: "
+			<< (uint64_t)(stats.nCommits / seconds) << " commits/s, "
+			<< (double)stats.nCommits / stats.nSyncs << " commits/sync" << std::endl;
+	}
+}
+
+void stressConcurrentMapStream()
+{
+	constexpr uint64_t nKeys = 20000;
+	constexpr auto duration = std::chrono::milliseconds(500);
+
+	auto afio = VFS::AbstractFileIO::create(2);
+	auto msPath = testPath("ConcurrentMapStreamTest.msf");
+	uint64_t keySize = sizeof(uint64_t);
+	uint64_t valSize = sizeof(uint64_t);
+
+	afio->remove(msPath);
+	VFS::ConcurrentMapStream ms(msPath, afio, keySize, valSize);
+
+	for (uint64_t key = 0; key < nKeys; ++key)
+	{
+		uint64_t value = key * key;
+		ms.insert(&key, &value);
+		if (key % 2000 == 1999)
+			ms.optimize();
+	}
+
+	uint64_t nMaxThreads = std::max(2u, std::thread::hardware_concurrency());
+	for (uint64_t nThreads = 1; nThreads <= nMaxThreads; nThreads *= 2)
+	{
+		std::atomic<bool> stop = false;
+		std::atomic<uint64_t> nReads = 0;
+		std::atomic<uint64_t> nWrongValues = 0;
+
+		// The writer keeps erasing, re-inserting and optimizing the upper half of the keys
+		std::thread writer([&]()
+			{
+				for (uint64_t key = nKeys / 2; !stop; ++key)
+				{
+					uint64_t k = nKeys / 2 + key % (nKeys / 2);
+					uint64_t value = k * k;
+					ms.erase(&k);
+					ms.insert(&k, &value);
+					if (key % 500 == 0)
+						ms.optimize();
+				}
+			}
+		);
+
+		std::vector<std::thread> readers;
+		for (uint64_t i = 0; i < nThreads; ++i)
+		{
+			readers.emplace_back([&, i]()
+				{
+					uint64_t n = 0;
+					uint64_t key = i;
+					while (!stop)
+					{
+						key = (key * 6364136223846793005ull + 1442695040888963407ull);
+						uint64_t k = key % (nKeys / 2);
+						uint64_t value;
+						if (!ms.get(&k, &value) || value != k * k)
+							++nWrongValues;
+						++n;
+					}
+					nReads += n;
+				}
+			);
+		}
+
+		std::this_thread::sleep_for(duration);
+		stop = true;
+		for (auto& reader : readers)
+			reader.join();
+		writer.join();
+
+		std::cout << nThreads << " reader(s): "
+			<< (uint64_t)(nReads / std::chrono::duration<double>(duration).count()) << " reads/s, "
+			<< nWrongValues << " wrong values (Should be 0!)" << std::endl;
+	}
+}
+
+void testShardedMapStream()
+{
+	constexpr uint64_t nKeys = 20000;
+	constexpr uint64_t batchSize = 1000;
+
+	for (uint64_t nShards : { 1, 2, 4, 8 })
+	{
+		auto afio = VFS::AbstractFileIO::create(nShards);
+		auto msPath = testPath("ShardedMapStreamTest.msf");
+		uint64_t keySize = sizeof(uint64_t);
+		uint64_t valSize = sizeof(uint64_t);
+
+		for (uint64_t i = 0; i < nShards; ++i)
+			afio->remove(msPath + "." + std::to_string(i));
+
+		VFS::ShardedMapStream ms(msPath, afio, nShards, keySize, valSize);
+
+		std::vector<uint64_t> keys(batchSize);
+		std::vector<uint64_t> values(batchSize);
+
+		auto begin = std::chrono::steady_clock::now();
+		for (uint64_t batch = 0; batch < nKeys / batchSize; ++batch)
+		{
+			for (uint64_t i = 0; i < batchSize; ++i)
+			{
+				keys[i] = batch * batchSize + i;
+				values[i] = keys[i] * keys[i];
+			}
+			ms.insert(keys.data(), values.data(), batchSize);
+			ms.optimize();
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+		for (uint64_t key = 0; key < nKeys; key += 6)
+			ms.erase(&key);
+		ms.optimize();
+
+		uint64_t nFoundErased = 0;
+		uint64_t nFoundNotErased = 0;
+		uint64_t nWrongValues = 0;
+		std::vector<uint64_t> indices(batchSize);
+		for (uint64_t batch = 0; batch < nKeys / batchSize; ++batch)
+		{
+			for (uint64_t i = 0; i < batchSize; ++i)
+				keys[i] = batch * batchSize + i;
+			ms.find(keys.data(), indices.data(), batchSize);
+
+			for (uint64_t i = 0; i < batchSize; ++i)
+			{
+				if (indices[i] == -1)
+					continue;
+
+				++*((keys[i] % 6 == 0) ? &nFoundErased : &nFoundNotErased);
+
+				uint64_t value;
+				ms.getValue(indices[i], &value);
+				if (value != keys[i] * keys[i])
+					++nWrongValues;
+			}
+		}
+
+		std::cout << nShards << " shard(s): ingest " << (uint64_t)(nKeys / seconds) << " keys/s, found "
+			<< nFoundErased << " deleted keys (Should be 0!), "
+			<< nFoundNotErased << " non-deleted keys (Should be " << nKeys - (nKeys + 5) / 6 << "!), "
+			<< nWrongValues << " wrong values (Should be 0!)" << std::endl;
+	}
+}
+
+void testMapStreamValueView()
+{
+	constexpr uint64_t nKeys = 2000;
+	constexpr uint64_t nLookups = 200000;
+
+	auto afio = VFS::AbstractFileIO::create(2);
+	auto msPath = testPath("MapStreamValueViewTest.msf");
+	uint64_t keySize = sizeof(uint64_t);
+	uint64_t valSize = 4096;
+
+	afio->remove(msPath);
+	VFS::MapStream ms(msPath, afio, keySize, valSize);
+
+	std::vector<char> value(valSize);
+	for (uint64_t key = 0; key < nKeys; ++key)
+	{
+		memset(value.data(), (int)(key % 251), valSize);
+		ms.insert(&key, value.data());
+		if (key % 500 == 499)
+			ms.optimize();
+	}
+	ms.optimize();
+
+	std::vector<uint64_t> indices(nKeys);
+	for (uint64_t key = 0; key < nKeys; ++key)
+		indices[key] = ms.find(&key);
+
+	uint64_t nMismatches = 0;
+	for (uint64_t key = 0; key < nKeys; ++key)
+	{
+		ms.getValue(indices[key], value.data());
+		auto view = ms.getValueView(indices[key]);
+		if (!view || view.size() != valSize || memcmp(view.data(), value.data(), valSize) != 0)
+			++nMismatches;
+	}
+	std::cout << "Found " << nMismatches << " mismatching views. (Should be 0!)" << std::endl;
+
+	uint64_t checksum = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < nLookups; ++i)
+	{
+		ms.getValue(indices[i % nKeys], value.data());
+		checksum += value[i % valSize];
+	}
+	double secondsCopy = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	begin = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < nLookups; ++i)
+	{
+		auto view = ms.getValueView(indices[i % nKeys]);
+		checksum -= ((const char*)view.data())[i % valSize];
+	}
+	double secondsView = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	std::cout << "getValue: " << (uint64_t)(nLookups / secondsCopy) << " values/s, getValueView: "
+		<< (uint64_t)(nLookups / secondsView) << " values/s (checksum " << checksum << ", should be 0)" << std::endl;
+}
+
+void testMapStreamAllocations()
+{
+	constexpr uint64_t nKeys = 2000;
+	constexpr uint64_t nLookups = 100000;
+
+	auto afio = VFS::AbstractFileIO::create(2);
+	auto msPath = testPath("MapStreamAllocationTest.msf");
+	uint64_t keySize = sizeof(uint64_t);
+	uint64_t valSize = sizeof(uint64_t);
+
+	afio->remove(msPath);
+	VFS::MapStream ms(msPath, afio, keySize, valSize);
+
+	// Leave some keys in the unsorted region so both lookup paths are used
+	for (uint64_t key = 0; key < nKeys; ++key)
+	{
+		uint64_t value = key * key;
+		ms.insert(&key, &value);
+		if (key == nKeys - 100)
+			ms.optimize();
+	}
+
+	// Warm up the per-thread buffer cache
+	uint64_t warmUpKey = nKeys;
+	ms.find(&warmUpKey);
+
+	uint64_t nWrongValues = 0;
+	uint64_t nAllocationsBefore = g_nAllocations;
+	for (uint64_t i = 0; i < nLookups; ++i)
+	{
+		uint64_t key = (i * 7919) % nKeys;
+		uint64_t value = 0;
+		ms.getValue(ms.find(&key), &value);
+		if (value != key * key)
+			++nWrongValues;
+	}
+	uint64_t nAllocations = g_nAllocations - nAllocationsBefore;
+
+	std::cout << "Found " << nWrongValues << " wrong values. (Should be 0!)" << std::endl;
+	std::cout << "Heap allocations during " << nLookups << " lookups: " << nAllocations << " (Should be 0!)" << std::endl;
+}
+
+void benchMapStreamBuilder()
+{
+	constexpr uint64_t nKeys = 1000000;
+
+	// Big-endian keys sort in numeric order
+	auto makeKey = [](uint64_t n)
+	{
+		uint64_t key = 0;
+		for (uint64_t i = 0; i < sizeof(key); ++i)
+			((unsigned char*)&key)[i] = (unsigned char)(n >> (8 * (sizeof(key) - 1 - i)));
+		return key;
+	};
+
+	auto afio = VFS::AbstractFileIO::create(4);
+	uint64_t keySize = sizeof(uint64_t);
+	uint64_t valSize = sizeof(uint64_t);
+
+	auto verify = [&](const std::string& path, const char* name, double seconds)
+	{
+		VFS::MapStream ms(path, afio, keySize, valSize);
+
+		uint64_t nWrong = 0;
+		for (uint64_t n = 0; n < nKeys; n += 997)
+		{
+			uint64_t key = makeKey(n);
+			uint64_t index = ms.find(&key);
+			uint64_t value = 0;
+			if (index != -1)
+				ms.getValue(index, &value);
+			if (value != n * n)
+				++nWrong;
+		}
+
+		std::cout << name << ": " << (uint64_t)(nKeys / seconds) << " records/s, "
+			<< (uint64_t)(nKeys * (keySize + valSize) / seconds / (1 << 20)) << " MiB/s, "
+			<< "optimization " << ms.currOptimization() << " (Should be 1!), "
+			<< nWrong << " wrong lookups (Should be 0!)" << std::endl;
+	};
+
+	{
+		auto path = testPath("MapStreamBuilderPresorted.msf");
+		auto begin = std::chrono::steady_clock::now();
+		{
+			VFS::MapStreamBuilder builder(path, afio, keySize, valSize);
+			for (uint64_t n = 0; n < nKeys; ++n)
+			{
+				uint64_t key = makeKey(n);
+				uint64_t value = n * n;
+				builder.add(&key, &value);
+			}
+
+			uint64_t key = makeKey(0);
+			uint64_t value = 0;
+			if (builder.add(&key, &value) != VFS::MapStreamBuilder::ErrCode::KeyOrderViolation)
+				std::cout << "Out of order key was not rejected!" << std::endl;
+		}
+		verify(path, "Presorted", std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+	}
+
+	{
+		auto path = testPath("MapStreamBuilderUnsorted.msf");
+		auto begin = std::chrono::steady_clock::now();
+		{
+			// A small budget forces several spilled runs
+			VFS::MapStreamBuilder builder(path, afio, keySize, valSize, VFS::MapStreamBuilder::Mode::Unsorted, 4 << 20);
+			for (uint64_t i = 0; i < nKeys; ++i)
+			{
+				uint64_t n = (i * 7919) % nKeys;
+				uint64_t key = makeKey(n);
+				uint64_t value = n * n;
+				builder.add(&key, &value);
+			}
+
+			// Duplicates added later are dropped
+			uint64_t key = makeKey(42);
+			uint64_t value = 0;
+			builder.add(&key, &value);
+		}
+		verify(path, "Unsorted", std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+	}
+}
+
+void testMapStreamUpsert()
+{
+	constexpr uint64_t nKeys = 2000;
+
+	auto afio = VFS::AbstractFileIO::create(2);
+	auto msPath = testPath("MapStreamUpsertTest.msf");
+	auto walPath = msPath + ".wal";
+	uint64_t keySize = sizeof(uint64_t);
+	uint64_t valSize = sizeof(uint64_t);
+
+	afio->remove(msPath);
+	auto wal = VFS::WriteAheadLog::create(walPath, afio);
+	VFS::MapStream ms(msPath, afio, keySize, valSize, wal);
+
+	// Half of the keys end up in the sorted region, the other half stays unsorted
+	for (uint64_t key = 0; key < nKeys; ++key)
+	{
+		uint64_t value = key;
+		ms.insert(&key, &value);
+		if (key == nKeys / 2)
+			ms.optimize();
+	}
+
+	for (uint64_t key = 0; key < nKeys; key += 2)
+	{
+		uint64_t value = key * 2;
+		ms.update(&key, &value);
+	}
+
+	uint64_t missingKey = nKeys;
+	uint64_t missingValue = 0;
+	bool updatedMissing = ms.update(&missingKey, &missingValue);
+
+	// Batched upsert over existing and new keys, with a repeated key where the last value wins
+	std::vector<uint64_t> keys, values;
+	for (uint64_t key = 1; key < nKeys + 100; key += 2)
+	{
+		keys.push_back(key);
+		values.push_back(key * 3);
+	}
+	keys.push_back(1);
+	values.push_back(42);
+	ms.upsert(keys.data(), values.data(), keys.size());
+
+	auto expected = [](uint64_t key) { return key == 1 ? 42 : (key % 2 == 0 ? key * 2 : key * 3); };
+
+	uint64_t nWrong = 0;
+	for (uint64_t key = 0; key < nKeys + 100; ++key)
+	{
+		uint64_t index = ms.find(&key);
+		uint64_t value = -1;
+		if (index != -1)
+			ms.getValue(index, &value);
+		if ((key < nKeys || key % 2 == 1) && value != expected(key))
+			++nWrong;
+	}
+
+	std::cout << "Found " << nWrong << " wrong values. (Should be 0!)" << std::endl;
+	std::cout << "Updated missing key: " << updatedMissing << " (Should be 0!)" << std::endl;
+	std::cout << "Optimization: " << ms.currOptimization() << " (Updated keys stay in their region)" << std::endl;
+}
+
+void benchValueCache()
+{
+	constexpr uint64_t nKeys = 200000;
+	constexpr uint64_t nHotKeys = nKeys / 100;
+	constexpr uint64_t nLookups = 1000000;
+
+	auto afio = VFS::AbstractFileIO::create(2);
+	auto path = testPath("ValueCacheBench.msf");
+	uint64_t keySize = sizeof(uint64_t);
+	uint64_t valSize = 64;
+
+	{
+		VFS::MapStreamBuilder builder(path, afio, keySize, valSize, VFS::MapStreamBuilder::Mode::Unsorted);
+		std::vector<char> value(valSize);
+		for (uint64_t key = 0; key < nKeys; ++key)
+		{
+			memcpy(value.data(), &key, sizeof(key));
+			builder.add(&key, value.data());
+		}
+	}
+
+	VFS::MapStream ms(path, afio, keySize, valSize);
+
+	// 90% of the lookups go to 1% of the keys, every 64th lookup is part of a scan over all keys
+	auto run = [&](const char* name)
+	{
+		std::vector<char> value(valSize);
+		uint64_t nWrong = 0;
+		uint64_t scanKey = 0;
+		uint64_t rnd = 88172645463325252ull;
+		auto begin = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < nLookups; ++i)
+		{
+			rnd ^= rnd << 13; rnd ^= rnd >> 7; rnd ^= rnd << 17;
+
+			uint64_t key;
+			if (i % 64 == 0)
+				key = scanKey++ % nKeys;
+			else if (rnd % 10 != 0)
+				key = (rnd >> 8) % nHotKeys * 100;
+			else
+				key = (rnd >> 8) % nKeys;
+
+			if (!ms.get(&key, value.data()) || memcmp(value.data(), &key, sizeof(key)) != 0)
+				++nWrong;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+		auto stats = ms.getCacheStats();
+		std::cout << name << ": " << (uint64_t)(nLookups / seconds) << " lookups/s, hit ratio " << stats.hitRatio()
+			<< ", " << stats.nEvictions << " evictions, " << (stats.nBytes >> 10) << " KiB cached, "
+			<< nWrong << " wrong values (Should be 0!)" << std::endl;
+	};
+
+	run("Uncached");
+
+	ms.enableCache(1 << 20);
+	run("Cached (1 MiB)");
+
+	// Changing a value must not leave the old one in the cache
+	uint64_t key = 0;
+	std::vector<char> value(valSize, 0x55);
+	ms.update(&key, value.data());
+	std::vector<char> readBack(valSize);
+	ms.get(&key, readBack.data());
+	std::cout << "Stale value after update: " << (readBack != value) << " (Should be 0!)" << std::endl;
+}
+
+void testDirectoryIndex()
+{
+	constexpr uint64_t nBigDirEntries = 100000;
+	constexpr uint64_t nSmallDirs = 10;
+	constexpr uint64_t nSmallDirEntries = 1000;
+
+	auto afio = VFS::AbstractFileIO::create(2);
+	auto path = testPath("DirectoryIndexTest.msf");
+
+	auto begin = std::chrono::steady_clock::now();
+	uint64_t nAdded = 0;
+	{
+		VFS::DirectoryIndex::Builder builder(path, afio);
+		auto add = [&](const std::string& p, VFS::DirectoryIndex::EntryType type, uint64_t size)
+		{
+			nAdded += builder.add(VFS::HashPath(p), type, size);
+		};
+
+		add("big", VFS::DirectoryIndex::EntryType::Directory, 0);
+		for (uint64_t i = 0; i < nBigDirEntries; ++i)
+			add("big/file" + std::to_string(i), VFS::DirectoryIndex::EntryType::File, i);
+		for (uint64_t d = 0; d < nSmallDirs; ++d)
+		{
+			add("small" + std::to_string(d), VFS::DirectoryIndex::EntryType::Directory, 0);
+			for (uint64_t i = 0; i < nSmallDirEntries; ++i)
+				add("small" + std::to_string(d) + "/file" + std::to_string(i), VFS::DirectoryIndex::EntryType::File, i);
+		}
+		builder.finish();
+	}
+	double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	VFS::DirectoryIndex index(path, afio);
+
+	begin = std::chrono::steady_clock::now();
+	uint64_t nWrong = 0;
+	uint64_t nListed = index.list(VFS::HashPath("big"), [&](const VFS::DirectoryIndex::Entry& entry)
+		{
+			if (entry.type != VFS::DirectoryIndex::EntryType::File || entry.name != "file" + std::to_string(entry.size))
+				++nWrong;
+			return true;
+		}
+	);
+	double listSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	std::cout << "Built index of " << nAdded << " entries in " << buildSeconds << "s" << std::endl;
+	std::cout << "Listed " << nListed << " entries (Should be " << nBigDirEntries << "!) in " << listSeconds * 1000 << "ms, "
+		<< nWrong << " wrong entries (Should be 0!)" << std::endl;
+	std::cout << "Root entries: " << index.list(VFS::HashPath()).size() << " (Should be " << nSmallDirs + 1 << "!)" << std::endl;
+
+	// Changes end up in the unsorted tail until the next optimize
+	index.remove(VFS::HashPath("small3/file7"));
+	index.add(VFS::HashPath("small3/extra"), VFS::DirectoryIndex::EntryType::File, 1);
+	VFS::DirectoryIndex::Entry entry;
+	std::cout << "Entries in small3: " << index.list(VFS::HashPath("small3")).size() << " (Should be " << nSmallDirEntries << "!)" << std::endl;
+	std::cout << "Removed entry found: " << index.stat(VFS::HashPath("small3/file7"), entry) << " (Should be 0!)" << std::endl;
+	std::cout << "Added entry found: " << index.stat(VFS::HashPath("small3/extra"), entry) << " (Should be 1!)" << std::endl;
+}
+
+void testHashPath()
+{
+	VFS::HashPath a("a");
+	VFS::HashPath ab("a/b");
+	VFS::HashPath abc = ab + VFS::HashPath::Element("c");
+
+	std::cout << "a == a/b: " << (a == ab) << " (Should be 0!)" << std::endl;
+	std::cout << "a/b == a/b/c/..: " << (ab == abc + VFS::HashPath::Element("..")) << " (Should be 1!)" << std::endl;
+	std::cout << "a/b == (a/b/c - 1): " << (ab == abc - 1) << " (Should be 1!)" << std::endl;
+	std::cout << "a/b hash == a/b/c prefix hash: " << (ab.hash() == abc.hash(2)) << " (Should be 1!)" << std::endl;
+	std::cout << "a/b == b/a: " << (ab == VFS::HashPath("b/a")) << " (Should be 0!)" << std::endl;
+	auto isAB = [&](VFS::HashPathRef path) { return path == ab; };
+	std::cout << "Converted from std::string: " << isAB(std::string("a/b")) << " (Should be 1!)" << std::endl;
+
+	constexpr uint64_t nPaths = 100000;
+	std::vector<VFS::HashPath> paths;
+	for (uint64_t i = 0; i < nPaths; ++i)
+		paths.push_back(VFS::HashPath("usr/share/doc/package" + std::to_string(i % 1000) + "/deeply/nested/file" + std::to_string(i)));
+
+	std::unordered_map<VFS::HashPath, uint64_t> pathMap;
+	for (uint64_t i = 0; i < nPaths; ++i)
+		pathMap[paths[i]] = i;
+
+	uint64_t nWrong = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < nPaths; ++i)
+	{
+		auto it = pathMap.find(paths[i]);
+		if (it == pathMap.end() || it->second != i)
+			++nWrong;
+		if (paths[i] == paths[(i + 1) % nPaths])
+			++nWrong;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	std::cout << "Looked up " << nPaths << " paths in " << seconds * 1000 << "ms, " << nWrong << " wrong results (Should be 0!)" << std::endl;
+}
+
+void testHashPathAllocations()
+{
+	constexpr uint64_t nIterations = 100000;
+
+	VFS::HashPath base("home/user/projects/vfs/include");
+	VFS::HashPath::Element file("VFSHashPath.h");
+	VFS::HashPath::Element stepOut("..");
+	std::unordered_map<VFS::HashPath, uint64_t> seen;
+	seen[base.child(file)] = 0;
+
+	std::cout << "sizeof(HashPath::Element): " << sizeof(VFS::HashPath::Element) << " (Should be 8!)" << std::endl;
+
+	uint64_t nWrong = 0;
+	uint64_t nAllocationsBefore = g_nAllocations;
+	for (uint64_t i = 0; i < nIterations; ++i)
+	{
+		VFS::HashPath path = base.parent().child(file);
+		path += stepOut;
+		path -= 1;
+		path = path + base[base.depth() - 2] + base[base.depth() - 1] + file;
+
+		if (path != base.child(file) || seen.count(path) != 1)
+			++nWrong;
+
+		// Names that are already interned do not allocate
+		if (VFS::HashPath::Element("VFSHashPath.h") != file)
+			++nWrong;
+	}
+	uint64_t nAllocations = g_nAllocations - nAllocationsBefore;
+
+	std::cout << "Found " << nWrong << " wrong paths. (Should be 0!)" << std::endl;
+	std::cout << "Heap allocations during " << nIterations << " iterations: " << nAllocations << " (Should be 0!)" << std::endl;
+	std::cout << "Interned strings: " << VFS::StringPool::size() << std::endl;
+}
+
+void benchHashPathParsing(const std::string& rootPath = "/usr")
+{
+	constexpr uint64_t nMinPaths = 4000000;
+
+	auto expectEqual = [](const std::string& left, const std::string& right)
+	{
+		if (VFS::HashPath(left) != VFS::HashPath(right))
+			std::cout << "  '" << left << "' and '" << right << "' differ!" << std::endl;
+	};
+	expectEqual("/a//b\\c/./d/../e/", "a/b/c/e");
+	expectEqual("\\\\server\\share\\dir", "server/share/dir");
+	expectEqual("a/b/../../c", "c");
+	expectEqual(".", "");
+	std::cout << "Elements of '/usr/lib': '" << VFS::HashPath("/usr/lib")[0].asString() << "', '" << VFS::HashPath("/usr/lib")[1].asString() << "'" << std::endl;
+
+	std::vector<std::string> paths;
+	std::error_code ec;
+	auto it = std::filesystem::recursive_directory_iterator(rootPath, std::filesystem::directory_options::skip_permission_denied, ec);
+	for (; !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec))
+		paths.push_back(it->path().u8string());
+	if (paths.empty())
+		return;
+
+	uint64_t nBytes = 0;
+	for (auto& path : paths)
+		nBytes += path.size();
+
+	// Intern every name once, the timed passes measure the steady state
+	for (auto& path : paths)
+		VFS::HashPath warmUp(path);
+
+	uint64_t nRounds = (nMinPaths + paths.size() - 1) / paths.size();
+	uint64_t depthSum = 0;
+	uint64_t nAllocationsBefore = g_nAllocations;
+	auto begin = std::chrono::steady_clock::now();
+	for (uint64_t round = 0; round < nRounds; ++round)
+		for (auto& path : paths)
+			depthSum += VFS::HashPath(path).depth();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	uint64_t nAllocations = g_nAllocations - nAllocationsBefore;
+
+	uint64_t nParsed = nRounds * paths.size();
+	std::cout << "Parsed " << nParsed << " paths (" << paths.size() << " distinct from '" << rootPath << "', avg depth "
+		<< depthSum / (double)nParsed << ") in " << seconds << "s: " << (uint64_t)(nParsed / seconds) << " paths/s, "
+		<< nRounds * nBytes / seconds / (1 << 20) << " MiB/s, " << nAllocations / (double)nParsed << " allocations per path" << std::endl;
+}
+
+void testStaticHashPath()
+{
+	using namespace VFS::Literals;
+
+	constexpr auto configRoot = "/etc/vfs/./config/"_hashpath;
+	static_assert(configRoot.depth() == 3, "Tokenized at compile time");
+	static_assert(configRoot.hash() == "etc\\vfs\\cache\\..\\config"_pathhash, "Hashed at compile time");
+
+	std::cout << "Matches runtime HashPath: " << configRoot.matches(VFS::HashPath("etc/vfs/config")) << " (Should be 1!)" << std::endl;
+	std::cout << "Round trip: " << (configRoot.toHashPath() == VFS::HashPath("etc/vfs/config")) << " (Should be 1!)" << std::endl;
+
+	auto classify = [](const VFS::HashPath& path)
+	{
+		switch (path.hash())
+		{
+		case "etc/vfs/config"_pathhash: return "config";
+		case "var/cache/vfs"_pathhash: return "cache";
+		default: return "other";
+		}
+	};
+	std::cout << "Switch: " << classify(VFS::HashPath("/var/cache/vfs")) << " (Should be cache!), "
+		<< classify(VFS::HashPath("/var/cache")) << " (Should be other!)" << std::endl;
+}
+
+void testArchiveFileSystem()
+{
+	auto afio = VFS::AbstractFileIO::create(4);
+	auto path = testPath("ArchiveTest.vfa");
+	for (auto ext : { "", ".paths", ".dirs" })
+		std::filesystem::remove(path + ext);
+
+	std::vector<char> data(100000);
+	for (uint64_t i = 0; i < data.size(); ++i)
+		data[i] = (char)(i * 31);
+
+	uint64_t sizeBeforeReuse = 0;
+	std::vector<char> buffer(data.size());
+	{
+		VFS::ArchiveFileSystem fs(path, afio);
+		fs.createDirectory(VFS::HashPath("docs"));
+		std::cout << "Create in missing dir: " << (int)fs.createFile(VFS::HashPath("missing/a.txt")) << " (Should be " << (int)VFS::ErrCode::PathNotFound << "!)" << std::endl;
+		std::cout << "Create twice: " << (int)fs.createDirectory(VFS::HashPath("docs")) << " (Should be " << (int)VFS::ErrCode::AlreadyExists << "!)" << std::endl;
+
+		for (uint64_t i = 0; i < 10; ++i)
+		{
+			VFS::HashPath file("docs/file" + std::to_string(i) + ".bin");
+			fs.createFile(file);
+			auto handle = fs.getFileHandle(file);
+			handle.writeFile(data.data(), 1000 * (i + 1));
+		}
+
+		auto handle = fs.getFileHandle(VFS::HashPath("docs/file0.bin"));
+		handle.resizeFile(data.size());
+		handle.writeFile(data.data() + 1000, data.size() - 1000, 1000);
+
+		std::cout << "Delete non-empty dir: " << (int)fs.deleteDirectory(VFS::HashPath("docs")) << " (Should be " << (int)VFS::ErrCode::DirectoryNotEmpty << "!)" << std::endl;
+
+		for (uint64_t i = 5; i < 10; ++i)
+			fs.deleteFile(VFS::HashPath("docs/file" + std::to_string(i) + ".bin"));
+		sizeBeforeReuse = fs.containerSize();
+		for (uint64_t i = 5; i < 10; ++i)
+		{
+			VFS::HashPath file("docs/new" + std::to_string(i) + ".bin");
+			fs.createFile(file);
+			fs.writeFile(file, data.data(), 1000 * (i + 1), 0);
+		}
+		std::cout << "Container grew by " << fs.containerSize() - sizeBeforeReuse << " bytes (Should be 0!)" << std::endl;
+
+		// The handle must not write to the extent the file had when it was opened
+		VFS::HashPath moved("docs/file1.bin");
+		auto stale = fs.getFileHandle(moved);
+		stale.writeFile(data.data(), 10);
+		fs.resizeFile(moved, data.size());
+		VFS::HashPath reused("docs/reused.bin");
+		fs.createFile(reused);
+		fs.writeFile(reused, data.data(), 2000, 0);
+		stale.writeFile(data.data() + 1, 10);
+		fs.readFile(reused, buffer.data(), 2000, 0);
+		std::cout << "Reused extent intact: " << (memcmp(buffer.data(), data.data(), 2000) == 0) << " (Should be 1!)" << std::endl;
+		stale.writeFile(data.data(), 10);
+		fs.resizeFile(moved, 2000);
+		fs.deleteFile(reused);
+	}
+
+	VFS::ArchiveFileSystem fs(path, afio);
+	std::vector<VFS::FileSystem::Entry> entries;
+	fs.listDirectory(VFS::HashPath("docs"), entries);
+	std::cout << "Listed " << entries.size() << " entries (Should be 10!)" << std::endl;
+
+	uint64_t nWrong = 0;
+	for (auto& entry : entries)
+	{
+		auto handle = fs.getFileHandle(VFS::HashPath("docs/" + entry.name));
+		uint64_t size = 0;
+		handle.getFileSize(size);
+		if (size != entry.size || handle.readFile(buffer.data(), size) != VFS::ErrCode::Success || memcmp(buffer.data(), data.data(), size) != 0)
+			++nWrong;
+	}
+	std::cout << "Files with wrong content: " << nWrong << " (Should be 0!)" << std::endl;
+	std::cout << "Read past end: " << (int)fs.readFile(VFS::HashPath("docs/file1.bin"), buffer.data(), 2001, 0) << " (Should be " << (int)VFS::ErrCode::EndOfFile << "!)" << std::endl;
+
+	auto garbagePath = testPath("ArchiveGarbage.vfa");
+	for (auto ext : { "", ".paths", ".dirs" })
+		std::filesystem::remove(garbagePath + ext);
+	afio->make(garbagePath);
+	afio->write(garbagePath, data.data(), 1000, 0);
+	VFS::ArchiveFileSystem garbage(garbagePath, afio);
+	std::cout << "Garbage archive open: " << garbage.isOpen() << " (Should be 0!), create: " << (int)garbage.createFile(VFS::HashPath("a.txt"))
+		<< " (Should be " << (int)VFS::ErrCode::IOError << "!)" << std::endl;
+}
+
+void testNativeFileSystem()
+{
+	constexpr uint64_t nFiles = 1000;
+	constexpr uint64_t nLookups = 200000;
+
+	auto basePath = testPath("NativeTest");
+	std::filesystem::remove_all(basePath);
+	std::filesystem::create_directories(basePath);
+
+	auto afio = VFS::AbstractFileIO::create(4);
+	VFS::NativeFileSystem fs(basePath, afio, 1024);
+	fs.createDirectory(VFS::HashPath("dir"));
+	std::vector<VFS::HashPath> files;
+	for (uint64_t i = 0; i < nFiles; ++i)
+	{
+		files.push_back(VFS::HashPath("dir/file" + std::to_string(i)));
+		fs.createFile(files.back());
+	}
+	fs.getFileHandle(files[0]).writeFile("hello", 5);
+
+	std::cout << "Create in missing dir: " << (int)fs.createFile(VFS::HashPath("missing/a")) << " (Should be " << (int)VFS::ErrCode::PathNotFound << "!)" << std::endl;
+	std::cout << "Trie size: " << fs.getTrie().size() << " (Should be " << nFiles + 1 << "!)" << std::endl;
+
+	auto timeLookups = [&](auto&& func)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		uint64_t nFound = 0;
+		for (uint64_t i = 0; i < nLookups; ++i)
+			nFound += func(i);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		std::cout << nFound << " found, " << nLookups / seconds / 1e6 << "M lookups/s" << std::endl;
+	};
+
+	std::vector<VFS::HashPath> missing;
+	for (uint64_t i = 0; i < 100; ++i)
+		missing.push_back(VFS::HashPath("dir2/nothing" + std::to_string(i)));
+
+	std::cout << "Handles (trie): ";
+	timeLookups([&](uint64_t i) { return (bool)fs.getFileHandle(files[i % nFiles]); });
+	std::cout << "Handles (kernel): ";
+	timeLookups([&](uint64_t i) { return std::filesystem::is_regular_file(files[i % nFiles].getRealPath(basePath)); });
+	std::cout << "Missing (negative cache): ";
+	timeLookups([&](uint64_t i) { return fs.typeOf(missing[i % missing.size()]) != VFS::FileSystem::EntryType::None; });
+	std::cout << "Missing (kernel): ";
+	timeLookups([&](uint64_t i) { return std::filesystem::exists(missing[i % missing.size()].getRealPath(basePath)); });
+
+	fs.deleteFile(files[1]);
+	std::cout << "Deleted file found: " << (fs.typeOf(files[1]) != VFS::FileSystem::EntryType::None) << " (Should be 0!)" << std::endl;
+	fs.createFile(files[1]);
+	std::cout << "Recreated file found: " << (fs.typeOf(files[1]) == VFS::FileSystem::EntryType::File) << " (Should be 1!)" << std::endl;
+
+	VFS::NativeFileSystem fresh(basePath, afio);
+	std::vector<VFS::FileSystem::Entry> entries;
+	fresh.listDirectory(VFS::HashPath("dir"), entries);
+	char buffer[5] = {};
+	fresh.readFile(files[0], buffer, 5, 0);
+	std::cout << "Listed " << entries.size() << " entries (Should be " << nFiles << "!), read '" << std::string(buffer, 5) << "' (Should be hello!)" << std::endl;
+	std::cout << "Unlisted file after listing: " << (int)fresh.typeOf(VFS::HashPath("dir/other")) << " (Should be 0!)" << std::endl;
+
+	auto outsidePath = testPath("NativeOutside.txt");
+	afio->make(outsidePath);
+	afio->write(outsidePath, "outside", 7, 0);
+	afio->flush(outsidePath);
+	auto escaping = VFS::HashPath("../NativeOutside.txt");
+	auto smuggled = VFS::HashPath("dir") + VFS::HashPath::Element("../../NativeOutside.txt");
+	std::cout << "Read outside base: " << (int)fs.readFile(escaping, buffer, 5, 0) << ", " << (int)fs.readFile(smuggled, buffer, 5, 0)
+		<< " (Should be " << (int)VFS::ErrCode::PathNotFound << "!)" << std::endl;
+}
+
+void testOverlayFileSystem()
+{
+	constexpr uint64_t nLookups = 200000;
+
+	auto basePath = testPath("OverlayTest");
+	std::filesystem::remove_all(basePath);
+	auto afio = VFS::AbstractFileIO::create(4);
+
+	auto makeLayer = [&](const std::string& name, const std::vector<std::string>& files)
+	{
+		std::filesystem::create_directories(basePath + "/" + name);
+		auto layer = std::make_shared<VFS::NativeFileSystem>(basePath + "/" + name, afio);
+		for (auto& file : files)
+		{
+			VFS::HashPath path(file);
+			for (uint64_t depth = 1; depth < path.depth(); ++depth)
+				layer->createDirectory(path - (path.depth() - depth));
+			layer->createFile(path);
+			layer->writeFile(path, (name + ":" + file).data(), name.size() + 1 + file.size(), 0);
+		}
+		return layer;
+	};
+
+	std::vector<std::string> baseFiles;
+	for (uint64_t i = 0; i < 100; ++i)
+		baseFiles.push_back("data/file" + std::to_string(i));
+	baseFiles.push_back("old/a");
+	baseFiles.push_back("old/b");
+	auto base = makeLayer("base", baseFiles);
+	auto patch = makeLayer("patch", { "data/file1", "data/.wh.file2", "old/.wh..wh..opq", "old/c", "new/x" });
+	auto upper = makeLayer("upper", {});
+
+	auto begin = std::chrono::steady_clock::now();
+	VFS::OverlayFileSystem fs({ base, patch, upper });
+	double mountSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	std::cout << "Mounted " << fs.nLayers() << " layers with " << fs.indexSize() << " entries (Should be 104!) in " << mountSeconds * 1000 << "ms" << std::endl;
+
+	auto readAll = [&](const std::string& file)
+	{
+		VFS::FileSystem::Entry entry;
+		if (fs.stat(VFS::HashPath(file), entry) != VFS::ErrCode::Success)
+			return std::string("<missing>");
+		std::string content(entry.size, '\0');
+		fs.readFile(VFS::HashPath(file), content.data(), content.size(), 0);
+		return content;
+	};
+	std::cout << "data/file0: " << readAll("data/file0") << " (Should be base:data/file0!)" << std::endl;
+	std::cout << "data/file1: " << readAll("data/file1") << " (Should be patch:data/file1!)" << std::endl;
+	std::cout << "data/file2: " << readAll("data/file2") << " (Should be <missing>!)" << std::endl;
+	std::cout << "old/a: " << readAll("old/a") << " (Should be <missing>!)" << std::endl;
+
+	std::vector<VFS::FileSystem::Entry> entries;
+	fs.listDirectory(VFS::HashPath("data"), entries);
+	std::cout << "Listed data: " << entries.size() << " (Should be 99!)" << std::endl;
+	fs.listDirectory(VFS::HashPath(), entries);
+	std::cout << "Listed root: " << entries.size() << " (Should be 3!)" << std::endl;
+
+	fs.writeFile(VFS::HashPath("data/file3"), "UPPER", 5, 0);
+	std::cout << "Copied up data/file3: " << readAll("data/file3") << " (Should be UPPERdata/file3!)" << std::endl;
+	fs.deleteFile(VFS::HashPath("data/file4"));
+	std::cout << "Deleted data/file4: " << readAll("data/file4") << " (Should be <missing>!)" << std::endl;
+	fs.createDirectory(VFS::HashPath("brand"));
+	fs.createFile(VFS::HashPath("brand/new"));
+
+	VFS::OverlayFileSystem remounted({ base, patch, upper });
+	std::cout << "Remounted with " << remounted.indexSize() << " entries (Should be 105!), data/file4 exists: "
+		<< (remounted.typeOf(VFS::HashPath("data/file4")) != VFS::FileSystem::EntryType::None) << " (Should be 0!)" << std::endl;
+
+	std::vector<VFS::HashPath> paths;
+	for (uint64_t i = 0; i < 100; ++i)
+		paths.push_back(VFS::HashPath("data/file" + std::to_string(i)));
+	begin = std::chrono::steady_clock::now();
+	uint64_t nFound = 0;
+	for (uint64_t i = 0; i < nLookups; ++i)
+		nFound += remounted.typeOf(paths[i % paths.size()]) == VFS::FileSystem::EntryType::File;
+	double lookupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	std::cout << nFound << " found, " << nLookups / lookupSeconds / 1e6 << "M lookups/s" << std::endl;
+
+	bool isRejected = false;
+	try
+	{
+		VFS::OverlayFileSystem empty({});
+	}
+	catch (const std::invalid_argument&)
+	{
+		isRejected = true;
+	}
+	std::cout << "Empty layer list rejected: " << isRejected << " (Should be 1!)" << std::endl;
+
+	isRejected = false;
+	try
+	{
+		remounted.mount(nullptr);
+	}
+	catch (const std::invalid_argument&)
+	{
+		isRejected = true;
+	}
+	std::cout << "Null mount rejected: " << isRejected << ", layers: " << remounted.nLayers() << " (Should be 1, 3!)" << std::endl;
+}
+
+void testDirectoryScanner(const std::string& hostRoot = "/usr")
+{
+	constexpr uint64_t nDirs = 50;
+	constexpr uint64_t nFilesPerDir = 40;
+
+	auto root = testPath("ScannerTree");
+	auto indexPath = testPath("ScannerIndex.msf");
+	std::filesystem::remove_all(root);
+	std::filesystem::remove(indexPath);
+	for (uint64_t d = 0; d < nDirs; ++d)
+	{
+		auto dir = root + "/dir" + std::to_string(d % 10) + "/sub" + std::to_string(d);
+		std::filesystem::create_directories(dir);
+		for (uint64_t f = 0; f < nFilesPerDir; ++f)
+			std::ofstream(dir + "/file" + std::to_string(f)) << f;
+	}
+
+	auto afio = VFS::AbstractFileIO::create(4);
+	auto print = [](const char* name, const VFS::DirectoryScanner::Stats& stats)
+	{
+		std::cout << name << ": " << stats.nDirectories << " dirs, " << stats.nFiles << " files, " << stats.nListed << " listed, "
+			<< stats.nReused << " reused in " << stats.seconds * 1000 << "ms, written: " << stats.isWritten << " (Should be 1!)" << std::endl;
+	};
+
+	VFS::DirectoryScanner scanner(root, 4);
+	print("Build (Should be 60 dirs, 2000 files)", scanner.build(indexPath, afio));
+	print("Update unchanged (Should be 1 listed, 60 reused)", scanner.update(indexPath, afio));
+	std::ofstream(root + "/dir3/sub13/added") << "new";
+	print("Update after add (Should be 2001 files, 2 listed)", scanner.update(indexPath, afio));
+
+	VFS::DirectoryIndex index(indexPath, afio);
+	std::cout << "Entries in dir3/sub13: " << index.list(VFS::HashPath("dir3/sub13")).size() << " (Should be " << nFilesPerDir + 1 << "!)" << std::endl;
+
+	auto hostIndexPath = testPath("ScannerHostIndex.msf");
+	std::filesystem::remove(hostIndexPath);
+	VFS::DirectoryScanner hostScanner(hostRoot);
+	print(("Build " + hostRoot).c_str(), hostScanner.build(hostIndexPath, afio));
+	print(("Update " + hostRoot).c_str(), hostScanner.update(hostIndexPath, afio));
+}
+
+void benchFileHandle()
+{
+	constexpr uint64_t fileSize = 64ull << 20;
+	constexpr uint64_t chunkSize = 4096;
+
+	auto basePath = testPath("FileHandleTest");
+	std::filesystem::remove_all(basePath);
+	std::filesystem::create_directories(basePath);
+	auto afio = VFS::AbstractFileIO::create(4);
+	VFS::NativeFileSystem fs(basePath, afio);
+	VFS::HashPath path("data.bin");
+	fs.createFile(path);
+
+	std::vector<char> chunk(chunkSize);
+	auto timeIt = [](const char* name, auto&& func)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		bool isCorrect = func();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		std::cout << name << ": " << fileSize / seconds / (1 << 20) << " MiB/s" << (isCorrect ? "" : " (WRONG CONTENT!)") << std::endl;
+	};
+
+	timeIt("Handle write, 4 KiB calls", [&]()
+		{
+			auto handle = fs.getFileHandle(path);
+			for (uint64_t offset = 0; offset < fileSize; offset += chunkSize)
+			{
+				memset(chunk.data(), (int)(offset / chunkSize), chunkSize);
+				handle.write(chunk.data(), chunkSize);
+			}
+			return handle.flush() == VFS::ErrCode::Success;
+		}
+	);
+
+	auto isChunkCorrect = [&](uint64_t offset) { return chunk[0] == (char)(offset / chunkSize) && chunk[chunkSize - 1] == chunk[0]; };
+	timeIt("Path readFile, 4 KiB calls", [&]()
+		{
+			bool isCorrect = true;
+			for (uint64_t offset = 0; offset < fileSize; offset += chunkSize)
+			{
+				fs.readFile(path, chunk.data(), chunkSize, offset);
+				isCorrect &= isChunkCorrect(offset);
+			}
+			return isCorrect;
+		}
+	);
+	timeIt("Handle read, 4 KiB calls", [&]()
+		{
+			auto handle = fs.getFileHandle(path);
+			bool isCorrect = true;
+			uint64_t nRead = 0;
+			for (uint64_t offset = 0; handle.read(chunk.data(), chunkSize, nRead) == VFS::ErrCode::Success; offset += nRead)
+				isCorrect &= nRead == chunkSize && isChunkCorrect(offset);
+			return isCorrect && handle.tell() == fileSize;
+		}
+	);
+#ifndef _WIN32
+	timeIt("Raw read(2), 4 KiB calls", [&]()
+		{
+			int fd = open(path.getRealPath(basePath).c_str(), O_RDONLY);
+			bool isCorrect = true;
+			for (uint64_t offset = 0; read(fd, chunk.data(), chunkSize) == (ssize_t)chunkSize; offset += chunkSize)
+				isCorrect &= isChunkCorrect(offset);
+			close(fd);
+			return isCorrect;
+		}
+	);
+#endif
+
+	auto archivePath = testPath("FileHandleArchive.vfa");
+	for (auto ext : { "", ".paths", ".dirs" })
+		std::filesystem::remove(archivePath + ext);
+	VFS::ArchiveFileSystem archive(archivePath, afio);
+	archive.createFile(path);
+	{
+		auto handle = archive.getFileHandle(path);
+		for (uint64_t i = 0; i < 100000; ++i)
+			handle.write(&i, sizeof(i));
+		handle.seek(8 * 500);
+		uint64_t value = 0;
+		uint64_t nRead = 0;
+		handle.read(&value, sizeof(value), nRead);
+		std::cout << "Archive value at 500: " << value << " (Should be 500!)" << std::endl;
+	}
+	VFS::FileSystem::Entry entry;
+	archive.stat(path, entry);
+	std::cout << "Archive file size: " << entry.size << " (Should be 800000!)" << std::endl;
+
+	// A handle sees writes of other handles once its token is open
+	{
+		auto reader = fs.getFileHandle(path);
+		auto writer = fs.getFileHandle(path);
+		uint64_t nRead = 0;
+		reader.read(chunk.data(), chunkSize, nRead);
+		writer.writeFile(chunk.data(), chunkSize, fileSize);
+		uint64_t size = 0;
+		reader.getFileSize(size);
+		bool isReadable = reader.readFile(chunk.data(), chunkSize, fileSize) == VFS::ErrCode::Success;
+		std::cout << "Size after write through other handle: " << size << " (Should be " << fileSize + chunkSize << "!), appended chunk readable: " << isReadable << " (Should be 1!)" << std::endl;
+	}
+}
+
+void testFileWatcher()
+{
+	auto basePath = testPath("WatcherTest");
+	std::filesystem::remove_all(basePath);
+	std::filesystem::create_directories(basePath + "/dir");
+
+	auto afio = VFS::AbstractFileIO::create(4);
+	VFS::NativeFileSystem fs(basePath, afio);
+	std::cout << "Watching: " << fs.startWatching() << " (Should be 1!)" << std::endl;
+
+	VFS::HashPath file("dir/external.txt");
+	VFS::HashPath nested("dir/sub/deep.txt");
+	std::vector<VFS::FileSystem::Entry> entries;
+	fs.listDirectory(VFS::HashPath("dir"), entries); // Complete, misses are answered from memory
+	std::cout << "Before: " << (int)fs.typeOf(file) << " (Should be 0!)" << std::endl;
+
+	auto waitFor = [&](const VFS::HashPath& path, VFS::FileSystem::EntryType type)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		while (fs.typeOf(path) != type)
+		{
+			if (std::chrono::steady_clock::now() - begin > std::chrono::seconds(2))
+				return -1.0;
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() * 1000;
+	};
+
+	std::ofstream(basePath + "/dir/external.txt") << "data";
+	std::cout << "External create seen after " << waitFor(file, VFS::FileSystem::EntryType::File) << "ms (Should not be -1!)" << std::endl;
+	std::filesystem::create_directories(basePath + "/dir/sub");
+	std::ofstream(basePath + "/dir/sub/deep.txt") << "data";
+	std::cout << "Nested create seen after " << waitFor(nested, VFS::FileSystem::EntryType::File) << "ms (Should not be -1!)" << std::endl;
+	std::filesystem::remove(basePath + "/dir/external.txt");
+	std::cout << "External delete seen after " << waitFor(file, VFS::FileSystem::EntryType::None) << "ms (Should not be -1!)" << std::endl;
+	std::filesystem::rename(basePath + "/dir/sub", basePath + "/moved");
+	std::cout << "Move seen after " << waitFor(VFS::HashPath("moved/deep.txt"), VFS::FileSystem::EntryType::File) << "ms (Should not be -1!)" << std::endl;
+	// The new path is found on the host right away, the old one is only gone once the watcher reported the move
+	std::cout << "Old path gone after " << waitFor(nested, VFS::FileSystem::EntryType::None) << "ms (Should not be -1!)" << std::endl;
+
+	fs.stopWatching();
+}
+
+void testDedupFileSystem()
+{
+	constexpr uint64_t nBuilds = 20;
+	constexpr uint64_t buildSize = 1 << 20;
+
+	auto basePath = testPath("DedupTest");
+	std::filesystem::remove_all(basePath);
+	std::filesystem::create_directories(basePath + "/tree");
+	auto afio = VFS::AbstractFileIO::create(4);
+	auto inner = std::make_shared<VFS::NativeFileSystem>(basePath + "/tree", afio);
+	auto store = std::make_shared<VFS::ChunkStore>(basePath + "/chunks", afio);
+	VFS::DedupFileSystem fs(inner, store);
+	fs.createDirectory(VFS::HashPath("builds"));
+
+	// Every build differs from the previous one by a few overwritten and inserted bytes
+	std::mt19937_64 rng(42);
+	std::vector<std::string> builds(1, std::string(buildSize, '\0'));
+	for (auto& c : builds[0])
+		c = (char)rng();
+	for (uint64_t i = 1; i < nBuilds; ++i)
+	{
+		std::string build = builds.back();
+		for (uint64_t j = 0; j < 3; ++j)
+		{
+			build.replace(rng() % build.size(), 0, std::to_string(rng()));
+			build[rng() % build.size()] ^= 0x5A;
+		}
+		builds.push_back(std::move(build));
+	}
+
+	uint64_t logicalBytes = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < nBuilds; ++i)
+	{
+		VFS::HashPath path("builds/build" + std::to_string(i));
+		fs.createFile(path);
+		fs.writeFile(path, builds[i].data(), builds[i].size(), 0);
+		logicalBytes += builds[i].size();
+	}
+	double writeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	std::cout << "Stored " << logicalBytes / 1024 << "KiB of builds in " << store->storedBytes() / 1024 << "KiB (Should be far less!) in "
+		<< writeSeconds * 1000 << "ms" << std::endl;
+
+	auto readAll = [&](const VFS::HashPath& path)
+	{
+		VFS::FileSystem::Entry entry;
+		if (fs.stat(path, entry) != VFS::ErrCode::Success)
+			return std::string("<missing>");
+		std::string content(entry.size, '\0');
+		fs.readFile(path, content.data(), content.size(), 0);
+		return content;
+	};
+	uint64_t nCorrect = 0;
+	for (uint64_t i = 0; i < nBuilds; ++i)
+		nCorrect += readAll(VFS::HashPath("builds/build" + std::to_string(i))) == builds[i];
+	std::cout << "Verified " << nCorrect << " builds (Should be " << nBuilds << "!)" << std::endl;
+
+	// Patching in place only adds the chunks around the patch
+	VFS::HashPath last("builds/build" + std::to_string(nBuilds - 1));
+	std::string& content = builds.back();
+	uint64_t storedBefore = store->storedBytes();
+	content.replace(buildSize / 2, 5, "PATCH");
+	fs.writeFile(last, "PATCH", 5, buildSize / 2);
+	std::cout << "Patch added " << (store->storedBytes() - storedBefore) / 1024 << "KiB (Should be small!), correct: " << (readAll(last) == content) << " (Should be 1!)" << std::endl;
+
+	content.resize(content.size() / 3);
+	fs.resizeFile(last, content.size());
+	std::cout << "Shrunk, correct: " << (readAll(last) == content) << " (Should be 1!)" << std::endl;
+	content.append("tail");
+	content.resize(content.size() + 10000, '\0');
+	fs.writeFile(last, "tail", 4, content.size() - 10004);
+	fs.resizeFile(last, content.size());
+	std::cout << "Extended, correct: " << (readAll(last) == content) << " (Should be 1!)" << std::endl;
+
+	// Zeros are streamed in chunk sized pieces and stored once
+	VFS::HashPath sparse("builds/sparse");
+	fs.createFile(sparse);
+	storedBefore = store->storedBytes();
+	fs.resizeFile(sparse, 256ull << 20);
+	fs.writeFile(sparse, "end", 3, (512ull << 20) - 3);
+	VFS::FileSystem::Entry sparseEntry;
+	fs.stat(sparse, sparseEntry);
+	char sparseTail[8] = {};
+	fs.readFile(sparse, sparseTail, 8, sparseEntry.size - 8);
+	std::cout << "Extended to " << (sparseEntry.size >> 20) << "MiB (Should be 512!), stored " << (store->storedBytes() - storedBefore) / 1024
+		<< "KiB (Should be small!), tail correct: " << (memcmp(sparseTail, "\0\0\0\0\0end", 8) == 0) << " (Should be 1!)" << std::endl;
+	fs.resizeFile(sparse, 0);
+	fs.stat(sparse, sparseEntry);
+	std::cout << "Truncated to " << sparseEntry.size << " (Should be 0!)" << std::endl;
+	fs.deleteFile(sparse);
+
+	std::vector<VFS::FileSystem::Entry> entries;
+	fs.listDirectory(VFS::HashPath("builds"), entries);
+	uint64_t listedBytes = 0;
+	for (auto& entry : entries)
+		listedBytes += entry.size;
+	uint64_t expectedBytes = 0;
+	for (auto& build : builds)
+		expectedBytes += build.size();
+	std::cout << "Listed " << entries.size() << " files, sizes correct: " << (listedBytes == expectedBytes) << " (Should be 1!)" << std::endl;
+}
+
+void testTrace()
+{
+	auto tracePath = testPath("trace.json");
+	auto afio = VFS::AbstractFileIO::create(4);
+	uint64_t keySize = sizeof(uint64_t);
+	uint64_t valSize = sizeof(uint64_t);
+
+	auto msPath = testPath("TraceTest.msf");
+	std::filesystem::remove(msPath);
+	{
+		VFS::MapStream ms(msPath, afio, keySize, valSize);
+		for (uint64_t key = 0; key < 200; ++key)
+			ms.insert(&key, &key);
+		for (uint64_t key = 0; key < 200; key += 3)
+			ms.erase(&key);
+		ms.optimize();
+	}
+
+	// Threads sharing one stream wait for each other
+	auto filePath = testPath("TraceTest.bin");
+	afio->make(filePath);
+	std::vector<std::thread> threads;
+	for (uint64_t i = 0; i < 4; ++i)
+	{
+		threads.emplace_back([&, i]()
+			{
+				char block[4096] = {};
+				for (uint64_t j = 0; j < 500; ++j)
+				{
+					afio->write(filePath, block, sizeof(block), (i * 500 + j) * sizeof(block));
+					afio->read(filePath, block, sizeof(block), j * sizeof(block));
+				}
+			});
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	// Rings of exited threads are taken over, threads running one after another share one
+	for (uint64_t i = 0; i < 16; ++i)
+		std::thread([&]() { char byte = 0; afio->write(filePath, &byte, 1, 0); }).join();
+
+	VFS::Trace::dump(tracePath);
+	std::ifstream file(tracePath);
+	std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	auto count = [&](const std::string& what)
+	{
+		uint64_t n = 0;
+		for (uint64_t pos = json.find(what); pos != std::string::npos; pos = json.find(what, pos + 1))
+			++n;
+		return n;
+	};
+	std::set<std::string> threadIds;
+	for (uint64_t pos = json.find("\"tid\":"); pos != std::string::npos; pos = json.find("\"tid\":", pos + 1))
+		threadIds.insert(json.substr(pos, json.find('}', pos) - pos));
+#ifdef VFS_ENABLE_TRACING
+	std::cout << "Traced " << count("\"ph\"") << " events, " << count("MapStream::optimize") << " optimize (Should be 1!), "
+		<< count("MapStream::eraseFinal") << " eraseFinal (Should be at least 1!), " << count("\"cat\":\"lock\"") << " lock waits, written to " << tracePath << std::endl;
+	std::cout << "Traced " << threadIds.size() << " threads (Should be at most 5!)" << std::endl;
+#else
+	std::cout << "Traced " << count("\"ph\"") << " events (Should be 0, VFS_ENABLE_TRACING is not defined!)" << std::endl;
+#endif
+}
+
+int main()
+{
+	//compareInputStrings();
+
+	//scanDrivePathsAndCompare();
+
+	//testAFIO();
+
+	//testCloseMatchingStreams();
+
+	//testWriteAheadLog();
+
+	//benchWriteAheadLog();
+
+	//stressConcurrentMapStream();
+
+	//testShardedMapStream();
+
+	//testMapStreamValueView();
+
+	//testMapStreamAllocations();
+
+	//benchMapStreamBuilder();
+
+	//testMapStreamUpsert();
+
+	//benchValueCache();
+
+	//testDirectoryIndex();
+
+	//testHashPath();
+
+	//testHashPathAllocations();
+
+	//benchHashPathParsing();
+
+	//testStaticHashPath();
+
+	//testArchiveFileSystem();
+
+	//testNativeFileSystem();
+
+	//testOverlayFileSystem();
+
+	//testDirectoryScanner();
+
+	//benchFileHandle();
+
+	//testFileWatcher();
+
+	//testDedupFileSystem();
+
+	//testTrace();
 
 	testMapStream();
 
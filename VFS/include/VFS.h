@@ -1,11 +1,33 @@
 #pragma once
 
 #include "VFS/VFSAbstractFileIO.h"
+#include "VFS/VFSArchiveFileSystem.h"
+#include "VFS/VFSBufferPool.h"
+#include "VFS/VFSChunkStore.h"
+#include "VFS/VFSConcurrentMapStream.h"
+#include "VFS/VFSDedupFileSystem.h"
+#include "VFS/VFSDirectoryIndex.h"
+#include "VFS/VFSDirectoryScanner.h"
+#include "VFS/VFSDirectoryTrie.h"
+#include "VFS/VFSEpoch.h"
 #include "VFS/VFSErrorCodes.h"
 #include "VFS/VFSFileHandle.h"
 #include "VFS/VFSFileSystem.h"
+#include "VFS/VFSFileWatcher.h"
 #include "VFS/VFSHash.h"
 #include "VFS/VFSHashPath.h"
+#include "VFS/VFSMappedFile.h"
 #include "VFS/VFSMapStream.h"
+#include "VFS/VFSMapStreamBuilder.h"
+#include "VFS/VFSNativeFileSystem.h"
+#include "VFS/VFSOverlayFileSystem.h"
 #include "VFS/VFSPlatform.h"
-#include "VFS/VFSRotaryShift.h"
\ No newline at end of file
+#include "VFS/VFSRotaryShift.h"
+#include "VFS/VFSShardedMapStream.h"
+#include "VFS/VFSSmallVector.h"
+#include "VFS/VFSStaticHashPath.h"
+#include "VFS/VFSStringPool.h"
+#include "VFS/VFSThreadPool.h"
+#include "VFS/VFSTrace.h"
+#include "VFS/VFSValueCache.h"
+#include "VFS/VFSWriteAheadLog.h"
\ No newline at end of file
@@ -4,9 +4,13 @@
 #include <fstream>
 #include <unordered_map>
 #include <mutex>
+#include <algorithm>
 
 #include <filesystem>
 
+#include "VFSPlatform.h"
+#include "VFSTrace.h"
+
 namespace VFS {
 
 	class AbstractFileIO;
@@ -37,6 +41,10 @@ namespace VFS {
 
 		class LockedStream;
 
+		struct LockableStream;
+
+		typedef std::shared_ptr<LockableStream> LockableStreamRef;
+
 		struct LockableStream
 		{
 		public:
@@ -53,21 +61,27 @@ namespace VFS {
 			std::fstream m_stream;
 		public:
 			friend LockedStream;
+			friend AbstractFileIO;
 		};
 
 		class LockedStream
 		{
 		public:
-			LockedStream(LockableStream* stream)
-				: m_pStream(stream) { if (m_pStream) m_pStream->m_mtx.lock(); }
+			LockedStream(LockableStreamRef stream)
+				: m_pStream(stream) { if (m_pStream) VFS_TRACE_LOCK(m_pStream->m_mtx, "wait: AbstractFileIO stream"); }
 			~LockedStream() { if (m_pStream) m_pStream->m_mtx.unlock(); }
 		public:
 			std::fstream* operator->() { return &m_pStream->m_stream; }
 		public:
 			operator bool() const { return m_pStream != nullptr; }
 		private:
-			LockableStream* m_pStream;
+			LockableStreamRef m_pStream; // Keeps the stream alive if it gets evicted while locked
 		};
+	public:
+		// Stream of a path that was resolved once. It stays open while the token is held, even
+		// if the path's entry is evicted in the meantime. Writes through a token are flushed
+		// right away so that other streams of the same file see them.
+		typedef LockableStreamRef Token;
 	private:
 		typedef std::fstream* StreamPtr;
 	private:
@@ -77,7 +91,16 @@ namespace VFS {
 	public:
 		Error read(const std::string& path, void* buffer, uint64_t size, uint64_t offset = 0);
 		Error write(const std::string& path, const void* buffer, uint64_t size, uint64_t offset = 0);
+		// Closes the stream of path and of everything below it if it is a directory
 		uint64_t closeMatchingStreams(const std::string& path);
+		Error flush(const std::string& path);
+		Error sync(const std::string& path);
+	public:
+		// Returns nullptr if the file cannot be opened
+		Token open(const std::string& path);
+		// Sets value.nRead, which is short at the end of the file
+		Error read(const Token& token, void* buffer, uint64_t size, uint64_t offset = 0);
+		Error write(const Token& token, const void* buffer, uint64_t size, uint64_t offset = 0);
 	public:
 		Error make(const std::string& path);
 		bool exists(const std::string& path);
@@ -85,10 +108,12 @@ namespace VFS {
 		Error resize(const std::string& path, uint64_t newSize);
 	private:
 		LockedStream getStream(const std::string& path);
+		LockableStreamRef findOrOpen(const std::string& path);
+		static bool isMatching(const std::string& streamPath, const std::string& path);
 	private:
-		std::unordered_map<std::string, LockableStream> m_streams;
+		std::unordered_map<std::string, LockableStreamRef> m_streams;
 		std::mutex m_mtxStreams;
-		const uint64_t m_nMaxStreams;
+		const uint64_t m_nMaxStreams; // Exceeded while all streams are in use
 	};
 
 	AbstractFileIO::AbstractFileIO(uint64_t nConcurrentStreams)
@@ -104,10 +129,13 @@ namespace VFS {
 
 	AbstractFileIO::Error AbstractFileIO::read(const std::string& path, void* buffer, uint64_t size, uint64_t offset)
 	{
+		VFS_TRACE_SCOPE("AbstractFileIO::read");
+
 		LockedStream stream = getStream(path);
 		if (!stream)
 			return ErrCode::CannotAccessFile;
 
+		stream->clear(); // A previous short read leaves the stream in a failed state
 		stream->seekg(offset); // Check for seek error (eof)
 		stream->read((char*)buffer, size);
 		// TODO: Check for read errors
@@ -117,10 +145,13 @@ namespace VFS {
 
 	AbstractFileIO::Error AbstractFileIO::write(const std::string& path, const void* buffer, uint64_t size, uint64_t offset)
 	{
+		VFS_TRACE_SCOPE("AbstractFileIO::write");
+
 		LockedStream stream = getStream(path);
 		if (!stream)
 			return ErrCode::CannotAccessFile;
 
+		stream->clear();
 		stream->seekp(offset); // Check for seek error (eof)
 		stream->write((const char*)buffer, size);
 		// TODO: Check for write errors
@@ -128,24 +159,106 @@ namespace VFS {
 		return ErrCode::Success;
 	}
 
+	AbstractFileIO::Token AbstractFileIO::open(const std::string& path)
+	{
+		VFS_TRACE_SCOPE("AbstractFileIO::open");
+		return findOrOpen(path);
+	}
+
+	AbstractFileIO::Error AbstractFileIO::read(const Token& token, void* buffer, uint64_t size, uint64_t offset)
+	{
+		VFS_TRACE_SCOPE("AbstractFileIO::read");
+
+		if (!token)
+			return ErrCode::CannotAccessFile;
+
+		LockedStream stream(token);
+		stream->clear();
+		stream->seekg(offset);
+		stream->read((char*)buffer, size);
+
+		Error err(ErrCode::Success);
+		err.value.nRead = stream->gcount();
+		return err;
+	}
+
+	AbstractFileIO::Error AbstractFileIO::write(const Token& token, const void* buffer, uint64_t size, uint64_t offset)
+	{
+		VFS_TRACE_SCOPE("AbstractFileIO::write");
+
+		if (!token)
+			return ErrCode::CannotAccessFile;
+
+		LockedStream stream(token);
+		stream->clear();
+		stream->seekp(offset);
+		stream->write((const char*)buffer, size);
+		stream->flush();
+		if (stream->fail())
+			return ErrCode::CannotAccessFile;
+
+		Error err(ErrCode::Success);
+		err.value.nWritten = size;
+		return err;
+	}
+
 	uint64_t AbstractFileIO::closeMatchingStreams(const std::string& path)
 	{
 		uint64_t nClosed = 0;
 
-		std::lock_guard lock(m_mtxStreams);
+		VFS_TRACE_LOCK(m_mtxStreams, "wait: AbstractFileIO streams");
+		std::lock_guard lock(m_mtxStreams, std::adopt_lock);
 
-		for (auto& it : m_streams)
+		for (auto it = m_streams.begin(); it != m_streams.end();)
 		{
-			if (it.first.find(path) == 0)
+			if (isMatching(it->first, path))
 			{
-				m_streams.erase(it.first);
+				// Streams still held stay open until released, nothing may be left in their buffer
+				if (it->second.use_count() > 1)
+					LockedStream(it->second)->flush();
+				it = m_streams.erase(it);
 				++nClosed;
 			}
+			else
+			{
+				++it;
+			}
 		}
 
 		return nClosed;
 	}
 
+	AbstractFileIO::Error AbstractFileIO::flush(const std::string& path)
+	{
+		VFS_TRACE_SCOPE("AbstractFileIO::flush");
+
+		LockableStreamRef stream;
+		{
+			VFS_TRACE_LOCK(m_mtxStreams, "wait: AbstractFileIO streams");
+			std::lock_guard lock(m_mtxStreams, std::adopt_lock);
+
+			auto it = m_streams.find(path);
+			if (it != m_streams.end())
+				stream = it->second;
+		}
+
+		// Nothing buffered if there is no open stream
+		if (stream)
+			LockedStream(stream)->flush();
+
+		return ErrCode::Success;
+	}
+
+	AbstractFileIO::Error AbstractFileIO::sync(const std::string& path)
+	{
+		flush(path);
+
+		if (!syncFile(path))
+			return ErrCode::CannotAccessFile;
+
+		return ErrCode::Success;
+	}
+
 	AbstractFileIO::Error AbstractFileIO::make(const std::string& path)
 	{
 		
@@ -192,23 +305,47 @@ namespace VFS {
 
 	AbstractFileIO::LockedStream AbstractFileIO::getStream(const std::string& path)
 	{
-		{
-			std::lock_guard lock(m_mtxStreams);
+		VFS_TRACE_SCOPE("AbstractFileIO::getStream");
 
-			auto it = m_streams.find(path);
-			if (it != m_streams.end())
-				return &it->second;
+		// Lock outside of m_mtxStreams so a busy stream does not block access to all others
+		return findOrOpen(path);
+	}
 
-			if (m_streams.size() == m_nMaxStreams)
-				m_streams.erase(m_streams.begin());
+	AbstractFileIO::LockableStreamRef AbstractFileIO::findOrOpen(const std::string& path)
+	{
+		VFS_TRACE_LOCK(m_mtxStreams, "wait: AbstractFileIO streams");
+		std::lock_guard lock(m_mtxStreams, std::adopt_lock);
 
-			LockableStream stream(std::fstream(path, std::ios::binary | std::ios::in | std::ios::out));
-			if (!LockedStream(&stream)->is_open())
-				return nullptr;
+		auto it = m_streams.find(path);
+		if (it != m_streams.end())
+			return it->second;
 
-			m_streams.insert(std::make_pair(path, std::move(stream)));
+		// Only streams nobody else holds are evicted, they are flushed and closed right away. A stream
+		// still in use could flush its buffer after newer writes through a second stream of the file.
+		if (m_streams.size() >= m_nMaxStreams)
+		{
+			auto victim = std::find_if(m_streams.begin(), m_streams.end(), [](auto& entry) { return entry.second.use_count() == 1; });
+			if (victim != m_streams.end())
+				m_streams.erase(victim);
 		}
 
-		return getStream(path);
+		auto stream = std::make_shared<LockableStream>(std::fstream(path, std::ios::binary | std::ios::in | std::ios::out));
+		if (!stream->m_stream.is_open())
+			return LockableStreamRef();
+
+		m_streams.insert(std::make_pair(path, stream));
+		return stream;
+	}
+
+	bool AbstractFileIO::isMatching(const std::string& streamPath, const std::string& path)
+	{
+		if (streamPath.compare(0, path.size(), path) != 0)
+			return false;
+		if (streamPath.size() == path.size() || path.empty())
+			return true;
+
+		// 'dir' matches 'dir/file' but not 'dir.tmp'
+		auto isSeparator = [](char c) { return c == '/' || c == '\\'; };
+		return isSeparator(path.back()) || isSeparator(streamPath[path.size()]);
 	}
 }
\ No newline at end of file
@@ -0,0 +1,525 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <cstring>
+
+#include "VFSFileSystem.h"
+#include "VFSAbstractFileIO.h"
+#include "VFSMapStream.h"
+#include "VFSDirectoryIndex.h"
+
+namespace VFS {
+
+	// FileSystem that packs all file data into the single container file at basePath.
+	//
+	// Every file owns one extent of a power of two size class. Freed extents are kept in one
+	// free list per class, threaded through the extents themselves with the list heads stored
+	// in the container header, so opening an archive only reads that header. The path table
+	// ('<basePath>.paths') is a MapStream keyed by HashPath::hash(), the directory listing
+	// lives in a DirectoryIndex ('<basePath>.dirs'). All data goes through the one shared
+	// AbstractFileIO, which should allow at least three concurrent streams.
+	// Every record also holds its parent's hash and its name. A parent can only be created
+	// if its own record matched, so this identifies the full path: a path whose hash is
+	// taken by a different one fails with HashCollision instead of aliasing its record.
+	// A container without a valid header is not touched, every operation fails with IOError.
+	class ArchiveFileSystem : public FileSystem
+	{
+	public:
+		ArchiveFileSystem(const std::string& basePath, AbstractFileIORef afio);
+		~ArchiveFileSystem();
+	public:
+		ErrCode createFile(HashPathRef path) override;
+		ErrCode deleteFile(HashPathRef path) override;
+		ErrCode createDirectory(HashPathRef path) override;
+		ErrCode deleteDirectory(HashPathRef path) override;
+		ErrCode stat(HashPathRef path, Entry& entry) override;
+		ErrCode listDirectory(HashPathRef path, std::vector<Entry>& entries) override;
+	public:
+		ErrCode readFile(HashPathRef path, void* buffer, uint64_t count, uint64_t offset) override;
+		ErrCode writeFile(HashPathRef path, const void* buffer, uint64_t count, uint64_t offset) override;
+		ErrCode resizeFile(HashPathRef path, uint64_t newSize) override;
+		ErrCode setLastModTime(HashPathRef path, uint64_t modTime) override;
+		// Read only, resizing moves files to other extents behind the back of a writable token.
+		// Writes go through writeFile().
+		ErrCode openFile(HashPathRef path, bool forWriting, FileToken& token) override;
+	public:
+		// Moves new entries of the path table and the directory index into their sorted regions
+		void optimize();
+		void flush();
+		uint64_t containerSize() const { return m_header.endOffset; }
+		bool isOpen() const { return m_isOpen; }
+	protected:
+		std::string getRealPath(HashPathRef path) override;
+	private:
+		#pragma pack(push, 1)
+		struct Header
+		{
+			const char identifier[6] = { 'V', 'F', 'S', 'A', 'R', 'C' }; // VirtualFileSystem ARChive
+			uint64_t endOffset = 0;
+			uint64_t freeHeads[48] = {}; // Offset of the first free extent of every size class, 0 if none
+		};
+		struct Record
+		{
+			EntryType type;
+			uint64_t offset;
+			uint64_t size;
+			uint8_t sizeClass;
+			uint64_t modTime;
+			Hash parent;
+			uint8_t nameLength;
+			char name[DirectoryIndex::MAX_NAME_LENGTH];
+		};
+		#pragma pack(pop)
+		static constexpr uint64_t MIN_CLASS_SHIFT = 6; // 64 bytes
+		static constexpr uint64_t N_SIZE_CLASSES = sizeof(Header::freeHeads) / sizeof(uint64_t);
+		static constexpr uint8_t NO_EXTENT = 0xFF;
+	private:
+		ErrCode create(HashPathRef path, EntryType type);
+		// PathNotFound if there is no record, HashCollision if it belongs to a different path
+		ErrCode getRecord(HashPathRef path, Record& record) const;
+		void putRecord(HashPathRef path, const Record& record);
+		void eraseRecord(HashPathRef path);
+		bool isDirectory(HashPathRef path) const;
+		ErrCode resize(HashPathRef path, Record& record, uint64_t newSize);
+		uint64_t allocate(uint8_t sizeClass);
+		void release(uint64_t offset, uint8_t sizeClass);
+		void zeroFill(uint64_t offset, uint64_t size);
+		void writeHeader();
+		static uint8_t sizeClassOf(uint64_t size);
+		static uint64_t capacityOf(uint8_t sizeClass);
+	private:
+		std::mutex m_mtx;
+		AbstractFileIORef m_afio;
+		Header m_header;
+		bool m_isOpen = false;
+		uint64_t m_keySize = sizeof(Hash);
+		uint64_t m_valSize = sizeof(Record);
+		MapStream m_paths;
+		DirectoryIndex m_dirs;
+	};
+
+	ArchiveFileSystem::ArchiveFileSystem(const std::string& basePath, AbstractFileIORef afio)
+		: FileSystem(basePath), m_afio(afio), m_paths(basePath + ".paths", afio, m_keySize, m_valSize), m_dirs(basePath + ".dirs", afio)
+	{
+		if (m_afio->exists(getBasePath()))
+		{
+			// Read through a token, only that reports short reads
+			auto err = m_afio->read(m_afio->open(getBasePath()), &m_header, sizeof(Header), 0);
+			m_isOpen = err.code == AbstractFileIO::ErrCode::Success && err.value.nRead == sizeof(Header)
+				&& memcmp(m_header.identifier, "VFSARC", sizeof(Header::identifier)) == 0;
+			if (!m_isOpen)
+				m_header.endOffset = 0;
+		}
+		else if (m_afio->make(getBasePath()).code == AbstractFileIO::ErrCode::Success)
+		{
+			m_header.endOffset = sizeof(Header);
+			writeHeader();
+			m_isOpen = true;
+		}
+
+		m_paths.enableCache(4ull << 20);
+	}
+
+	ArchiveFileSystem::~ArchiveFileSystem()
+	{
+		flush();
+	}
+
+	ErrCode ArchiveFileSystem::createFile(HashPathRef path)
+	{
+		std::lock_guard lock(m_mtx);
+		return create(path, EntryType::File);
+	}
+
+	ErrCode ArchiveFileSystem::deleteFile(HashPathRef path)
+	{
+		std::lock_guard lock(m_mtx);
+		if (!isOpen())
+			return ErrCode::IOError;
+
+		Record record;
+		ErrCode ec = getRecord(path, record);
+		if (ec != ErrCode::Success)
+			return ec;
+		if (record.type != EntryType::File)
+			return ErrCode::NotAFile;
+
+		if (record.sizeClass != NO_EXTENT)
+			release(record.offset, record.sizeClass);
+		eraseRecord(path);
+		return ErrCode::Success;
+	}
+
+	ErrCode ArchiveFileSystem::createDirectory(HashPathRef path)
+	{
+		std::lock_guard lock(m_mtx);
+		return create(path, EntryType::Directory);
+	}
+
+	ErrCode ArchiveFileSystem::deleteDirectory(HashPathRef path)
+	{
+		std::lock_guard lock(m_mtx);
+		if (!isOpen())
+			return ErrCode::IOError;
+
+		Record record;
+		ErrCode ec = getRecord(path, record);
+		if (ec != ErrCode::Success)
+			return ec;
+		if (record.type != EntryType::Directory)
+			return ErrCode::NotADirectory;
+
+		bool isEmpty = true;
+		m_dirs.list(path, [&isEmpty](const Entry&) { isEmpty = false; return false; });
+		if (!isEmpty)
+			return ErrCode::DirectoryNotEmpty;
+
+		eraseRecord(path);
+		return ErrCode::Success;
+	}
+
+	ErrCode ArchiveFileSystem::stat(HashPathRef path, Entry& entry)
+	{
+		std::lock_guard lock(m_mtx);
+		if (!isOpen())
+			return ErrCode::IOError;
+
+		if (path.depth() == 0)
+		{
+			entry = Entry();
+			entry.type = EntryType::Directory;
+			return ErrCode::Success;
+		}
+
+		Record record;
+		ErrCode ec = getRecord(path, record);
+		if (ec != ErrCode::Success)
+			return ec;
+
+		entry.type = record.type;
+		entry.size = record.size;
+		entry.modTime = record.modTime;
+		entry.name = path[path.depth() - 1].asString();
+		return ErrCode::Success;
+	}
+
+	ErrCode ArchiveFileSystem::listDirectory(HashPathRef path, std::vector<Entry>& entries)
+	{
+		std::lock_guard lock(m_mtx);
+		if (!isOpen())
+			return ErrCode::IOError;
+
+		if (!isDirectory(path))
+			return ErrCode::NotADirectory;
+
+		entries = m_dirs.list(path);
+		return ErrCode::Success;
+	}
+
+	ErrCode ArchiveFileSystem::readFile(HashPathRef path, void* buffer, uint64_t count, uint64_t offset)
+	{
+		// Held during the read, a concurrent resize or delete could hand the extent to another file
+		std::lock_guard lock(m_mtx);
+		if (!isOpen())
+			return ErrCode::IOError;
+
+		Record record;
+		ErrCode ec = getRecord(path, record);
+		if (ec != ErrCode::Success)
+			return ec;
+
+		if (record.type != EntryType::File)
+			return ErrCode::NotAFile;
+		if (offset + count > record.size)
+			return ErrCode::EndOfFile;
+		if (count == 0)
+			return ErrCode::Success;
+
+		if (m_afio->read(getBasePath(), buffer, count, record.offset + offset).code != AbstractFileIO::ErrCode::Success)
+			return ErrCode::IOError;
+		return ErrCode::Success;
+	}
+
+	ErrCode ArchiveFileSystem::writeFile(HashPathRef path, const void* buffer, uint64_t count, uint64_t offset)
+	{
+		std::lock_guard lock(m_mtx);
+		if (!isOpen())
+			return ErrCode::IOError;
+
+		Record record;
+		ErrCode ec = getRecord(path, record);
+		if (ec != ErrCode::Success)
+			return ec;
+		if (record.type != EntryType::File)
+			return ErrCode::NotAFile;
+
+		if (offset + count > record.size)
+		{
+			ErrCode ec = resize(path, record, offset + count);
+			if (ec != ErrCode::Success)
+				return ec;
+		}
+
+		if (count == 0)
+			return ErrCode::Success;
+
+		if (m_afio->write(getBasePath(), buffer, count, record.offset + offset).code != AbstractFileIO::ErrCode::Success)
+			return ErrCode::IOError;
+		return ErrCode::Success;
+	}
+
+	ErrCode ArchiveFileSystem::resizeFile(HashPathRef path, uint64_t newSize)
+	{
+		std::lock_guard lock(m_mtx);
+		if (!isOpen())
+			return ErrCode::IOError;
+
+		Record record;
+		ErrCode ec = getRecord(path, record);
+		if (ec != ErrCode::Success)
+			return ec;
+		if (record.type != EntryType::File)
+			return ErrCode::NotAFile;
+
+		return resize(path, record, newSize);
+	}
+
+	ErrCode ArchiveFileSystem::setLastModTime(HashPathRef path, uint64_t modTime)
+	{
+		std::lock_guard lock(m_mtx);
+		if (!isOpen())
+			return ErrCode::IOError;
+
+		Record record;
+		ErrCode ec = getRecord(path, record);
+		if (ec != ErrCode::Success)
+			return ec;
+
+		record.modTime = modTime;
+		putRecord(path, record);
+		return ErrCode::Success;
+	}
+
+	ErrCode ArchiveFileSystem::openFile(HashPathRef path, bool forWriting, FileToken& token)
+	{
+		if (forWriting)
+			return ErrCode::Unsupported;
+
+		std::lock_guard lock(m_mtx);
+		if (!isOpen())
+			return ErrCode::IOError;
+
+		Record record;
+		ErrCode ec = getRecord(path, record);
+		if (ec != ErrCode::Success)
+			return ec;
+		if (record.type != EntryType::File)
+			return ErrCode::NotAFile;
+
+		token.afio = m_afio;
+		token.stream = m_afio->open(getBasePath());
+		if (!token.stream)
+			return ErrCode::IOError;
+		token.offset = record.offset;
+		token.size = record.size;
+		token.capacity = record.size;
+		token.isWritable = false;
+		return ErrCode::Success;
+	}
+
+	void ArchiveFileSystem::optimize()
+	{
+		std::lock_guard lock(m_mtx);
+		if (!isOpen())
+			return;
+		m_paths.optimize();
+		m_dirs.optimize();
+	}
+
+	void ArchiveFileSystem::flush()
+	{
+		std::lock_guard lock(m_mtx);
+		if (!isOpen())
+			return;
+		m_paths.flush();
+		m_dirs.flush();
+		m_afio->flush(getBasePath());
+	}
+
+	std::string ArchiveFileSystem::getRealPath(HashPathRef)
+	{
+		// Every file lives inside the container
+		return getBasePath();
+	}
+
+	ErrCode ArchiveFileSystem::create(HashPathRef path, EntryType type)
+	{
+		if (!isOpen())
+			return ErrCode::IOError;
+		if (path.depth() == 0)
+			return ErrCode::AlreadyExists;
+
+		auto& name = path[path.depth() - 1].asString();
+		if (name.size() > DirectoryIndex::MAX_NAME_LENGTH)
+			return ErrCode::Unsupported;
+
+		Record record = {};
+		ErrCode ec = getRecord(path, record);
+		if (ec == ErrCode::Success)
+			return ErrCode::AlreadyExists;
+		if (ec != ErrCode::PathNotFound)
+			return ec;
+		if (!isDirectory(path.parent()))
+			return ErrCode::PathNotFound;
+
+		record = {};
+		record.type = type;
+		record.offset = 0;
+		record.size = 0;
+		record.sizeClass = NO_EXTENT;
+		record.modTime = 0;
+		record.parent = path.parent().hash();
+		record.nameLength = (uint8_t)name.size();
+		memcpy(record.name, name.data(), name.size());
+		putRecord(path, record);
+		return ErrCode::Success;
+	}
+
+	ErrCode ArchiveFileSystem::getRecord(HashPathRef path, Record& record) const
+	{
+		if (path.depth() == 0)
+			return ErrCode::PathNotFound; // The root has no record
+
+		Hash key = path.hash();
+		if (!m_paths.get(&key, &record))
+			return ErrCode::PathNotFound;
+
+		auto& name = path[path.depth() - 1].asString();
+		if (record.parent != path.parent().hash() || record.nameLength != name.size() || memcmp(record.name, name.data(), name.size()) != 0)
+			return ErrCode::HashCollision;
+		return ErrCode::Success;
+	}
+
+	void ArchiveFileSystem::putRecord(HashPathRef path, const Record& record)
+	{
+		Hash key = path.hash();
+		m_paths.upsert(&key, (void*)&record);
+		m_dirs.add(path, record.type, record.size, record.modTime);
+	}
+
+	void ArchiveFileSystem::eraseRecord(HashPathRef path)
+	{
+		Hash key = path.hash();
+		m_paths.erase(&key);
+		m_dirs.remove(path);
+	}
+
+	bool ArchiveFileSystem::isDirectory(HashPathRef path) const
+	{
+		Record record;
+		return path.depth() == 0 || (getRecord(path, record) == ErrCode::Success && record.type == EntryType::Directory);
+	}
+
+	ErrCode ArchiveFileSystem::resize(HashPathRef path, Record& record, uint64_t newSize)
+	{
+		if (newSize == 0)
+		{
+			if (record.sizeClass != NO_EXTENT)
+				release(record.offset, record.sizeClass);
+			record.offset = 0;
+			record.sizeClass = NO_EXTENT;
+		}
+		else if (record.sizeClass != NO_EXTENT && newSize <= capacityOf(record.sizeClass))
+		{
+			// Reused extents may still hold old data
+			if (newSize > record.size)
+				zeroFill(record.offset + record.size, newSize - record.size);
+		}
+		else
+		{
+			uint8_t newClass = sizeClassOf(newSize);
+			if (newClass >= N_SIZE_CLASSES)
+				return ErrCode::IOError;
+
+			uint64_t newOffset = allocate(newClass);
+
+			// Move the existing data over to the new extent
+			constexpr uint64_t maxBuffSize = 65536;
+			uint64_t oldSize = record.size;
+			std::vector<char> buffer(std::min(maxBuffSize, std::max<uint64_t>(1, oldSize)));
+			for (uint64_t moved = 0; moved < oldSize; )
+			{
+				uint64_t nToMove = std::min<uint64_t>(buffer.size(), oldSize - moved);
+				m_afio->read(getBasePath(), buffer.data(), nToMove, record.offset + moved);
+				m_afio->write(getBasePath(), buffer.data(), nToMove, newOffset + moved);
+				moved += nToMove;
+			}
+			zeroFill(newOffset + oldSize, newSize - oldSize);
+
+			if (record.sizeClass != NO_EXTENT)
+				release(record.offset, record.sizeClass);
+			record.offset = newOffset;
+			record.sizeClass = newClass;
+		}
+
+		record.size = newSize;
+		putRecord(path, record);
+		return ErrCode::Success;
+	}
+
+	uint64_t ArchiveFileSystem::allocate(uint8_t sizeClass)
+	{
+		uint64_t offset = m_header.freeHeads[sizeClass];
+		if (offset != 0)
+		{
+			// Pop the head, its first bytes hold the offset of the next free extent
+			m_afio->read(getBasePath(), &m_header.freeHeads[sizeClass], sizeof(uint64_t), offset);
+		}
+		else
+		{
+			offset = m_header.endOffset;
+			m_header.endOffset += capacityOf(sizeClass);
+		}
+
+		writeHeader();
+		return offset;
+	}
+
+	void ArchiveFileSystem::release(uint64_t offset, uint8_t sizeClass)
+	{
+		m_afio->write(getBasePath(), &m_header.freeHeads[sizeClass], sizeof(uint64_t), offset);
+		m_header.freeHeads[sizeClass] = offset;
+		writeHeader();
+	}
+
+	void ArchiveFileSystem::zeroFill(uint64_t offset, uint64_t size)
+	{
+		constexpr uint64_t maxBuffSize = 65536;
+		std::vector<char> zeros(std::min(maxBuffSize, size));
+		for (uint64_t written = 0; written < size; )
+		{
+			uint64_t nToWrite = std::min<uint64_t>(zeros.size(), size - written);
+			m_afio->write(getBasePath(), zeros.data(), nToWrite, offset + written);
+			written += nToWrite;
+		}
+	}
+
+	void ArchiveFileSystem::writeHeader()
+	{
+		m_afio->write(getBasePath(), &m_header, sizeof(Header), 0);
+	}
+
+	uint8_t ArchiveFileSystem::sizeClassOf(uint64_t size)
+	{
+		uint8_t cls = 0;
+		while (cls < N_SIZE_CLASSES && capacityOf(cls) < size)
+			++cls;
+		return cls;
+	}
+
+	uint64_t ArchiveFileSystem::capacityOf(uint8_t sizeClass)
+	{
+		return 1ull << (sizeClass + MIN_CLASS_SHIFT);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+
+namespace VFS {
+
+	// Per-thread cache of temporary buffers, grouped in power of two size classes.
+	// Once a thread has warmed up, acquiring a buffer of a cached class does not touch the heap.
+	class BufferPool
+	{
+	public:
+		static char* acquire(uint64_t size);
+		static void release(char* buff, uint64_t size);
+	private:
+		static uint64_t sizeClass(uint64_t size);
+	private:
+		static constexpr uint64_t MIN_CLASS_SHIFT = 6; // 64 bytes
+		static constexpr uint64_t N_CLASSES = 16; // Up to 2 MiB
+		static constexpr uint64_t N_CACHED_PER_CLASS = 8;
+		struct Cache
+		{
+			char* buffers[N_CLASSES][N_CACHED_PER_CLASS] = {};
+			uint64_t nCached[N_CLASSES] = {};
+		public:
+			~Cache();
+		};
+		static Cache& cache();
+	};
+
+	char* BufferPool::acquire(uint64_t size)
+	{
+		uint64_t cls = sizeClass(size);
+		if (cls >= N_CLASSES)
+			return new char[size];
+
+		auto& c = cache();
+		if (c.nCached[cls] > 0)
+			return c.buffers[cls][--c.nCached[cls]];
+
+		return new char[1ull << (cls + MIN_CLASS_SHIFT)];
+	}
+
+	void BufferPool::release(char* buff, uint64_t size)
+	{
+		uint64_t cls = sizeClass(size);
+		if (cls < N_CLASSES)
+		{
+			auto& c = cache();
+			if (c.nCached[cls] < N_CACHED_PER_CLASS)
+			{
+				c.buffers[cls][c.nCached[cls]++] = buff;
+				return;
+			}
+		}
+
+		delete[] buff;
+	}
+
+	uint64_t BufferPool::sizeClass(uint64_t size)
+	{
+		uint64_t cls = 0;
+		while ((1ull << (cls + MIN_CLASS_SHIFT)) < size)
+			++cls;
+		return cls;
+	}
+
+	BufferPool::Cache::~Cache()
+	{
+		for (uint64_t cls = 0; cls < N_CLASSES; ++cls)
+			for (uint64_t i = 0; i < nCached[cls]; ++i)
+				delete[] buffers[cls][i];
+	}
+
+	BufferPool::Cache& BufferPool::cache()
+	{
+		static thread_local Cache s_cache;
+		return s_cache;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstring>
+#include <filesystem>
+
+#include "VFSHash.h"
+#include "VFSMapStream.h"
+#include "VFSAbstractFileIO.h"
+
+namespace VFS {
+
+	// Content-addressed storage of variable sized chunks.
+	//
+	// Data is split at content-defined boundaries (FastCDC: gear rolling hash with normalized
+	// chunking), so an insertion or deletion only changes the chunks around it. Every distinct
+	// chunk is appended to the data file at path once, the index '<path>.chunks' maps
+	// (content hash, size, seq) to its offset and reference count. Chunks with equal hash and
+	// size are compared byte by byte before they are shared, a real collision gets the next seq.
+	// Chunks whose count drops to zero stay in the data file, there is no compaction yet.
+	// Index entries of new chunks are kept in memory and merged into the index in batches once
+	// they exceed an eighth of it, so every entry is rewritten a bounded number of times.
+	// They reach the index file on flush() and on destruction.
+	class ChunkStore
+	{
+	public:
+		#pragma pack(push, 1)
+		struct ChunkRef
+		{
+			Hash hash;
+			uint32_t size;
+			uint32_t seq;
+		};
+		#pragma pack(pop)
+		static constexpr uint64_t MIN_CHUNK_SIZE = 2048;
+		static constexpr uint64_t AVG_CHUNK_SIZE = 8192;
+		static constexpr uint64_t MAX_CHUNK_SIZE = 65536;
+	public:
+		ChunkStore(const std::string& path, AbstractFileIORef afio);
+		~ChunkStore();
+	public:
+		// Splits data into chunks, stores the ones not known yet and appends a reference to each.
+		// On failure refs is left as it was.
+		bool store(const void* data, uint64_t size, std::vector<ChunkRef>& refs);
+		bool read(const ChunkRef& ref, void* buffer, uint64_t count, uint64_t offset = 0);
+		void release(const ChunkRef& ref);
+		// Bytes in the data file
+		uint64_t storedBytes() const;
+		bool isOpen() const { return m_data != nullptr; }
+		void flush();
+	public:
+		// Length of the first chunk of data
+		static uint64_t nextCut(const uint8_t* data, uint64_t size);
+	private:
+		struct Value
+		{
+			uint64_t offset;
+			uint64_t refCount;
+		};
+		struct Gear
+		{
+			uint64_t values[256];
+		};
+		static constexpr Gear makeGear();
+		static constexpr uint64_t MASK_S = 0x0003590703530000ull; // 15 bits, used below the average size
+		static constexpr uint64_t MASK_L = 0x0000D90003530000ull; // 11 bits, used above it
+		static constexpr uint64_t MIN_PENDING = 1024;
+		struct RefHash
+		{
+			size_t operator()(const ChunkRef& ref) const { return (size_t)(ref.hash ^ ((uint64_t)ref.seq << 32)); }
+		};
+		struct RefEqual
+		{
+			bool operator()(const ChunkRef& left, const ChunkRef& right) const { return memcmp(&left, &right, sizeof(ChunkRef)) == 0; }
+		};
+	private:
+		bool insert(const char* data, uint64_t size, ChunkRef& ref);
+		bool lookup(const ChunkRef& ref, Value& value);
+		void setValue(const ChunkRef& ref, const Value& value);
+		void mergePending();
+	private:
+		mutable std::mutex m_mtx;
+		std::string m_path;
+		AbstractFileIORef m_afio;
+		AbstractFileIO::Token m_data;
+		uint64_t m_keySize = sizeof(ChunkRef);
+		uint64_t m_valSize = sizeof(Value);
+		MapStream m_index;
+		uint64_t m_endOffset = 0;
+		std::unordered_map<ChunkRef, Value, RefHash, RefEqual> m_pending; // Not in m_index yet
+		std::vector<char> m_compareBuffer;
+	};
+
+	typedef std::shared_ptr<ChunkStore> ChunkStoreRef;
+
+	ChunkStore::ChunkStore(const std::string& path, AbstractFileIORef afio)
+		: m_path(path), m_afio(afio), m_index(path + ".chunks", afio, m_keySize, m_valSize)
+	{
+		if (!m_afio->exists(m_path))
+			m_afio->make(m_path);
+		m_data = m_afio->open(m_path);
+
+		std::error_code ec;
+		m_endOffset = std::filesystem::file_size(m_path, ec);
+		m_index.enableCache(4ull << 20);
+		m_index.optimize(); // Lookups of unknown chunks only search the sorted region then
+	}
+
+	ChunkStore::~ChunkStore()
+	{
+		flush();
+	}
+
+	bool ChunkStore::store(const void* data, uint64_t size, std::vector<ChunkRef>& refs)
+	{
+		std::lock_guard lock(m_mtx);
+
+		if (!isOpen())
+			return false;
+
+		uint64_t nOldRefs = refs.size();
+		auto bytes = (const uint8_t*)data;
+		for (uint64_t offset = 0; offset < size; )
+		{
+			uint64_t chunkSize = nextCut(bytes + offset, size - offset);
+			ChunkRef ref;
+			if (!insert((const char*)bytes + offset, chunkSize, ref))
+			{
+				// Drops the references taken so far, the chunks themselves stay
+				for (uint64_t i = nOldRefs; i < refs.size(); ++i)
+				{
+					Value value;
+					if (lookup(refs[i], value) && value.refCount > 0)
+					{
+						--value.refCount;
+						setValue(refs[i], value);
+					}
+				}
+				refs.resize(nOldRefs);
+				return false;
+			}
+			refs.push_back(ref);
+			offset += chunkSize;
+		}
+		return true;
+	}
+
+	bool ChunkStore::read(const ChunkRef& ref, void* buffer, uint64_t count, uint64_t offset)
+	{
+		if (offset + count > ref.size)
+			return false;
+
+		Value value;
+		{
+			std::lock_guard lock(m_mtx);
+			if (!isOpen() || !lookup(ref, value))
+				return false;
+		}
+		auto err = m_afio->read(m_data, buffer, count, value.offset + offset);
+		return err.code == AbstractFileIO::ErrCode::Success && err.value.nRead == count;
+	}
+
+	void ChunkStore::release(const ChunkRef& ref)
+	{
+		std::lock_guard lock(m_mtx);
+
+		Value value;
+		if (!lookup(ref, value) || value.refCount == 0)
+			return;
+		--value.refCount;
+		setValue(ref, value);
+	}
+
+	uint64_t ChunkStore::storedBytes() const
+	{
+		std::lock_guard lock(m_mtx);
+		return m_endOffset;
+	}
+
+	void ChunkStore::flush()
+	{
+		std::lock_guard lock(m_mtx);
+		mergePending();
+		m_index.flush();
+	}
+
+	constexpr ChunkStore::Gear ChunkStore::makeGear()
+	{
+		// splitmix64 output, as for the hash secret
+		Gear gear = {};
+		uint64_t x = 0x243F6A8885A308D3ull;
+		for (uint64_t i = 0; i < 256; ++i)
+		{
+			x += 0x9E3779B97F4A7C15ull;
+			uint64_t z = x;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			gear.values[i] = z ^ (z >> 31);
+		}
+		return gear;
+	}
+
+	uint64_t ChunkStore::nextCut(const uint8_t* data, uint64_t size)
+	{
+		static constexpr Gear GEAR = makeGear();
+
+		if (size <= MIN_CHUNK_SIZE)
+			return size;
+
+		uint64_t normalSize = std::min(size, AVG_CHUNK_SIZE);
+		uint64_t maxSize = std::min(size, MAX_CHUNK_SIZE);
+		uint64_t fingerprint = 0;
+		uint64_t i = MIN_CHUNK_SIZE;
+		for (; i < normalSize; ++i)
+		{
+			fingerprint = (fingerprint << 1) + GEAR.values[data[i]];
+			if (!(fingerprint & MASK_S))
+				return i + 1;
+		}
+		for (; i < maxSize; ++i)
+		{
+			fingerprint = (fingerprint << 1) + GEAR.values[data[i]];
+			if (!(fingerprint & MASK_L))
+				return i + 1;
+		}
+		return maxSize;
+	}
+
+	bool ChunkStore::insert(const char* data, uint64_t size, ChunkRef& ref)
+	{
+		ref = { makeHash(data, size), (uint32_t)size, 0 };
+		Value value;
+		for (; lookup(ref, value); ++ref.seq)
+		{
+			m_compareBuffer.resize(size);
+			auto err = m_afio->read(m_data, m_compareBuffer.data(), size, value.offset);
+			if (err.code != AbstractFileIO::ErrCode::Success || err.value.nRead != size)
+				return false;
+			if (memcmp(m_compareBuffer.data(), data, size) != 0)
+				continue; // Same hash and size, different content
+
+			++value.refCount;
+			setValue(ref, value);
+			return true;
+		}
+
+		if (m_afio->write(m_data, data, size, m_endOffset).code != AbstractFileIO::ErrCode::Success)
+			return false;
+
+		value.offset = m_endOffset;
+		value.refCount = 1;
+		m_endOffset += size;
+		m_pending[ref] = value;
+
+		if (m_pending.size() >= std::max(MIN_PENDING, m_index.count() / 8))
+			mergePending();
+		return true;
+	}
+
+	bool ChunkStore::lookup(const ChunkRef& ref, Value& value)
+	{
+		auto it = m_pending.find(ref);
+		if (it != m_pending.end())
+		{
+			value = it->second;
+			return true;
+		}
+		return m_index.get((void*)&ref, &value);
+	}
+
+	void ChunkStore::setValue(const ChunkRef& ref, const Value& value)
+	{
+		auto it = m_pending.find(ref);
+		if (it != m_pending.end())
+			it->second = value;
+		else
+			m_index.update((void*)&ref, (void*)&value);
+	}
+
+	void ChunkStore::mergePending()
+	{
+		if (m_pending.empty())
+			return;
+
+		std::vector<ChunkRef> keys;
+		std::vector<Value> values;
+		keys.reserve(m_pending.size());
+		values.reserve(m_pending.size());
+		for (auto& entry : m_pending)
+		{
+			keys.push_back(entry.first);
+			values.push_back(entry.second);
+		}
+		m_pending.clear();
+
+		// The unsorted region is empty before, a batch only needs a binary search per key
+		m_index.upsert(keys.data(), values.data(), keys.size());
+		m_index.optimize();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,290 @@
+#pragma once
+
+#include "VFSMapStream.h"
+#include "VFSEpoch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace VFS {
+
+	// MapStream for one writer and any number of concurrent readers.
+	//
+	// Readers work on an immutable in-memory image of the map. Images are published
+	// through an epoch protected pointer, so find/getValue never lock and never touch
+	// the file. The writer updates the file through the wrapped MapStream and publishes
+	// a new image after every operation. Consecutive images share the regions that did not change.
+	// The unsorted region lives in fixed-size segments that are only appended to: an image only
+	// sees its first nUnsorted elements, so an insert writes the element behind them and publishes
+	// the same segments with a larger count. Only optimize() and flushing erased elements move
+	// elements around, they load the sorted region anew.
+	class ConcurrentMapStream
+	{
+	private:
+		static constexpr uint64_t SEGMENT_ELEMS = 1024;
+		struct Tail
+		{
+			// Sized once, slots behind the last used segment are filled in by the writer.
+			// A full tail is replaced by a larger one that shares the segments.
+			std::vector<std::shared_ptr<char[]>> segments;
+		};
+		struct Image
+		{
+			uint64_t nSorted = 0;
+			uint64_t nUnsorted = 0;
+			std::shared_ptr<const std::vector<char>> sorted;
+			std::shared_ptr<const Tail> tail;
+			std::shared_ptr<const std::set<uint64_t>> erased;
+		};
+	public:
+		// Snapshot of the map, indices returned by find() are only valid for the view they came from.
+		class View
+		{
+		private:
+			View(const ConcurrentMapStream* stream);
+		public:
+			uint64_t find(MapStream::ConstKey key) const;
+			void getValue(uint64_t index, MapStream::Val valBuff) const;
+			bool get(MapStream::ConstKey key, MapStream::Val valBuff) const;
+			uint64_t size() const;
+		private:
+			EpochManager::Guard m_guard;
+			const ConcurrentMapStream* m_stream;
+			const Image* m_image;
+		public:
+			friend ConcurrentMapStream;
+		};
+	public:
+		ConcurrentMapStream(const std::string& path, AbstractFileIORef afio, uint64_t& keySize, uint64_t& valSize, WriteAheadLogRef wal = nullptr);
+		~ConcurrentMapStream();
+	public:
+		View view() const;
+		bool get(MapStream::ConstKey key, MapStream::Val valBuff) const;
+	public:
+		void insert(MapStream::ConstKey key, MapStream::ConstVal value);
+		void erase(MapStream::ConstKey key);
+		void optimize();
+		float currOptimization();
+		void flush();
+	private:
+		const Image* loadImage();
+		void publish(const Image* image);
+		char* appendElem(uint64_t index);
+		const char* getElem(const Image& image, uint64_t index) const;
+	private:
+		MapStream m_stream;
+		const uint64_t m_keySize;
+		const uint64_t m_valSize;
+		std::mutex m_mtxWriter;
+		std::shared_ptr<Tail> m_tail; // Tail of the current image, only touched by the writer
+		mutable EpochManager m_epochs;
+		std::atomic<const Image*> m_image;
+	};
+
+	ConcurrentMapStream::View::View(const ConcurrentMapStream* stream)
+		: m_guard(stream->m_epochs.pin()), m_stream(stream), m_image(stream->m_image.load())
+	{
+	}
+
+	uint64_t ConcurrentMapStream::View::find(MapStream::ConstKey key) const
+	{
+		auto k = (const char*)*key;
+		auto keySize = m_stream->m_keySize;
+
+		uint64_t low = 0;
+		uint64_t high = m_image->nSorted;
+		while (low < high)
+		{
+			uint64_t index = low + (high - low) / 2;
+			auto temp = m_stream->getElem(*m_image, index);
+
+			if (MapStream::compare(temp, k, keySize))
+				low = index + 1;
+			else if (MapStream::compare(k, temp, keySize))
+				high = index;
+			else if (!m_image->erased->count(index))
+				return index;
+			else
+				break; // Erased, but may have been inserted again
+		}
+
+		for (uint64_t i = 0; i < m_image->nUnsorted; ++i)
+		{
+			uint64_t index = i | MapStream::UNSORTED_INDEX_BIT;
+			auto temp = m_stream->getElem(*m_image, index);
+			if (memcmp(temp, k, keySize) == 0 && !m_image->erased->count(index))
+				return index;
+		}
+
+		return -1;
+	}
+
+	void ConcurrentMapStream::View::getValue(uint64_t index, MapStream::Val valBuff) const
+	{
+		memcpy(*valBuff, m_stream->getElem(*m_image, index) + m_stream->m_keySize, m_stream->m_valSize);
+	}
+
+	bool ConcurrentMapStream::View::get(MapStream::ConstKey key, MapStream::Val valBuff) const
+	{
+		uint64_t index = find(key);
+		if (index == -1)
+			return false;
+
+		getValue(index, valBuff);
+		return true;
+	}
+
+	uint64_t ConcurrentMapStream::View::size() const
+	{
+		return m_image->nSorted + m_image->nUnsorted - m_image->erased->size();
+	}
+
+	ConcurrentMapStream::ConcurrentMapStream(const std::string& path, AbstractFileIORef afio, uint64_t& keySize, uint64_t& valSize, WriteAheadLogRef wal)
+		: m_stream(path, afio, keySize, valSize, wal), m_keySize(keySize), m_valSize(valSize)
+	{
+		m_image.store(loadImage());
+	}
+
+	ConcurrentMapStream::~ConcurrentMapStream()
+	{
+		delete m_image.load();
+	}
+
+	ConcurrentMapStream::View ConcurrentMapStream::view() const
+	{
+		return View(this);
+	}
+
+	bool ConcurrentMapStream::get(MapStream::ConstKey key, MapStream::Val valBuff) const
+	{
+		return view().get(key, valBuff);
+	}
+
+	void ConcurrentMapStream::insert(MapStream::ConstKey key, MapStream::ConstVal value)
+	{
+		std::lock_guard lock(m_mtxWriter);
+
+		uint64_t nUnsorted = m_stream.m_header.nUnsorted;
+		m_stream.insert(key, value);
+		if (m_stream.m_header.nUnsorted == nUnsorted)
+			return;
+
+		auto current = m_image.load();
+		auto elem = appendElem(current->nUnsorted);
+		memcpy(elem, *key, m_keySize);
+		memcpy(elem + m_keySize, *value, m_valSize);
+
+		auto image = new Image(*current);
+		image->tail = m_tail;
+		++image->nUnsorted;
+		publish(image);
+	}
+
+	void ConcurrentMapStream::erase(MapStream::ConstKey key)
+	{
+		std::lock_guard lock(m_mtxWriter);
+
+		uint64_t index = m_stream.find(key);
+		if (index == -1)
+			return;
+
+		m_stream.erase(key);
+
+		auto current = m_image.load();
+		auto erased = std::make_shared<std::set<uint64_t>>(*current->erased);
+		erased->insert(index);
+
+		auto image = new Image(*current);
+		image->erased = erased;
+		publish(image);
+	}
+
+	void ConcurrentMapStream::optimize()
+	{
+		std::lock_guard lock(m_mtxWriter);
+
+		bool isModified = m_stream.m_header.nUnsorted > 0 || !m_stream.m_toErase.empty();
+		m_stream.optimize();
+		if (isModified)
+			publish(loadImage());
+	}
+
+	float ConcurrentMapStream::currOptimization()
+	{
+		std::lock_guard lock(m_mtxWriter);
+		return m_stream.currOptimization();
+	}
+
+	void ConcurrentMapStream::flush()
+	{
+		std::lock_guard lock(m_mtxWriter);
+
+		// Only erasing elements moves the others, otherwise the current image still matches the file
+		bool isErasing = !m_stream.m_toErase.empty();
+		m_stream.flush();
+		if (isErasing)
+			publish(loadImage());
+	}
+
+	const ConcurrentMapStream::Image* ConcurrentMapStream::loadImage()
+	{
+		auto image = new Image();
+		image->nSorted = m_stream.m_header.nSorted;
+		image->nUnsorted = m_stream.m_header.nUnsorted;
+
+		auto elemSize = m_stream.size(MapStream::Type::Elem);
+		auto sorted = std::make_shared<std::vector<char>>(image->nSorted * elemSize);
+		if (image->nSorted > 0)
+			m_stream.read(MapStream::Location::Sorted, image->nSorted, 0, sorted->data());
+
+		m_tail = std::make_shared<Tail>();
+		for (uint64_t i = 0; i < image->nUnsorted; i += SEGMENT_ELEMS)
+		{
+			uint64_t nElements = std::min(SEGMENT_ELEMS, image->nUnsorted - i);
+			m_stream.read(MapStream::Location::Unsorted, nElements, i, appendElem(i));
+		}
+
+		image->sorted = sorted;
+		image->tail = m_tail;
+		image->erased = std::make_shared<std::set<uint64_t>>(m_stream.m_toErase);
+		return image;
+	}
+
+	void ConcurrentMapStream::publish(const Image* image)
+	{
+		auto old = m_image.exchange(image);
+		m_epochs.retire(old);
+	}
+
+	char* ConcurrentMapStream::appendElem(uint64_t index)
+	{
+		uint64_t segment = index / SEGMENT_ELEMS;
+		if (segment >= m_tail->segments.size())
+		{
+			// Published images keep the old tail, they never look at the new slots
+			auto tail = std::make_shared<Tail>();
+			tail->segments.resize(std::max<uint64_t>(8, m_tail->segments.size() * 2));
+			std::copy(m_tail->segments.begin(), m_tail->segments.end(), tail->segments.begin());
+			m_tail = tail;
+		}
+
+		auto elemSize = m_keySize + m_valSize;
+		auto& data = m_tail->segments[segment];
+		if (!data)
+			data.reset(new char[SEGMENT_ELEMS * elemSize]);
+		return data.get() + (index % SEGMENT_ELEMS) * elemSize;
+	}
+
+	const char* ConcurrentMapStream::getElem(const Image& image, uint64_t index) const
+	{
+		auto elemSize = m_keySize + m_valSize;
+		if (index & MapStream::UNSORTED_INDEX_BIT)
+		{
+			index &= ~MapStream::UNSORTED_INDEX_BIT;
+			return image.tail->segments[index / SEGMENT_ELEMS].get() + (index % SEGMENT_ELEMS) * elemSize;
+		}
+		return image.sorted->data() + index * elemSize;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+#include "VFSFileSystem.h"
+#include "VFSChunkStore.h"
+
+namespace VFS {
+
+	// FileSystem that stores file contents as chunk lists in a ChunkStore.
+	//
+	// Directories and names live in the inner FileSystem, its files only hold the logical size
+	// followed by the ChunkRefs of the content. Identical chunks of all files are stored once.
+	// A write rechunks the chunks it touches (and the one before it, whose end may move) and
+	// keeps the others, so small patches to large files only add a few chunks. Released chunks
+	// are not reclaimed by the store. The chunk list of the most recently used file is cached.
+	class DedupFileSystem : public FileSystem
+	{
+	public:
+		DedupFileSystem(FileSystemRef inner, ChunkStoreRef store);
+	public:
+		ErrCode createFile(HashPathRef path) override;
+		ErrCode deleteFile(HashPathRef path) override;
+		ErrCode createDirectory(HashPathRef path) override;
+		ErrCode deleteDirectory(HashPathRef path) override;
+		ErrCode stat(HashPathRef path, Entry& entry) override;
+		ErrCode listDirectory(HashPathRef path, std::vector<Entry>& entries) override;
+		EntryType typeOf(HashPathRef path) override;
+	public:
+		ErrCode readFile(HashPathRef path, void* buffer, uint64_t count, uint64_t offset) override;
+		ErrCode writeFile(HashPathRef path, const void* buffer, uint64_t count, uint64_t offset) override;
+		ErrCode resizeFile(HashPathRef path, uint64_t newSize) override;
+		ErrCode setLastModTime(HashPathRef path, uint64_t modTime) override;
+	protected:
+		std::string getRealPath(HashPathRef path) override;
+	private:
+		typedef ChunkStore::ChunkRef ChunkRef;
+		static constexpr uint64_t SEGMENT_SIZE = 1 << 20;
+		struct ChunkList
+		{
+			uint64_t size = 0;
+			std::vector<ChunkRef> refs;
+			std::vector<uint64_t> offsets; // Start of every chunk, followed by size
+		};
+	private:
+		ErrCode loadList(HashPathRef path);
+		ErrCode storeList(HashPathRef path, uint64_t firstChanged);
+		// Replaces [offset, offset + count) with buffer and truncates or zero-extends to newSize
+		ErrCode rewrite(HashPathRef path, const void* buffer, uint64_t count, uint64_t offset, uint64_t newSize);
+		uint64_t chunkAt(uint64_t offset) const;
+		// Collect content in m_segment and store all chunks whose end cannot move anymore
+		bool appendSegment(const char* data, uint64_t size, std::vector<ChunkRef>& refs);
+		bool storeSegment(bool isFinal, std::vector<ChunkRef>& refs);
+		ErrCode readLogicalSize(HashPathRef path, uint64_t& size);
+	private:
+		std::mutex m_mtx;
+		FileSystemRef m_inner;
+		ChunkStoreRef m_store;
+		Hash m_listPath = 0;
+		bool m_hasList = false;
+		ChunkList m_list;
+		std::vector<char> m_segment;
+		std::vector<char> m_chunk;
+	};
+
+	DedupFileSystem::DedupFileSystem(FileSystemRef inner, ChunkStoreRef store)
+		: FileSystem(inner->getBasePath()), m_inner(inner), m_store(store)
+	{
+	}
+
+	ErrCode DedupFileSystem::createFile(HashPathRef path)
+	{
+		std::lock_guard lock(m_mtx);
+
+		ErrCode ec = m_inner->createFile(path);
+		if (ec != ErrCode::Success)
+			return ec;
+
+		uint64_t size = 0;
+		return m_inner->writeFile(path, &size, sizeof(size), 0);
+	}
+
+	ErrCode DedupFileSystem::deleteFile(HashPathRef path)
+	{
+		std::lock_guard lock(m_mtx);
+
+		ErrCode ec = loadList(path);
+		if (ec != ErrCode::Success)
+			return ec;
+		ec = m_inner->deleteFile(path);
+		if (ec != ErrCode::Success)
+			return ec;
+
+		for (auto& ref : m_list.refs)
+			m_store->release(ref);
+		m_hasList = false;
+		return ErrCode::Success;
+	}
+
+	ErrCode DedupFileSystem::createDirectory(HashPathRef path)
+	{
+		return m_inner->createDirectory(path);
+	}
+
+	ErrCode DedupFileSystem::deleteDirectory(HashPathRef path)
+	{
+		return m_inner->deleteDirectory(path);
+	}
+
+	ErrCode DedupFileSystem::stat(HashPathRef path, Entry& entry)
+	{
+		ErrCode ec = m_inner->stat(path, entry);
+		if (ec != ErrCode::Success || entry.type != EntryType::File)
+			return ec;
+
+		std::lock_guard lock(m_mtx);
+		return readLogicalSize(path, entry.size);
+	}
+
+	ErrCode DedupFileSystem::listDirectory(HashPathRef path, std::vector<Entry>& entries)
+	{
+		ErrCode ec = m_inner->listDirectory(path, entries);
+		if (ec != ErrCode::Success)
+			return ec;
+
+		std::lock_guard lock(m_mtx);
+		for (auto& entry : entries)
+		{
+			if (entry.type != EntryType::File)
+				continue;
+			ec = readLogicalSize(path.child(HashPath::Element(entry.name)), entry.size);
+			if (ec != ErrCode::Success)
+				return ec;
+		}
+		return ErrCode::Success;
+	}
+
+	DedupFileSystem::EntryType DedupFileSystem::typeOf(HashPathRef path)
+	{
+		return m_inner->typeOf(path);
+	}
+
+	ErrCode DedupFileSystem::readFile(HashPathRef path, void* buffer, uint64_t count, uint64_t offset)
+	{
+		std::lock_guard lock(m_mtx);
+
+		ErrCode ec = loadList(path);
+		if (ec != ErrCode::Success)
+			return ec;
+		if (offset + count > m_list.size)
+			return ErrCode::EndOfFile;
+
+		auto out = (char*)buffer;
+		for (uint64_t i = chunkAt(offset); count > 0; ++i)
+		{
+			uint64_t inChunk = offset - m_list.offsets[i];
+			uint64_t nBytes = std::min<uint64_t>(count, m_list.refs[i].size - inChunk);
+			if (!m_store->read(m_list.refs[i], out, nBytes, inChunk))
+				return ErrCode::IOError;
+			out += nBytes;
+			offset += nBytes;
+			count -= nBytes;
+		}
+		return ErrCode::Success;
+	}
+
+	ErrCode DedupFileSystem::writeFile(HashPathRef path, const void* buffer, uint64_t count, uint64_t offset)
+	{
+		std::lock_guard lock(m_mtx);
+
+		ErrCode ec = loadList(path);
+		if (ec != ErrCode::Success)
+			return ec;
+		return rewrite(path, buffer, count, offset, std::max(m_list.size, offset + count));
+	}
+
+	ErrCode DedupFileSystem::resizeFile(HashPathRef path, uint64_t newSize)
+	{
+		std::lock_guard lock(m_mtx);
+
+		ErrCode ec = loadList(path);
+		if (ec != ErrCode::Success)
+			return ec;
+		return rewrite(path, nullptr, 0, newSize, newSize);
+	}
+
+	ErrCode DedupFileSystem::setLastModTime(HashPathRef path, uint64_t modTime)
+	{
+		return m_inner->setLastModTime(path, modTime);
+	}
+
+	std::string DedupFileSystem::getRealPath(HashPathRef path)
+	{
+		return m_inner->getRealPath(path);
+	}
+
+	ErrCode DedupFileSystem::loadList(HashPathRef path)
+	{
+		if (m_hasList && m_listPath == path.hash())
+			return ErrCode::Success;
+		m_hasList = false;
+
+		Entry entry;
+		ErrCode ec = m_inner->stat(path, entry);
+		if (ec != ErrCode::Success)
+			return ec;
+		if (entry.type != EntryType::File)
+			return ErrCode::NotAFile;
+
+		// Files created by the inner FileSystem directly are empty
+		m_list.size = 0;
+		m_list.refs.clear();
+		if (entry.size >= sizeof(uint64_t))
+		{
+			m_list.refs.resize((entry.size - sizeof(uint64_t)) / sizeof(ChunkRef));
+			ec = m_inner->readFile(path, &m_list.size, sizeof(uint64_t), 0);
+			if (ec == ErrCode::Success && !m_list.refs.empty())
+				ec = m_inner->readFile(path, m_list.refs.data(), m_list.refs.size() * sizeof(ChunkRef), sizeof(uint64_t));
+			if (ec != ErrCode::Success)
+				return ec;
+		}
+
+		m_list.offsets.resize(m_list.refs.size() + 1);
+		m_list.offsets[0] = 0;
+		for (uint64_t i = 0; i < m_list.refs.size(); ++i)
+			m_list.offsets[i + 1] = m_list.offsets[i] + m_list.refs[i].size;
+		if (m_list.offsets.back() != m_list.size)
+			return ErrCode::IOError;
+
+		m_listPath = path.hash();
+		m_hasList = true;
+		return ErrCode::Success;
+	}
+
+	ErrCode DedupFileSystem::storeList(HashPathRef path, uint64_t firstChanged)
+	{
+		// Only the size and the refs from the first changed one on are written
+		uint64_t listSize = sizeof(uint64_t) + m_list.refs.size() * sizeof(ChunkRef);
+		ErrCode ec = m_inner->resizeFile(path, listSize);
+		if (ec == ErrCode::Success)
+			ec = m_inner->writeFile(path, &m_list.size, sizeof(uint64_t), 0);
+		if (ec == ErrCode::Success && firstChanged < m_list.refs.size())
+			ec = m_inner->writeFile(path, m_list.refs.data() + firstChanged, (m_list.refs.size() - firstChanged) * sizeof(ChunkRef), sizeof(uint64_t) + firstChanged * sizeof(ChunkRef));
+		if (ec != ErrCode::Success)
+			m_hasList = false;
+		return ec;
+	}
+
+	ErrCode DedupFileSystem::rewrite(HashPathRef path, const void* buffer, uint64_t count, uint64_t offset, uint64_t newSize)
+	{
+		uint64_t oldSize = m_list.size;
+		if (count == 0 && newSize == oldSize)
+			return ErrCode::Success;
+
+		// Chunks [first, last) are replaced, a change of the size always reaches the end. Only
+		// the part below newSize is read, a truncation does not touch the dropped chunks.
+		uint64_t nChunks = m_list.refs.size();
+		uint64_t changeBegin = std::min({ offset, oldSize, newSize });
+		uint64_t first = nChunks == 0 ? 0 : chunkAt(changeBegin > 0 ? changeBegin - 1 : 0);
+		uint64_t last = newSize != oldSize ? nChunks : chunkAt(offset + count - 1) + 1;
+		uint64_t segBegin = m_list.offsets[first];
+		uint64_t segEnd = last == nChunks ? newSize : m_list.offsets[last];
+		uint64_t writeEnd = offset + count;
+
+		// The new content is assembled piece by piece: written bytes, old bytes and zeros
+		static const char zeros[ChunkStore::MAX_CHUNK_SIZE] = {};
+		std::vector<ChunkRef> newRefs;
+		m_segment.clear();
+		bool isOk = true;
+		for (uint64_t pos = segBegin; isOk && pos < segEnd; )
+		{
+			uint64_t end = std::min(segEnd, pos + SEGMENT_SIZE);
+			const char* data = zeros;
+			if (pos >= offset && pos < writeEnd)
+			{
+				end = std::min(end, writeEnd);
+				data = (const char*)buffer + (pos - offset);
+			}
+			else
+			{
+				if (pos < offset)
+					end = std::min(end, offset);
+				if (pos < oldSize)
+				{
+					uint64_t i = chunkAt(pos);
+					end = std::min(end, m_list.offsets[i + 1]);
+					m_chunk.resize(end - pos);
+					isOk = m_store->read(m_list.refs[i], m_chunk.data(), end - pos, pos - m_list.offsets[i]);
+					data = m_chunk.data();
+				}
+				else
+				{
+					end = std::min(end, pos + ChunkStore::MAX_CHUNK_SIZE);
+				}
+			}
+			isOk = isOk && appendSegment(data, end - pos, newRefs);
+			pos = end;
+		}
+		if (!isOk || !storeSegment(true, newRefs))
+		{
+			for (auto& ref : newRefs)
+				m_store->release(ref);
+			return ErrCode::IOError;
+		}
+
+		for (uint64_t i = first; i < last; ++i)
+			m_store->release(m_list.refs[i]);
+
+		m_list.refs.erase(m_list.refs.begin() + first, m_list.refs.begin() + last);
+		m_list.refs.insert(m_list.refs.begin() + first, newRefs.begin(), newRefs.end());
+		m_list.size = newSize;
+		m_list.offsets.resize(m_list.refs.size() + 1);
+		for (uint64_t i = first; i < m_list.refs.size(); ++i)
+			m_list.offsets[i + 1] = m_list.offsets[i] + m_list.refs[i].size;
+
+		return storeList(path, first);
+	}
+
+	uint64_t DedupFileSystem::chunkAt(uint64_t offset) const
+	{
+		auto it = std::upper_bound(m_list.offsets.begin(), m_list.offsets.end(), offset);
+		uint64_t index = it - m_list.offsets.begin() - 1;
+		return std::min<uint64_t>(index, m_list.refs.size() - 1);
+	}
+
+	bool DedupFileSystem::appendSegment(const char* data, uint64_t size, std::vector<ChunkRef>& refs)
+	{
+		m_segment.insert(m_segment.end(), data, data + size);
+		return m_segment.size() < SEGMENT_SIZE || storeSegment(false, refs);
+	}
+
+	bool DedupFileSystem::storeSegment(bool isFinal, std::vector<ChunkRef>& refs)
+	{
+		// A cut with at least MAX_CHUNK_SIZE bytes behind it does not depend on what follows,
+		// the chunks end where they would if the whole content was stored at once
+		uint64_t nComplete = m_segment.size();
+		if (!isFinal)
+		{
+			nComplete = 0;
+			while (m_segment.size() - nComplete >= ChunkStore::MAX_CHUNK_SIZE)
+				nComplete += ChunkStore::nextCut((const uint8_t*)m_segment.data() + nComplete, m_segment.size() - nComplete);
+		}
+
+		if (!m_store->store(m_segment.data(), nComplete, refs))
+			return false;
+		m_segment.erase(m_segment.begin(), m_segment.begin() + nComplete);
+		return true;
+	}
+
+	ErrCode DedupFileSystem::readLogicalSize(HashPathRef path, uint64_t& size)
+	{
+		if (m_hasList && m_listPath == path.hash())
+		{
+			size = m_list.size;
+			return ErrCode::Success;
+		}
+
+		size = 0;
+		ErrCode ec = m_inner->readFile(path, &size, sizeof(size), 0);
+		return ec == ErrCode::EndOfFile ? ErrCode::Success : ec;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,220 @@
+#pragma once
+
+#include "VFSMapStream.h"
+#include "VFSMapStreamBuilder.h"
+#include "VFSHashPath.h"
+
+#include <vector>
+#include <cstring>
+
+namespace VFS {
+
+	// Directory metadata stored in a MapStream, keyed by (parent path hash, name hash).
+	//
+	// All children of a directory share the first half of their key, so once the map is
+	// optimized listing a directory is one binary search followed by a sequential read of
+	// a contiguous range, no matter how many other entries the index holds.
+	class DirectoryIndex
+	{
+	public:
+		enum class EntryType : uint8_t { None = 0, File, Directory };
+		struct Entry
+		{
+			EntryType type = EntryType::None;
+			uint64_t size = 0;
+			uint64_t modTime = 0;
+			std::string name;
+		};
+		typedef std::function<bool(const Entry& entry)> ListFunc;
+		static constexpr uint64_t MAX_NAME_LENGTH = 255;
+		// Writes a whole index in one pass with MapStreamBuilder, the entries may come in any order.
+		// Of entries with the same path the first one added is kept.
+		class Builder
+		{
+		public:
+			Builder(const std::string& path, AbstractFileIORef afio, uint64_t memoryBudget = 64ull << 20);
+		public:
+			bool add(HashPathRef path, EntryType type, uint64_t size = 0, uint64_t modTime = 0);
+			bool finish();
+		private:
+			MapStreamBuilder m_builder;
+		};
+	public:
+		DirectoryIndex(const std::string& path, AbstractFileIORef afio, WriteAheadLogRef wal = nullptr);
+	public:
+		// Adds or replaces the entry of path, its parent directory is not created implicitly
+		bool add(HashPathRef path, EntryType type, uint64_t size = 0, uint64_t modTime = 0);
+		// Removes the entry of path only, children of a removed directory stay in the index
+		bool remove(HashPathRef path);
+		bool stat(HashPathRef path, Entry& entry) const;
+		uint64_t list(HashPathRef dir, const ListFunc& func) const;
+		std::vector<Entry> list(HashPathRef dir) const;
+		void optimize();
+		float currOptimization() const;
+		void flush();
+	private:
+		#pragma pack(push, 1)
+		struct Key
+		{
+			Hash parent;
+			Hash name;
+		};
+		struct Value
+		{
+			EntryType type;
+			uint64_t size;
+			uint64_t modTime;
+			uint8_t nameLength;
+			char name[MAX_NAME_LENGTH];
+		};
+		#pragma pack(pop)
+	private:
+		static Key makeKey(HashPathRef path);
+		static bool makeValue(HashPathRef path, EntryType type, uint64_t size, uint64_t modTime, Value& value);
+		static Entry toEntry(const Value& value);
+	private:
+		uint64_t m_keySize = sizeof(Key);
+		uint64_t m_valSize = sizeof(Value);
+		MapStream m_stream;
+		bool m_isValid = false;
+	};
+
+	DirectoryIndex::DirectoryIndex(const std::string& path, AbstractFileIORef afio, WriteAheadLogRef wal)
+		: m_stream(path, afio, m_keySize, m_valSize, wal)
+	{
+		// An existing file with a different layout is left alone
+		m_isValid = (m_keySize == sizeof(Key) && m_valSize == sizeof(Value));
+	}
+
+	bool DirectoryIndex::add(HashPathRef path, EntryType type, uint64_t size, uint64_t modTime)
+	{
+		Value value;
+		if (!m_isValid || !makeValue(path, type, size, modTime, value))
+			return false;
+
+		Key key = makeKey(path);
+		m_stream.upsert(&key, &value);
+		return true;
+	}
+
+	bool DirectoryIndex::remove(HashPathRef path)
+	{
+		if (!m_isValid || path.depth() == 0)
+			return false;
+
+		Key key = makeKey(path);
+		if (m_stream.find(&key) == -1)
+			return false;
+
+		m_stream.erase(&key);
+		return true;
+	}
+
+	bool DirectoryIndex::stat(HashPathRef path, Entry& entry) const
+	{
+		if (!m_isValid || path.depth() == 0)
+			return false;
+
+		Key key = makeKey(path);
+		uint64_t index = m_stream.find(&key);
+		if (index == -1)
+			return false;
+
+		Value value;
+		m_stream.getValue(index, &value);
+		entry = toEntry(value);
+
+		// Element hashes may collide, the stored name has the final say
+		return entry.name == path[path.depth() - 1].asString();
+	}
+
+	uint64_t DirectoryIndex::list(HashPathRef dir, const ListFunc& func) const
+	{
+		if (!m_isValid)
+			return 0;
+
+		Hash parent = dir.hash();
+		return m_stream.scan(&parent, sizeof(parent), [&func](const void*, const void* value, uint64_t)
+			{
+				Value v;
+				memcpy(&v, value, sizeof(v));
+				return func(toEntry(v));
+			}
+		);
+	}
+
+	std::vector<DirectoryIndex::Entry> DirectoryIndex::list(HashPathRef dir) const
+	{
+		std::vector<Entry> entries;
+		list(dir, [&entries](const Entry& entry) { entries.push_back(entry); return true; });
+		return entries;
+	}
+
+	void DirectoryIndex::optimize()
+	{
+		m_stream.optimize();
+	}
+
+	float DirectoryIndex::currOptimization() const
+	{
+		return m_stream.currOptimization();
+	}
+
+	void DirectoryIndex::flush()
+	{
+		m_stream.flush();
+	}
+
+	DirectoryIndex::Key DirectoryIndex::makeKey(HashPathRef path)
+	{
+		return { path.hash(path.depth() - 1), path[path.depth() - 1].asHash() };
+	}
+
+	bool DirectoryIndex::makeValue(HashPathRef path, EntryType type, uint64_t size, uint64_t modTime, Value& value)
+	{
+		if (path.depth() == 0)
+			return false;
+
+		auto& name = path[path.depth() - 1].asString();
+		if (name.size() > MAX_NAME_LENGTH)
+			return false;
+
+		value = {};
+		value.type = type;
+		value.size = size;
+		value.modTime = modTime;
+		value.nameLength = (uint8_t)name.size();
+		memcpy(value.name, name.data(), name.size());
+		return true;
+	}
+
+	DirectoryIndex::Entry DirectoryIndex::toEntry(const Value& value)
+	{
+		Entry entry;
+		entry.type = value.type;
+		entry.size = value.size;
+		entry.modTime = value.modTime;
+		entry.name.assign(value.name, std::min<uint64_t>(value.nameLength, MAX_NAME_LENGTH));
+		return entry;
+	}
+
+	DirectoryIndex::Builder::Builder(const std::string& path, AbstractFileIORef afio, uint64_t memoryBudget)
+		: m_builder(path, afio, sizeof(Key), sizeof(Value), MapStreamBuilder::Mode::Unsorted, memoryBudget)
+	{
+	}
+
+	bool DirectoryIndex::Builder::add(HashPathRef path, EntryType type, uint64_t size, uint64_t modTime)
+	{
+		Value value;
+		if (!makeValue(path, type, size, modTime, value))
+			return false;
+
+		Key key = makeKey(path);
+		return m_builder.add(&key, &value) == MapStreamBuilder::ErrCode::Success;
+	}
+
+	bool DirectoryIndex::Builder::finish()
+	{
+		return m_builder.finish() == MapStreamBuilder::ErrCode::Success;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <filesystem>
+
+#include "VFSAbstractFileIO.h"
+#include "VFSDirectoryIndex.h"
+#include "VFSHashPath.h"
+
+namespace VFS {
+
+	// Crawls a host directory tree with work-stealing threads and persists it as a DirectoryIndex.
+	//
+	// Every worker owns a deque of directories to list. It pops from the back of its own deque
+	// (depth first, so that sibling entries stay close) and steals from the front of the others
+	// once it runs dry. Directory entries carry the mtime of the directory, update() only lists
+	// directories whose mtime differs from the one in the old index and copies the children of
+	// all others from it. Files changed in place do not touch the mtime of their directory and
+	// keep their old size and mtime until something in that directory is added or removed.
+	class DirectoryScanner
+	{
+	public:
+		struct Stats
+		{
+			uint64_t nDirectories = 0;
+			uint64_t nFiles = 0;
+			uint64_t nListed = 0; // Directories read from the host
+			uint64_t nReused = 0; // Directories taken from the old index
+			uint64_t nSkipped = 0; // Names that do not fit into the index
+			double seconds = 0.0;
+			bool isWritten = false; // False if the new index could not be written or moved into place, the old one stays then
+		};
+	public:
+		DirectoryScanner(const std::string& rootPath, uint64_t nThreads = std::thread::hardware_concurrency());
+	public:
+		// Crawls the whole tree and writes a new index to indexPath
+		Stats build(const std::string& indexPath, AbstractFileIORef afio);
+		// Validates the index at indexPath and rewrites it, falls back to build() if there is none
+		Stats update(const std::string& indexPath, AbstractFileIORef afio);
+	private:
+		struct Record
+		{
+			HashPath path;
+			DirectoryIndex::EntryType type;
+			uint64_t size;
+			uint64_t modTime;
+		};
+		struct Task
+		{
+			HashPath dir;
+			uint64_t oldModTime; // Of the old index, 0 if unknown
+		};
+		struct Worker
+		{
+			std::mutex mtx;
+			std::deque<Task> tasks;
+			std::vector<Record> records;
+			Stats stats;
+		};
+		struct Crawl
+		{
+			std::vector<std::unique_ptr<Worker>> workers;
+			std::atomic<uint64_t> nPending = 0; // Directories queued or being listed
+			std::atomic<int64_t> nQueued = 0; // Directories in the deques, briefly negative while a push is counted
+			std::mutex mtxIdle;
+			std::condition_variable cvIdle; // Signalled when a task is queued or nPending drops to 0
+			const DirectoryIndex* oldIndex = nullptr;
+			std::mutex mtxOldIndex;
+			DirectoryIndex::Builder* builder = nullptr;
+			std::mutex mtxBuilder;
+		};
+		static constexpr uint64_t RECORD_BATCH_SIZE = 4096;
+	private:
+		// Writes the crawled entries to '<indexPath>.tmp'
+		Stats crawl(const std::string& indexPath, AbstractFileIORef afio, const DirectoryIndex* oldIndex);
+		static bool replaceIndex(const std::string& indexPath, AbstractFileIORef afio);
+		void work(Crawl& crawl, uint64_t self);
+		bool takeTask(Crawl& crawl, uint64_t self, Task& task);
+		void pushTask(Crawl& crawl, uint64_t self, HashPath&& dir, uint64_t oldModTime);
+		void processDirectory(Crawl& crawl, uint64_t self, const Task& task);
+		void flushRecords(Crawl& crawl, Worker& worker);
+		static uint64_t toModTime(std::filesystem::file_time_type time);
+	private:
+		std::string m_rootPath;
+		uint64_t m_nThreads;
+	};
+
+	DirectoryScanner::DirectoryScanner(const std::string& rootPath, uint64_t nThreads)
+		: m_rootPath(rootPath), m_nThreads(std::max<uint64_t>(1, nThreads))
+	{
+	}
+
+	DirectoryScanner::Stats DirectoryScanner::build(const std::string& indexPath, AbstractFileIORef afio)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		Stats stats = crawl(indexPath, afio, nullptr);
+		stats.isWritten = stats.isWritten && replaceIndex(indexPath, afio);
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		return stats;
+	}
+
+	DirectoryScanner::Stats DirectoryScanner::update(const std::string& indexPath, AbstractFileIORef afio)
+	{
+		if (!afio->exists(indexPath))
+			return build(indexPath, afio);
+
+		auto begin = std::chrono::steady_clock::now();
+		Stats stats;
+		{
+			DirectoryIndex oldIndex(indexPath, afio);
+			stats = crawl(indexPath, afio, &oldIndex);
+		}
+		stats.isWritten = stats.isWritten && replaceIndex(indexPath, afio);
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		return stats;
+	}
+
+	DirectoryScanner::Stats DirectoryScanner::crawl(const std::string& indexPath, AbstractFileIORef afio, const DirectoryIndex* oldIndex)
+	{
+		// The new index is written next to the old one, which is read while crawling
+		std::string tmpPath = indexPath + ".tmp";
+		DirectoryIndex::Builder builder(tmpPath, afio);
+
+		Crawl crawl;
+		crawl.oldIndex = oldIndex;
+		crawl.builder = &builder;
+		for (uint64_t i = 0; i < m_nThreads; ++i)
+			crawl.workers.push_back(std::make_unique<Worker>());
+		pushTask(crawl, 0, HashPath(), 0);
+
+		std::vector<std::thread> threads;
+		for (uint64_t i = 1; i < m_nThreads; ++i)
+			threads.emplace_back(&DirectoryScanner::work, this, std::ref(crawl), i);
+		work(crawl, 0);
+		for (auto& thread : threads)
+			thread.join();
+
+		Stats stats;
+		for (auto& worker : crawl.workers)
+		{
+			flushRecords(crawl, *worker);
+			stats.nDirectories += worker->stats.nDirectories;
+			stats.nFiles += worker->stats.nFiles;
+			stats.nListed += worker->stats.nListed;
+			stats.nReused += worker->stats.nReused;
+			stats.nSkipped += worker->stats.nSkipped;
+		}
+		stats.isWritten = builder.finish();
+		return stats;
+	}
+
+	bool DirectoryScanner::replaceIndex(const std::string& indexPath, AbstractFileIORef afio)
+	{
+		afio->closeMatchingStreams(indexPath);
+		afio->closeMatchingStreams(indexPath + ".tmp");
+		std::error_code ec;
+		std::filesystem::rename(indexPath + ".tmp", indexPath, ec);
+		return !ec;
+	}
+
+	void DirectoryScanner::work(Crawl& crawl, uint64_t self)
+	{
+		Task task;
+		while (true)
+		{
+			if (!takeTask(crawl, self, task))
+			{
+				// Idle workers sleep until there is something to steal or the crawl is done
+				std::unique_lock lock(crawl.mtxIdle);
+				if (crawl.nPending.load() == 0)
+					break;
+				crawl.cvIdle.wait(lock, [&crawl]() { return crawl.nQueued.load() > 0 || crawl.nPending.load() == 0; });
+				continue;
+			}
+
+			processDirectory(crawl, self, task);
+			if (--crawl.nPending == 0)
+			{
+				std::lock_guard lock(crawl.mtxIdle);
+				crawl.cvIdle.notify_all();
+			}
+		}
+	}
+
+	bool DirectoryScanner::takeTask(Crawl& crawl, uint64_t self, Task& task)
+	{
+		{
+			auto& own = *crawl.workers[self];
+			std::lock_guard lock(own.mtx);
+			if (!own.tasks.empty())
+			{
+				task = std::move(own.tasks.back());
+				own.tasks.pop_back();
+				--crawl.nQueued;
+				return true;
+			}
+		}
+
+		// Steal the oldest entry, it is closest to the root and likely has the most work below it
+		for (uint64_t i = 1; i < crawl.workers.size(); ++i)
+		{
+			auto& victim = *crawl.workers[(self + i) % crawl.workers.size()];
+			std::lock_guard lock(victim.mtx);
+			if (!victim.tasks.empty())
+			{
+				task = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+				--crawl.nQueued;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void DirectoryScanner::pushTask(Crawl& crawl, uint64_t self, HashPath&& dir, uint64_t oldModTime)
+	{
+		++crawl.nPending;
+		{
+			auto& own = *crawl.workers[self];
+			std::lock_guard lock(own.mtx);
+			own.tasks.push_back({ std::move(dir), oldModTime });
+		}
+
+		// Counted under mtxIdle, so a worker about to wait cannot miss it
+		std::lock_guard lock(crawl.mtxIdle);
+		++crawl.nQueued;
+		crawl.cvIdle.notify_one();
+	}
+
+	void DirectoryScanner::processDirectory(Crawl& crawl, uint64_t self, const Task& task)
+	{
+		auto& worker = *crawl.workers[self];
+		const HashPath& dir = task.dir;
+		std::error_code ec;
+		std::string realPath = dir.getRealPath(m_rootPath);
+		uint64_t modTime = toModTime(std::filesystem::last_write_time(realPath, ec));
+		if (ec)
+			return;
+
+		// Directories add their own entry, so that it always carries their current mtime
+		if (dir.depth() > 0)
+		{
+			worker.records.push_back({ dir, DirectoryIndex::EntryType::Directory, 0, modTime });
+			++worker.stats.nDirectories;
+		}
+
+		// The old mtimes of subdirectories come with their parent's listing, no lookup per directory
+		std::vector<DirectoryIndex::Entry> oldChildren;
+		if (crawl.oldIndex)
+		{
+			std::lock_guard lock(crawl.mtxOldIndex);
+			oldChildren = crawl.oldIndex->list(dir);
+		}
+
+		bool isUnchanged = dir.depth() > 0 && task.oldModTime == modTime;
+		if (isUnchanged)
+		{
+			++worker.stats.nReused;
+			for (auto& child : oldChildren)
+			{
+				HashPath childPath = dir.child(HashPath::Element(child.name));
+				if (child.type == DirectoryIndex::EntryType::Directory)
+				{
+					pushTask(crawl, self, std::move(childPath), child.modTime);
+					continue;
+				}
+				worker.records.push_back({ std::move(childPath), child.type, child.size, child.modTime });
+				++worker.stats.nFiles;
+			}
+		}
+		else
+		{
+			std::unordered_map<Hash, uint64_t> oldDirModTimes;
+			for (auto& child : oldChildren)
+				if (child.type == DirectoryIndex::EntryType::Directory)
+					oldDirModTimes[HashPath::Element(child.name).asHash()] = child.modTime;
+
+			++worker.stats.nListed;
+			for (auto& dirEntry : std::filesystem::directory_iterator(realPath, std::filesystem::directory_options::skip_permission_denied, ec))
+			{
+				// Symlinks are not followed, they could form cycles
+				if (dirEntry.is_symlink(ec))
+					continue;
+
+				std::string name = dirEntry.path().filename().string();
+				if (name.size() > DirectoryIndex::MAX_NAME_LENGTH)
+				{
+					++worker.stats.nSkipped;
+					continue;
+				}
+
+				HashPath::Element elem(name);
+				HashPath childPath = dir.child(elem);
+				if (dirEntry.is_directory(ec))
+				{
+					auto it = oldDirModTimes.find(elem.asHash());
+					pushTask(crawl, self, std::move(childPath), it == oldDirModTimes.end() ? 0 : it->second);
+				}
+				else if (dirEntry.is_regular_file(ec))
+				{
+					uint64_t size = dirEntry.file_size(ec);
+					uint64_t fileModTime = toModTime(dirEntry.last_write_time(ec));
+					worker.records.push_back({ std::move(childPath), DirectoryIndex::EntryType::File, size, fileModTime });
+					++worker.stats.nFiles;
+				}
+			}
+		}
+
+		if (worker.records.size() >= RECORD_BATCH_SIZE)
+			flushRecords(crawl, worker);
+	}
+
+	void DirectoryScanner::flushRecords(Crawl& crawl, Worker& worker)
+	{
+		std::lock_guard lock(crawl.mtxBuilder);
+		for (auto& record : worker.records)
+			if (!crawl.builder->add(record.path, record.type, record.size, record.modTime))
+				++worker.stats.nSkipped;
+		worker.records.clear();
+	}
+
+	uint64_t DirectoryScanner::toModTime(std::filesystem::file_time_type time)
+	{
+		// Nanoseconds since the epoch of the file clock, as in NativeFileSystem
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+	}
+}
\ No newline at end of file
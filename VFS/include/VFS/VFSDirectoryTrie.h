@@ -0,0 +1,287 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <algorithm>
+
+#include "VFSHashPath.h"
+#include "VFSSmallVector.h"
+#include "VFSDirectoryIndex.h"
+
+namespace VFS {
+
+	// In-memory trie of the paths known to exist in a file system, keyed by element hash.
+	//
+	// Children are kept in small arrays sorted by hash, so a lookup is one binary search per
+	// element. Paths known to be missing go into a bounded negative cache, directories whose
+	// children were all inserted can be marked complete so that misses inside them are
+	// answered without the cache. Anything else is Unknown and has to be checked by the owner.
+	class DirectoryTrie
+	{
+	public:
+		typedef DirectoryIndex::EntryType EntryType;
+		enum class Lookup
+		{
+			Unknown = 0,
+			Exists,
+			Missing
+		};
+	public:
+		DirectoryTrie(uint64_t maxNegativeEntries = 4096);
+	public:
+		// Returns Exists and sets type if the path is in the trie
+		Lookup lookup(HashPathRef path, EntryType* type = nullptr) const;
+		// Inserts the path, missing parents are inserted as directories
+		void insert(HashPathRef path, EntryType type);
+		// Removes the path and everything below it and remembers it as missing
+		void erase(HashPathRef path);
+		// Marks all children of an existing directory as known
+		void markComplete(HashPathRef dir);
+		void addMissing(HashPathRef path);
+		void clear();
+		// Number of paths in the trie, the root is not counted
+		uint64_t size() const;
+		uint64_t nMissing() const;
+	private:
+		struct Child
+		{
+			Hash hash;
+			uint32_t node;
+		};
+		struct Node
+		{
+			EntryType type = EntryType::Directory;
+			bool isComplete = false;
+			SmallVector<Child, 4> children;
+		};
+		struct NegativeSlot
+		{
+			Hash hash;
+			uint64_t seq;
+		};
+		static constexpr uint32_t ROOT = 0;
+		static constexpr uint32_t NO_NODE = UINT32_MAX;
+	private:
+		uint32_t findChild(uint32_t node, Hash elemHash) const;
+		uint32_t findNode(HashPathRef path, uint64_t& depthReached) const;
+		uint32_t newNode(EntryType type);
+		void freeSubtree(uint32_t node);
+		void eraseMissing(Hash pathHash);
+	private:
+		mutable std::shared_mutex m_mtx;
+		std::vector<Node> m_nodes;
+		std::vector<uint32_t> m_freeNodes;
+		// Negative cache, m_missingRing holds the insertion order for FIFO eviction
+		const uint64_t m_maxMissing;
+		std::unordered_map<Hash, uint64_t> m_missing;
+		std::vector<NegativeSlot> m_missingRing;
+		uint64_t m_missingSeq = 0;
+	};
+
+	DirectoryTrie::DirectoryTrie(uint64_t maxNegativeEntries)
+		: m_maxMissing(std::max<uint64_t>(1, maxNegativeEntries))
+	{
+		clear();
+	}
+
+	DirectoryTrie::Lookup DirectoryTrie::lookup(HashPathRef path, EntryType* type) const
+	{
+		std::shared_lock lock(m_mtx);
+
+		uint64_t depthReached = 0;
+		uint32_t node = findNode(path, depthReached);
+		if (depthReached == path.depth())
+		{
+			if (type)
+				*type = m_nodes[node].type;
+			return Lookup::Exists;
+		}
+
+		// Nothing can live below a file or next to the known children of a complete directory
+		if (m_nodes[node].type == EntryType::File || m_nodes[node].isComplete)
+			return Lookup::Missing;
+		for (uint64_t d = depthReached + 1; d <= path.depth(); ++d)
+			if (m_missing.find(path.hash(d)) != m_missing.end())
+				return Lookup::Missing;
+		return Lookup::Unknown;
+	}
+
+	void DirectoryTrie::insert(HashPathRef path, EntryType type)
+	{
+		std::unique_lock lock(m_mtx);
+
+		uint32_t node = ROOT;
+		for (uint64_t d = 0; d < path.depth(); ++d)
+		{
+			bool isLeaf = d + 1 == path.depth();
+			Hash elemHash = path[d].asHash();
+			uint32_t child = findChild(node, elemHash);
+			if (child == NO_NODE)
+			{
+				eraseMissing(path.hash(d + 1));
+				child = newNode(isLeaf ? type : EntryType::Directory);
+
+				// Keep the children sorted by hash
+				auto& children = m_nodes[node].children;
+				children.push_back({ elemHash, child });
+				for (uint64_t i = children.size() - 1; i > 0 && children[i - 1].hash > elemHash; --i)
+					std::swap(children[i - 1], children[i]);
+			}
+			else if (isLeaf)
+			{
+				m_nodes[child].type = type;
+			}
+			node = child;
+		}
+	}
+
+	void DirectoryTrie::erase(HashPathRef path)
+	{
+		std::unique_lock lock(m_mtx);
+
+		if (path.depth() == 0)
+			return;
+
+		uint64_t depthReached = 0;
+		uint32_t parent = findNode(path.parent(), depthReached);
+		if (depthReached == path.depth() - 1)
+		{
+			auto& children = m_nodes[parent].children;
+			Hash elemHash = path[path.depth() - 1].asHash();
+			for (uint64_t i = 0; i < children.size(); ++i)
+			{
+				if (children[i].hash != elemHash)
+					continue;
+
+				freeSubtree(children[i].node);
+				for (uint64_t j = i + 1; j < children.size(); ++j)
+					children[j - 1] = children[j];
+				children.pop_back();
+				break;
+			}
+		}
+
+		lock.unlock();
+		addMissing(path);
+	}
+
+	void DirectoryTrie::markComplete(HashPathRef dir)
+	{
+		std::unique_lock lock(m_mtx);
+
+		uint64_t depthReached = 0;
+		uint32_t node = findNode(dir, depthReached);
+		if (depthReached == dir.depth() && m_nodes[node].type == EntryType::Directory)
+			m_nodes[node].isComplete = true;
+	}
+
+	void DirectoryTrie::addMissing(HashPathRef path)
+	{
+		std::unique_lock lock(m_mtx);
+
+		Hash pathHash = path.hash();
+		if (m_missing.find(pathHash) != m_missing.end())
+			return;
+
+		auto& slot = m_missingRing[m_missingSeq % m_maxMissing];
+		if (m_missingSeq >= m_maxMissing)
+		{
+			// Evict the oldest entry unless it was erased and added again since
+			auto it = m_missing.find(slot.hash);
+			if (it != m_missing.end() && it->second == slot.seq)
+				m_missing.erase(it);
+		}
+
+		slot = { pathHash, m_missingSeq };
+		m_missing[pathHash] = m_missingSeq;
+		++m_missingSeq;
+	}
+
+	void DirectoryTrie::clear()
+	{
+		std::unique_lock lock(m_mtx);
+
+		m_nodes.clear();
+		m_freeNodes.clear();
+		m_nodes.emplace_back(); // Root
+		m_missing.clear();
+		m_missingRing.assign(m_maxMissing, { 0, 0 });
+		m_missingSeq = 0;
+	}
+
+	uint64_t DirectoryTrie::size() const
+	{
+		std::shared_lock lock(m_mtx);
+		return m_nodes.size() - m_freeNodes.size() - 1;
+	}
+
+	uint64_t DirectoryTrie::nMissing() const
+	{
+		std::shared_lock lock(m_mtx);
+		return m_missing.size();
+	}
+
+	uint32_t DirectoryTrie::findChild(uint32_t node, Hash elemHash) const
+	{
+		auto& children = m_nodes[node].children;
+		auto it = std::lower_bound(children.begin(), children.end(), elemHash,
+			[](const Child& child, Hash hash) { return child.hash < hash; }
+		);
+		if (it == children.end() || it->hash != elemHash)
+			return NO_NODE;
+		return it->node;
+	}
+
+	uint32_t DirectoryTrie::findNode(HashPathRef path, uint64_t& depthReached) const
+	{
+		uint32_t node = ROOT;
+		for (depthReached = 0; depthReached < path.depth(); ++depthReached)
+		{
+			uint32_t child = findChild(node, path[depthReached].asHash());
+			if (child == NO_NODE)
+				break;
+			node = child;
+		}
+		return node;
+	}
+
+	uint32_t DirectoryTrie::newNode(EntryType type)
+	{
+		uint32_t node;
+		if (!m_freeNodes.empty())
+		{
+			node = m_freeNodes.back();
+			m_freeNodes.pop_back();
+			m_nodes[node] = Node();
+		}
+		else
+		{
+			node = (uint32_t)m_nodes.size();
+			m_nodes.emplace_back();
+		}
+		m_nodes[node].type = type;
+		return node;
+	}
+
+	void DirectoryTrie::freeSubtree(uint32_t node)
+	{
+		std::vector<uint32_t> stack = { node };
+		while (!stack.empty())
+		{
+			uint32_t curr = stack.back();
+			stack.pop_back();
+			for (auto& child : m_nodes[curr].children)
+				stack.push_back(child.node);
+			m_nodes[curr].children.clear();
+			m_freeNodes.push_back(curr);
+		}
+	}
+
+	void DirectoryTrie::eraseMissing(Hash pathHash)
+	{
+		// The ring slot stays behind and is skipped on eviction
+		m_missing.erase(pathHash);
+	}
+}
\ No newline at end of file
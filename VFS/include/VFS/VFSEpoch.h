@@ -0,0 +1,157 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <thread>
+
+namespace VFS {
+
+	// Epoch based reclamation for objects published through an atomic pointer.
+	//
+	// Readers pin the current epoch before loading the pointer and unpin when done,
+	// neither step takes a lock. Writers publish the replacement first and then retire
+	// the old object, which is deleted once no reader is pinned to an epoch it was visible in.
+	class EpochManager
+	{
+	public:
+		class Guard
+		{
+		public:
+			Guard(EpochManager* man);
+			Guard(Guard&& other) noexcept;
+			~Guard();
+		public:
+			Guard(const Guard&) = delete;
+			Guard& operator=(const Guard&) = delete;
+		private:
+			EpochManager* m_man;
+			uint64_t m_slot;
+		};
+	public:
+		EpochManager() = default;
+		~EpochManager();
+	public:
+		Guard pin();
+		template <typename T>
+		void retire(const T* ptr);
+		void reclaim();
+	private:
+		uint64_t enter();
+		void leave(uint64_t slot);
+		uint64_t minActiveEpoch() const;
+	private:
+		static constexpr uint64_t N_SLOTS = 256;
+		static constexpr uint64_t IDLE = -1;
+		struct alignas(64) Slot
+		{
+			std::atomic<uint64_t> epoch = IDLE;
+		};
+		struct Retired
+		{
+			uint64_t epoch;
+			std::function<void()> deleter;
+		};
+	private:
+		Slot m_slots[N_SLOTS];
+		std::atomic<uint64_t> m_globalEpoch = 0;
+		std::mutex m_mtxRetired;
+		std::vector<Retired> m_retired;
+	};
+
+	EpochManager::Guard::Guard(EpochManager* man)
+		: m_man(man), m_slot(man->enter())
+	{
+	}
+
+	EpochManager::Guard::Guard(Guard&& other) noexcept
+		: m_man(other.m_man), m_slot(other.m_slot)
+	{
+		other.m_man = nullptr;
+	}
+
+	EpochManager::Guard::~Guard()
+	{
+		if (m_man)
+			m_man->leave(m_slot);
+	}
+
+	EpochManager::~EpochManager()
+	{
+		for (auto& retired : m_retired)
+			retired.deleter();
+	}
+
+	EpochManager::Guard EpochManager::pin()
+	{
+		return Guard(this);
+	}
+
+	template <typename T>
+	void EpochManager::retire(const T* ptr)
+	{
+		// Readers pinning after this increment can no longer see 'ptr'
+		uint64_t epoch = m_globalEpoch.fetch_add(1);
+		{
+			std::lock_guard lock(m_mtxRetired);
+			m_retired.push_back({ epoch, [ptr]() { delete ptr; } });
+		}
+		reclaim();
+	}
+
+	void EpochManager::reclaim()
+	{
+		std::vector<Retired> toDelete;
+		{
+			std::lock_guard lock(m_mtxRetired);
+			uint64_t minEpoch = minActiveEpoch();
+			for (auto it = m_retired.begin(); it != m_retired.end();)
+			{
+				if (it->epoch < minEpoch)
+				{
+					toDelete.push_back(std::move(*it));
+					it = m_retired.erase(it);
+				}
+				else
+				{
+					++it;
+				}
+			}
+		}
+
+		for (auto& retired : toDelete)
+			retired.deleter();
+	}
+
+	uint64_t EpochManager::enter()
+	{
+		static thread_local uint64_t slotHint = std::hash<std::thread::id>()(std::this_thread::get_id());
+
+		for (uint64_t i = 0; ; ++i)
+		{
+			uint64_t slot = (slotHint + i) % N_SLOTS;
+			uint64_t expected = IDLE;
+			if (m_slots[slot].epoch.compare_exchange_strong(expected, m_globalEpoch.load()))
+			{
+				slotHint = slot;
+				return slot;
+			}
+			if (i % N_SLOTS == N_SLOTS - 1)
+				std::this_thread::yield(); // More readers than slots
+		}
+	}
+
+	void EpochManager::leave(uint64_t slot)
+	{
+		m_slots[slot].epoch.store(IDLE);
+	}
+
+	uint64_t EpochManager::minActiveEpoch() const
+	{
+		uint64_t minEpoch = m_globalEpoch.load();
+		for (auto& slot : m_slots)
+			minEpoch = std::min(minEpoch, slot.epoch.load());
+		return minEpoch;
+	}
+}
\ No newline at end of file
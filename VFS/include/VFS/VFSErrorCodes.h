@@ -7,6 +7,13 @@ namespace VFS {
 		Success = 0,
 		PathNotFound,
 		NotAFile,
-		NotADirectory
+		NotADirectory,
+		AlreadyExists,
+		DirectoryNotEmpty,
+		EndOfFile,
+		InvalidHandle,
+		IOError,
+		Unsupported,
+		HashCollision // The path's hash is taken by a different path
 	};
 }
\ No newline at end of file
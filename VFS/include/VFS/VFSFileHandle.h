@@ -1,29 +1,128 @@
 #pragma once
 
+#include <vector>
+
 #include "VFSErrorCodes.h"
 #include "VFSHashPath.h"
+#include "VFSAbstractFileIO.h"
 
 namespace VFS {
 
+	class FileSystem;
+
+	// Direct access to the bytes of one file, handed out by FileSystem::openFile()
+	struct FileToken
+	{
+		AbstractFileIORef afio;
+		AbstractFileIO::Token stream;
+		uint64_t offset = 0; // Of the file data within the stream
+		uint64_t size = 0;
+		uint64_t capacity = 0; // Writes ending beyond this have to go through the FileSystem
+		bool isWritable = false;
+	};
+
+	// Open file of a FileSystem with a cursor for streaming access.
+	//
+	// The file is resolved to a FileToken once, reads and writes after that go straight to its
+	// stream. Small read() and write() calls are batched through a per-handle buffer, large
+	// ones bypass it. Backends without tokens are accessed through the FileSystem by path.
+	// The size is taken from the FileSystem, so growth through other handles is seen.
+	// The file must not be deleted while a handle to it is open.
+	// The member functions are defined in VFSFileSystem.h.
 	class FileHandle
 	{
 	public:
 		FileHandle() = default;
-		FileHandle(HashPathRef path);
+		FileHandle(FileSystem* fileSystem, HashPathRef path);
+		FileHandle(const FileHandle&) = delete;
+		FileHandle(FileHandle&& other) noexcept;
+		~FileHandle();
+	public:
+		FileHandle& operator=(const FileHandle&) = delete;
+		FileHandle& operator=(FileHandle&& other) noexcept;
 	public:
+		// Positional access, the cursor is not moved
 		ErrCode setLastModTime(uint64_t modTime);
-		ErrCode writeFile(void* buffer, uint64_t count, uint64_t offset = 0);
+		ErrCode writeFile(const void* buffer, uint64_t count, uint64_t offset = 0);
 		ErrCode readFile(void* buffer, uint64_t count, uint64_t offset = 0);
 		ErrCode resizeFile(uint64_t newSize);
+		ErrCode getFileSize(uint64_t& size);
 	public:
+		// Reads up to count bytes at the cursor, returns EndOfFile if the cursor is at the end
+		ErrCode read(void* buffer, uint64_t count, uint64_t& nRead);
+		ErrCode write(const void* buffer, uint64_t count);
+		ErrCode seek(uint64_t position);
+		uint64_t tell() const { return m_cursor; }
+		// Writes out buffered data
+		ErrCode flush();
+	public:
+		HashPathRef getPath() const { return m_path; }
 		operator bool() const;
+	private:
+		ErrCode open(bool forWriting);
+		ErrCode readAt(void* buffer, uint64_t count, uint64_t offset);
+		ErrCode writeAt(const void* buffer, uint64_t count, uint64_t offset);
+		ErrCode fileSize(uint64_t& size);
+		void dropReadBuffer();
+	private:
+		static constexpr uint64_t BUFFER_SIZE = 65536;
 	private:
 		bool m_isValid = false;
+		FileSystem* m_fileSystem = nullptr;
 		HashPath m_path;
+		FileToken m_token;
+		bool m_hasToken = false;
+		bool m_useToken = true;
+		uint64_t m_cursor = 0;
+		// Either read ahead or not yet written data, starting at file offset m_bufferPos
+		std::vector<char> m_buffer;
+		uint64_t m_bufferPos = 0;
+		uint64_t m_bufferSize = 0;
+		bool m_isDirty = false;
 	};
 
-	FileHandle::FileHandle(HashPathRef path)
-		: m_path(path)
+	FileHandle::FileHandle(FileSystem* fileSystem, HashPathRef path)
+		: m_isValid(fileSystem != nullptr), m_fileSystem(fileSystem), m_path(path)
+	{
+	}
+
+	FileHandle::FileHandle(FileHandle&& other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	FileHandle::~FileHandle()
+	{
+		flush();
+	}
+
+	FileHandle& FileHandle::operator=(FileHandle&& other) noexcept
+	{
+		if (this == &other)
+			return *this;
+
+		flush();
+		m_isValid = other.m_isValid;
+		m_fileSystem = other.m_fileSystem;
+		m_path = std::move(other.m_path);
+		m_token = std::move(other.m_token);
+		m_hasToken = other.m_hasToken;
+		m_useToken = other.m_useToken;
+		m_cursor = other.m_cursor;
+		m_buffer = std::move(other.m_buffer);
+		m_bufferPos = other.m_bufferPos;
+		m_bufferSize = other.m_bufferSize;
+		m_isDirty = other.m_isDirty;
+
+		other.m_isValid = false;
+		other.m_hasToken = false;
+		other.m_bufferSize = 0;
+		other.m_isDirty = false;
+		return *this;
+	}
+
+	FileHandle::operator bool() const
 	{
+		return m_isValid;
 	}
 }
\ No newline at end of file
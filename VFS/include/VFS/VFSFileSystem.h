@@ -1,21 +1,47 @@
 #pragma once
 
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+
 #include "VFSHashPath.h"
 #include "VFSFileHandle.h"
+#include "VFSDirectoryIndex.h"
 
 namespace VFS {
 
+	// Interface of all backends. Paths are relative to the root of the backend,
+	// parent directories have to exist before anything is created inside them.
 	class FileSystem
 	{
+	public:
+		typedef DirectoryIndex::Entry Entry;
+		typedef DirectoryIndex::EntryType EntryType;
 	public:
 		FileSystem() = delete;
 		FileSystem(const std::string& basePath);
+		virtual ~FileSystem() = default;
 	public:
-		ErrCode createFile(HashPathRef path);
-		ErrCode deleteFile(HashPathRef path);
-		ErrCode createDirectory(HashPathRef path);
-		ErrCode deleteDirectory(HashPathRef path);
+		virtual ErrCode createFile(HashPathRef path) = 0;
+		virtual ErrCode deleteFile(HashPathRef path) = 0;
+		virtual ErrCode createDirectory(HashPathRef path) = 0;
+		virtual ErrCode deleteDirectory(HashPathRef path) = 0;
+		virtual ErrCode stat(HashPathRef path, Entry& entry) = 0;
+		virtual ErrCode listDirectory(HashPathRef path, std::vector<Entry>& entries) = 0;
+		// Type of the entry at path, EntryType::None if there is none. Defaults to stat().
+		virtual EntryType typeOf(HashPathRef path);
 		FileHandle getFileHandle(HashPathRef path);
+	public:
+		// File access behind FileHandle
+		virtual ErrCode readFile(HashPathRef path, void* buffer, uint64_t count, uint64_t offset) = 0;
+		virtual ErrCode writeFile(HashPathRef path, const void* buffer, uint64_t count, uint64_t offset) = 0;
+		virtual ErrCode resizeFile(HashPathRef path, uint64_t newSize) = 0;
+		virtual ErrCode setLastModTime(HashPathRef path, uint64_t modTime) = 0;
+		// Resolves a file for direct access through a FileHandle. The token of a file opened
+		// for writing must only be used for writes within its capacity. Returns Unsupported
+		// by default or where the file may move, FileHandle then goes through the functions above.
+		virtual ErrCode openFile(HashPathRef path, bool forWriting, FileToken& token);
 	public:
 		void setBasePath(const std::string& basePath);
 		const std::string& getBasePath() const;
@@ -23,5 +49,317 @@ namespace VFS {
 		virtual std::string getRealPath(HashPathRef path) = 0;
 	private:
 		std::string m_basePath;
+	public:
+		friend class OverlayFileSystem;
+		friend class DedupFileSystem;
 	};
+
+	typedef std::shared_ptr<FileSystem> FileSystemRef;
+
+	FileSystem::FileSystem(const std::string& basePath)
+		: m_basePath(basePath)
+	{
+	}
+
+	FileSystem::EntryType FileSystem::typeOf(HashPathRef path)
+	{
+		Entry entry;
+		if (stat(path, entry) != ErrCode::Success)
+			return EntryType::None;
+		return entry.type;
+	}
+
+	ErrCode FileSystem::openFile(HashPathRef, bool, FileToken&)
+	{
+		return ErrCode::Unsupported;
+	}
+
+	FileHandle FileSystem::getFileHandle(HashPathRef path)
+	{
+		if (typeOf(path) != EntryType::File)
+			return FileHandle();
+
+		return FileHandle(this, path);
+	}
+
+	void FileSystem::setBasePath(const std::string& basePath)
+	{
+		m_basePath = basePath;
+	}
+
+	const std::string& FileSystem::getBasePath() const
+	{
+		return m_basePath;
+	}
+
+	ErrCode FileHandle::setLastModTime(uint64_t modTime)
+	{
+		if (!m_isValid)
+			return ErrCode::InvalidHandle;
+		return m_fileSystem->setLastModTime(m_path, modTime);
+	}
+
+	ErrCode FileHandle::writeFile(const void* buffer, uint64_t count, uint64_t offset)
+	{
+		if (!m_isValid)
+			return ErrCode::InvalidHandle;
+
+		ErrCode ec = flush();
+		if (ec != ErrCode::Success)
+			return ec;
+		dropReadBuffer();
+		return writeAt(buffer, count, offset);
+	}
+
+	ErrCode FileHandle::readFile(void* buffer, uint64_t count, uint64_t offset)
+	{
+		if (!m_isValid)
+			return ErrCode::InvalidHandle;
+
+		ErrCode ec = flush();
+		if (ec != ErrCode::Success)
+			return ec;
+		return readAt(buffer, count, offset);
+	}
+
+	ErrCode FileHandle::resizeFile(uint64_t newSize)
+	{
+		if (!m_isValid)
+			return ErrCode::InvalidHandle;
+
+		ErrCode ec = flush();
+		if (ec != ErrCode::Success)
+			return ec;
+		dropReadBuffer();
+		m_hasToken = false; // The file may have moved
+		return m_fileSystem->resizeFile(m_path, newSize);
+	}
+
+	ErrCode FileHandle::getFileSize(uint64_t& size)
+	{
+		if (!m_isValid)
+			return ErrCode::InvalidHandle;
+
+		ErrCode ec = flush();
+		if (ec != ErrCode::Success)
+			return ec;
+		return fileSize(size);
+	}
+
+	ErrCode FileHandle::read(void* buffer, uint64_t count, uint64_t& nRead)
+	{
+		nRead = 0;
+		if (!m_isValid)
+			return ErrCode::InvalidHandle;
+
+		ErrCode ec = flush();
+		if (ec != ErrCode::Success)
+			return ec;
+
+		// Served from the buffer alone, those bytes were in the file when they were read
+		if (m_cursor >= m_bufferPos && m_cursor + count <= m_bufferPos + m_bufferSize)
+		{
+			memcpy(buffer, m_buffer.data() + (m_cursor - m_bufferPos), count);
+			nRead = count;
+			m_cursor += count;
+			return ErrCode::Success;
+		}
+
+		uint64_t size = 0;
+		ec = fileSize(size);
+		if (ec != ErrCode::Success)
+			return ec;
+		if (m_cursor >= size)
+			return count == 0 ? ErrCode::Success : ErrCode::EndOfFile;
+		count = std::min(count, size - m_cursor);
+
+		char* out = (char*)buffer;
+		while (nRead < count)
+		{
+			if (m_cursor >= m_bufferPos && m_cursor < m_bufferPos + m_bufferSize)
+			{
+				uint64_t nToCopy = std::min(count - nRead, m_bufferPos + m_bufferSize - m_cursor);
+				memcpy(out + nRead, m_buffer.data() + (m_cursor - m_bufferPos), nToCopy);
+				nRead += nToCopy;
+				m_cursor += nToCopy;
+				continue;
+			}
+
+			// Large reads go straight into the caller's buffer
+			uint64_t nRemaining = count - nRead;
+			if (nRemaining >= BUFFER_SIZE)
+			{
+				ec = readAt(out + nRead, nRemaining, m_cursor);
+				if (ec != ErrCode::Success)
+					return ec;
+				nRead += nRemaining;
+				m_cursor += nRemaining;
+				break;
+			}
+
+			m_buffer.resize(BUFFER_SIZE);
+			m_bufferPos = m_cursor;
+			m_bufferSize = std::min(BUFFER_SIZE, size - m_cursor);
+			ec = readAt(m_buffer.data(), m_bufferSize, m_bufferPos);
+			if (ec != ErrCode::Success)
+			{
+				dropReadBuffer();
+				return ec;
+			}
+		}
+
+		return ErrCode::Success;
+	}
+
+	ErrCode FileHandle::write(const void* buffer, uint64_t count)
+	{
+		if (!m_isValid)
+			return ErrCode::InvalidHandle;
+
+		// Only contiguous writes are collected
+		if (m_isDirty && (m_cursor != m_bufferPos + m_bufferSize || m_bufferSize + count > BUFFER_SIZE))
+		{
+			ErrCode ec = flush();
+			if (ec != ErrCode::Success)
+				return ec;
+		}
+		if (!m_isDirty)
+			dropReadBuffer();
+
+		if (count >= BUFFER_SIZE)
+		{
+			ErrCode ec = writeAt(buffer, count, m_cursor);
+			if (ec != ErrCode::Success)
+				return ec;
+			m_cursor += count;
+			return ErrCode::Success;
+		}
+
+		if (m_bufferSize == 0)
+		{
+			m_buffer.resize(BUFFER_SIZE);
+			m_bufferPos = m_cursor;
+		}
+		memcpy(m_buffer.data() + m_bufferSize, buffer, count);
+		m_bufferSize += count;
+		m_cursor += count;
+		m_isDirty = true;
+		return ErrCode::Success;
+	}
+
+	ErrCode FileHandle::seek(uint64_t position)
+	{
+		if (!m_isValid)
+			return ErrCode::InvalidHandle;
+
+		m_cursor = position;
+		return ErrCode::Success;
+	}
+
+	ErrCode FileHandle::flush()
+	{
+		if (!m_isDirty)
+			return ErrCode::Success;
+
+		// The written data stays in the buffer for reading
+		m_isDirty = false;
+		ErrCode ec = writeAt(m_buffer.data(), m_bufferSize, m_bufferPos);
+		if (ec != ErrCode::Success)
+			dropReadBuffer();
+		return ec;
+	}
+
+	ErrCode FileHandle::open(bool forWriting)
+	{
+		if (!m_useToken || (m_hasToken && (m_token.isWritable || !forWriting)))
+			return ErrCode::Success;
+
+		FileToken token;
+		ErrCode ec = m_fileSystem->openFile(m_path, forWriting, token);
+		if (ec == ErrCode::Unsupported)
+		{
+			// Access by path from now on, a read only token must not take writes
+			m_useToken = false;
+			m_hasToken = false;
+			return ErrCode::Success;
+		}
+		if (ec != ErrCode::Success)
+			return ec;
+
+		m_token = std::move(token);
+		m_hasToken = true;
+		return ErrCode::Success;
+	}
+
+	ErrCode FileHandle::readAt(void* buffer, uint64_t count, uint64_t offset)
+	{
+		ErrCode ec = open(false);
+		if (ec != ErrCode::Success)
+			return ec;
+		if (!m_hasToken)
+			return m_fileSystem->readFile(m_path, buffer, count, offset);
+
+		if (offset + count > m_token.size)
+		{
+			// The file may have grown through another handle
+			uint64_t size = 0;
+			ec = fileSize(size);
+			if (ec != ErrCode::Success)
+				return ec;
+			if (!m_hasToken)
+				return m_fileSystem->readFile(m_path, buffer, count, offset);
+			if (offset + count > size)
+				return ErrCode::EndOfFile;
+		}
+
+		auto err = m_token.afio->read(m_token.stream, buffer, count, m_token.offset + offset);
+		if (err.code != AbstractFileIO::ErrCode::Success || err.value.nRead != count)
+			return ErrCode::IOError;
+		return ErrCode::Success;
+	}
+
+	ErrCode FileHandle::writeAt(const void* buffer, uint64_t count, uint64_t offset)
+	{
+		ErrCode ec = open(true);
+		if (ec != ErrCode::Success)
+			return ec;
+		if (!m_hasToken)
+			return m_fileSystem->writeFile(m_path, buffer, count, offset);
+
+		// Growing beyond the capacity needs the FileSystem, which may move the file
+		if (offset + count > m_token.capacity)
+		{
+			m_hasToken = false;
+			return m_fileSystem->writeFile(m_path, buffer, count, offset);
+		}
+
+		if (m_token.afio->write(m_token.stream, buffer, count, m_token.offset + offset).code != AbstractFileIO::ErrCode::Success)
+			return ErrCode::IOError;
+		m_token.size = std::max(m_token.size, offset + count);
+		return ErrCode::Success;
+	}
+
+	ErrCode FileHandle::fileSize(uint64_t& size)
+	{
+		// Other handles and the FileSystem itself may have resized the file since it was opened
+		FileSystem::Entry entry;
+		ErrCode ec = m_fileSystem->stat(m_path, entry);
+		if (ec != ErrCode::Success)
+			return ec;
+		size = entry.size;
+
+		if (m_hasToken)
+		{
+			if (size > m_token.capacity)
+				m_hasToken = false; // Grown through the FileSystem, the file may have moved
+			else
+				m_token.size = size;
+		}
+		return ErrCode::Success;
+	}
+
+	void FileHandle::dropReadBuffer()
+	{
+		m_bufferSize = 0;
+	}
 }
\ No newline at end of file
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <filesystem>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <climits>
+#endif
+
+#include "VFSHashPath.h"
+
+namespace VFS {
+
+	// Reports entries that are created or deleted below a host directory by anyone.
+	//
+	// Uses one inotify watch per directory and a background thread that calls the callback
+	// with paths relative to the root. New directories are watched as they appear, entries
+	// created in them before their watch was added are reported as created as well. Overflow
+	// means that events were lost and everything has to be considered stale.
+	// Only Linux is supported, elsewhere the watcher is never active.
+	class FileWatcher
+	{
+	public:
+		enum class Event
+		{
+			Created,
+			Deleted,
+			Overflow
+		};
+		typedef std::function<void(HashPathRef path, Event event, bool isDirectory)> Callback;
+	public:
+		FileWatcher(const std::string& rootPath, Callback callback);
+		~FileWatcher();
+	public:
+		bool isActive() const { return m_isActive; }
+		// Number of watched directories, set up front and updated by the watcher thread
+		uint64_t nWatches() const { return m_nWatches; }
+	private:
+		void run();
+		void watchTree(const HashPath& dir, bool reportChildren);
+		void unwatchTree(const HashPath& dir);
+		void handleEvent(int wd, uint32_t mask, const char* name);
+	private:
+		std::string m_rootPath;
+		Callback m_callback;
+		bool m_isActive = false;
+		std::atomic<uint64_t> m_nWatches = 0;
+		int m_fd = -1;
+		int m_stopPipe[2] = { -1, -1 };
+		std::unordered_map<int, HashPath> m_watches;
+		std::thread m_thread;
+	};
+
+#ifdef __linux__
+	FileWatcher::FileWatcher(const std::string& rootPath, Callback callback)
+		: m_rootPath(rootPath), m_callback(callback)
+	{
+		m_fd = inotify_init1(IN_CLOEXEC);
+		if (m_fd < 0)
+			return;
+		if (pipe(m_stopPipe) != 0)
+		{
+			close(m_fd);
+			m_fd = -1;
+			return;
+		}
+
+		watchTree(HashPath(), false);
+		m_isActive = !m_watches.empty();
+		if (m_isActive)
+			m_thread = std::thread(&FileWatcher::run, this);
+	}
+
+	FileWatcher::~FileWatcher()
+	{
+		if (m_thread.joinable())
+		{
+			char stop = 0;
+			(void)!write(m_stopPipe[1], &stop, 1);
+			m_thread.join();
+		}
+
+		for (int fd : { m_fd, m_stopPipe[0], m_stopPipe[1] })
+			if (fd >= 0)
+				close(fd);
+	}
+
+	void FileWatcher::run()
+	{
+		// Large enough for many events, each carries a name of up to NAME_MAX bytes
+		alignas(inotify_event) char buffer[64 * (sizeof(inotify_event) + NAME_MAX + 1)];
+
+		pollfd fds[2] = { { m_fd, POLLIN, 0 }, { m_stopPipe[0], POLLIN, 0 } };
+		while (true)
+		{
+			if (poll(fds, 2, -1) < 0)
+				continue;
+			if (fds[1].revents)
+				return;
+
+			ssize_t nRead = read(m_fd, buffer, sizeof(buffer));
+			for (ssize_t offset = 0; offset < nRead; )
+			{
+				auto event = (const inotify_event*)(buffer + offset);
+				handleEvent(event->wd, event->mask, event->len > 0 ? event->name : "");
+				offset += sizeof(inotify_event) + event->len;
+			}
+		}
+	}
+
+	void FileWatcher::watchTree(const HashPath& dir, bool reportChildren)
+	{
+		constexpr uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+		std::string realPath = dir.getRealPath(m_rootPath);
+		int wd = inotify_add_watch(m_fd, realPath.c_str(), mask);
+		if (wd < 0)
+			return;
+		m_watches[wd] = dir;
+		m_nWatches = m_watches.size();
+
+		// Watched first and listed second, so that nothing created in between is missed
+		std::error_code ec;
+		for (auto& dirEntry : std::filesystem::directory_iterator(realPath, std::filesystem::directory_options::skip_permission_denied, ec))
+		{
+			if (dirEntry.is_symlink(ec))
+				continue;
+
+			HashPath child = dir.child(HashPath::Element(dirEntry.path().filename().string()));
+			bool isDirectory = dirEntry.is_directory(ec);
+			if (reportChildren)
+				m_callback(child, Event::Created, isDirectory);
+			if (isDirectory)
+				watchTree(child, reportChildren);
+		}
+	}
+
+	void FileWatcher::unwatchTree(const HashPath& dir)
+	{
+		for (auto it = m_watches.begin(); it != m_watches.end(); )
+		{
+			auto& path = it->second;
+			if (path.depth() >= dir.depth() && path.hash(dir.depth()) == dir.hash())
+			{
+				inotify_rm_watch(m_fd, it->first);
+				it = m_watches.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+		m_nWatches = m_watches.size();
+	}
+
+	void FileWatcher::handleEvent(int wd, uint32_t mask, const char* name)
+	{
+		if (mask & IN_Q_OVERFLOW)
+		{
+			m_callback(HashPath(), Event::Overflow, true);
+			return;
+		}
+
+		auto it = m_watches.find(wd);
+		if (it == m_watches.end())
+			return;
+
+		if (mask & IN_IGNORED)
+		{
+			m_watches.erase(it);
+			m_nWatches = m_watches.size();
+			return;
+		}
+		if (mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+			return; // Reported as deleted by the parent's watch
+
+		HashPath path = it->second.child(HashPath::Element(name));
+		bool isDirectory = mask & IN_ISDIR;
+		if (mask & (IN_CREATE | IN_MOVED_TO))
+		{
+			m_callback(path, Event::Created, isDirectory);
+			if (isDirectory)
+				watchTree(path, true);
+		}
+		else if (mask & (IN_DELETE | IN_MOVED_FROM))
+		{
+			m_callback(path, Event::Deleted, isDirectory);
+			if (isDirectory && (mask & IN_MOVED_FROM))
+				unwatchTree(path); // The watches move along, but their paths would be stale
+		}
+	}
+#else
+	FileWatcher::FileWatcher(const std::string& rootPath, Callback callback)
+		: m_rootPath(rootPath), m_callback(callback)
+	{
+	}
+
+	FileWatcher::~FileWatcher()
+	{
+	}
+
+	void FileWatcher::run()
+	{
+	}
+
+	void FileWatcher::watchTree(const HashPath& dir, bool reportChildren)
+	{
+	}
+
+	void FileWatcher::unwatchTree(const HashPath& dir)
+	{
+	}
+
+	void FileWatcher::handleEvent(int wd, uint32_t mask, const char* name)
+	{
+	}
+#endif
+}
\ No newline at end of file
@@ -1,43 +1,344 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <string>
+#include <string_view>
 
 #include "VFSRotaryShift.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VFS_HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER) && defined(_M_X64) && !defined(__SIZEOF_INT128__)
+#include <intrin.h>
+#endif
+
+// Lets the hash functions use memcpy and SIMD at runtime while staying usable in constant expressions
+#if defined(__GNUC__) || defined(__clang__) || (defined(_MSC_VER) && _MSC_VER >= 1925)
+#define VFS_IS_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#else
+#define VFS_IS_CONSTANT_EVALUATED() false
+#endif
+
 namespace VFS {
 
 	typedef uint64_t Hash;
 
-	Hash makeHash(const std::string& str)
+	// Hashes that end up on disk have to be recomputed with the version they were written with.
+	// Legacy:	The original pack-wise multiply and rotate hash, weakly mixing
+	// V1:		wyhash style multiply-fold for short inputs, xxh3 style striped accumulation for long ones
+	enum class HashVersion : uint8_t
 	{
-		constexpr uint64_t packSize = sizeof(Hash);
+		Legacy = 0,
+		V1,
+		Current = V1
+	};
+
+	// The string_view overloads are constexpr, so hashes of literals can be computed at compile time.
+	// Multi-byte reads are little-endian at compile time, runtime hashes match on little-endian hosts.
+	Hash makeHash(const void* data, uint64_t size, HashVersion version = HashVersion::Current);
+	constexpr Hash makeHash(std::string_view str, HashVersion version = HashVersion::Current);
+	// Order dependent combination of two hashes, e.g. a parent path hash and an element hash
+	constexpr Hash combineHash(Hash seed, Hash value);
 
-		auto combine = [](Hash& full, Hash part, uint64_t index)
+	namespace HashV1 {
+
+		static constexpr uint64_t P64_1 = 0x9E3779B185EBCA87ull;
+		static constexpr uint64_t P64_2 = 0xC2B2AE3D27D4EB4Full;
+		static constexpr uint64_t P64_3 = 0x165667B19E3779F9ull;
+		static constexpr uint64_t P64_4 = 0x85EBCA77C2B2AE63ull;
+		static constexpr uint64_t P64_5 = 0x27D4EB2F165667C5ull;
+		static constexpr uint64_t P32_1 = 0x9E3779B1ull;
+		static constexpr uint64_t P32_2 = 0x85EBCA77ull;
+		static constexpr uint64_t P32_3 = 0xC2B2AE3Dull;
+
+		static constexpr uint64_t STRIPE_SIZE = 64;
+		static constexpr uint64_t STRIPES_PER_BLOCK = 8;
+		static constexpr uint64_t LONG_THRESHOLD = 240; // Inputs above are hashed stripe-wise
+
+		struct Secret
 		{
-			constexpr uint64_t prime = 7;
-			full *= prime;
-			full += rotaryShiftLeft64(part, index % (sizeof(Hash) * CHAR_BIT));
+			uint64_t lanes[16];
 		};
 
-		const uint64_t nBytes = str.size();
-		const uint64_t nPacks = nBytes / packSize;
-		const uint64_t offsetLastPack = nPacks * packSize;
-		const uint64_t nBytesLastPack = nBytes % packSize;
+		static constexpr Secret makeSecret()
+		{
+			// splitmix64 output, any well mixed constants would do
+			Secret secret = {};
+			uint64_t x = 0;
+			for (uint64_t i = 0; i < 16; ++i)
+			{
+				x += 0x9E3779B97F4A7C15ull;
+				uint64_t z = x;
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+				secret.lanes[i] = z ^ (z >> 31);
+			}
+			return secret;
+		}
 
-		Hash hashFull = 0;
+		static constexpr Secret SECRET = makeSecret();
+
+		static constexpr uint64_t readBytes(const char* p, uint64_t n)
+		{
+			uint64_t v = 0;
+			for (uint64_t i = 0; i < n; ++i)
+				v |= (uint64_t)(uint8_t)p[i] << (8 * i);
+			return v;
+		}
+
+		static constexpr uint64_t read64(const char* p)
+		{
+			if (VFS_IS_CONSTANT_EVALUATED())
+				return readBytes(p, 8);
+			uint64_t v = 0;
+			memcpy(&v, p, sizeof(v));
+			return v;
+		}
+
+		static constexpr uint64_t read32(const char* p)
+		{
+			if (VFS_IS_CONSTANT_EVALUATED())
+				return readBytes(p, 4);
+			uint32_t v = 0;
+			memcpy(&v, p, sizeof(v));
+			return v;
+		}
+
+		static constexpr uint64_t read3(const char* p, uint64_t k) { return ((uint64_t)(uint8_t)p[0] << 16) | ((uint64_t)(uint8_t)p[k >> 1] << 8) | (uint8_t)p[k - 1]; }
+
+		static constexpr void multiply(uint64_t& a, uint64_t& b)
+		{
+		#if defined(__SIZEOF_INT128__)
+			__uint128_t r = (__uint128_t)a * b;
+			a = (uint64_t)r;
+			b = (uint64_t)(r >> 64);
+		#else
+		#if defined(_MSC_VER) && defined(_M_X64)
+			if (!VFS_IS_CONSTANT_EVALUATED())
+			{
+				a = _umul128(a, b, &b);
+				return;
+			}
+		#endif
+			uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+			uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+			uint64_t t = rl + (rm0 << 32);
+			uint64_t c = t < rl;
+			uint64_t lo = t + (rm1 << 32);
+			c += lo < t;
+			a = lo;
+			b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+		#endif
+		}
+
+		static constexpr uint64_t mix(uint64_t a, uint64_t b)
+		{
+			multiply(a, b);
+			return a ^ b;
+		}
+
+		static constexpr uint64_t avalanche(uint64_t h)
+		{
+			h ^= h >> 37;
+			h *= 0x165667919E3779F9ull;
+			return h ^ (h >> 32);
+		}
+
+		static constexpr void accumulateScalar(uint64_t* acc, const char* stripe, const uint64_t* key)
+		{
+			for (uint64_t i = 0; i < 8; ++i)
+			{
+				uint64_t d = read64(stripe + i * 8);
+				uint64_t dk = d ^ key[i];
+				acc[i ^ 1] += d;
+				acc[i] += (dk & 0xFFFFFFFFull) * (dk >> 32);
+			}
+		}
+
+		static constexpr void scrambleScalar(uint64_t* acc, const uint64_t* key)
+		{
+			for (uint64_t i = 0; i < 8; ++i)
+				acc[i] = (acc[i] ^ (acc[i] >> 47) ^ key[i]) * P32_1;
+		}
+
+		static constexpr void accumulate(uint64_t* acc, const char* stripe, const uint64_t* key)
+		{
+		#ifdef VFS_HAS_SSE2
+			if (VFS_IS_CONSTANT_EVALUATED())
+			{
+				accumulateScalar(acc, stripe, key);
+				return;
+			}
+
+			for (uint64_t i = 0; i < 4; ++i)
+			{
+				__m128i a = _mm_load_si128((const __m128i*)acc + i);
+				__m128i d = _mm_loadu_si128((const __m128i*)stripe + i);
+				__m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i*)key + i));
+				__m128i product = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+				__m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+				_mm_store_si128((__m128i*)acc + i, _mm_add_epi64(a, _mm_add_epi64(product, swapped)));
+			}
+		#else
+			accumulateScalar(acc, stripe, key);
+		#endif
+		}
+
+		static constexpr void scramble(uint64_t* acc, const uint64_t* key)
+		{
+		#ifdef VFS_HAS_SSE2
+			if (VFS_IS_CONSTANT_EVALUATED())
+			{
+				scrambleScalar(acc, key);
+				return;
+			}
 
-		for (uint64_t i = 0; i < nPacks; ++i)
-			combine(hashFull, *(const Hash*)(str.data() + (i * packSize)), i);
+			const __m128i prime = _mm_set1_epi32((int)P32_1);
+			for (uint64_t i = 0; i < 4; ++i)
+			{
+				__m128i a = _mm_load_si128((const __m128i*)acc + i);
+				a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+				a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*)key + i));
+				__m128i lo = _mm_mul_epu32(a, prime);
+				__m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+				_mm_store_si128((__m128i*)acc + i, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+			}
+		#else
+			scrambleScalar(acc, key);
+		#endif
+		}
 
-		if (nBytesLastPack > 0)
+		static constexpr Hash hashLong(const char* p, uint64_t size)
 		{
+			alignas(16) uint64_t acc[8] = { P32_3, P64_1, P64_2, P64_3, P64_4, P32_2, P64_5, P32_1 };
+
+			// Every stripe of a block gets its own key, a window shifted by one lane each time
+			const uint64_t nStripes = (size - 1) / STRIPE_SIZE;
+			const uint64_t nBlocks = nStripes / STRIPES_PER_BLOCK;
+			for (uint64_t block = 0; block < nBlocks; ++block)
+			{
+				for (uint64_t s = 0; s < STRIPES_PER_BLOCK; ++s)
+					accumulate(acc, p + (block * STRIPES_PER_BLOCK + s) * STRIPE_SIZE, SECRET.lanes + s);
+				scramble(acc, SECRET.lanes + 8);
+			}
+			for (uint64_t s = 0; s < nStripes % STRIPES_PER_BLOCK; ++s)
+				accumulate(acc, p + (nBlocks * STRIPES_PER_BLOCK + s) * STRIPE_SIZE, SECRET.lanes + s);
+
+			// The last stripe may overlap the previous one
+			accumulate(acc, p + size - STRIPE_SIZE, SECRET.lanes + 7);
+
+			uint64_t h = size * P64_1;
+			for (uint64_t i = 0; i < 4; ++i)
+				h += mix(acc[2 * i] ^ SECRET.lanes[2 * i + 1], acc[2 * i + 1] ^ SECRET.lanes[2 * i + 2]);
+			return avalanche(h);
+		}
+
+		static constexpr Hash hash(const char* p, uint64_t size)
+		{
+			if (size > LONG_THRESHOLD)
+				return hashLong(p, size);
+
+			const uint64_t* s = SECRET.lanes;
+			uint64_t seed = mix(s[0], s[1]);
+			uint64_t a = 0;
+			uint64_t b = 0;
+			if (size <= 16)
+			{
+				if (size >= 4)
+				{
+					a = (read32(p) << 32) | read32(p + ((size >> 3) << 2));
+					b = (read32(p + size - 4) << 32) | read32(p + size - 4 - ((size >> 3) << 2));
+				}
+				else if (size > 0)
+				{
+					a = read3(p, size);
+				}
+			}
+			else
+			{
+				uint64_t i = size;
+				if (i > 48)
+				{
+					uint64_t see1 = seed;
+					uint64_t see2 = seed;
+					do
+					{
+						seed = mix(read64(p) ^ s[1], read64(p + 8) ^ seed);
+						see1 = mix(read64(p + 16) ^ s[2], read64(p + 24) ^ see1);
+						see2 = mix(read64(p + 32) ^ s[3], read64(p + 40) ^ see2);
+						p += 48;
+						i -= 48;
+					} while (i > 48);
+					seed ^= see1 ^ see2;
+				}
+				while (i > 16)
+				{
+					seed = mix(read64(p) ^ s[1], read64(p + 8) ^ seed);
+					p += 16;
+					i -= 16;
+				}
+				a = read64(p + i - 16);
+				b = read64(p + i - 8);
+			}
+
+			a ^= s[1];
+			b ^= seed;
+			multiply(a, b);
+			return mix(a ^ s[0] ^ size, b ^ s[1]);
+		}
+	}
+
+	static constexpr Hash makeHashLegacy(const char* bytes, uint64_t size)
+	{
+		constexpr uint64_t packSize = sizeof(Hash);
+		constexpr uint64_t prime = 7;
+
+		const uint64_t nPacks = size / packSize;
+		const uint64_t nBytesLastPack = size % packSize;
+
+		Hash hashFull = 0;
+
+		for (uint64_t i = 0; i <= nPacks; ++i)
+		{
+			uint64_t nBytesPack = (i < nPacks) ? packSize : nBytesLastPack;
+			if (nBytesPack == 0)
+				break;
+
 			Hash hashPart = 0;
-			memcpy(&hashPart, str.data() + offsetLastPack, nBytesLastPack);
-			combine(hashFull, hashPart, nPacks);
+			if (VFS_IS_CONSTANT_EVALUATED())
+				hashPart = HashV1::readBytes(bytes + i * packSize, nBytesPack);
+			else
+				memcpy(&hashPart, bytes + i * packSize, nBytesPack);
+
+			hashFull *= prime;
+			hashFull += rotaryShiftLeft64(hashPart, i % (sizeof(Hash) * CHAR_BIT));
 		}
 
 		return hashFull;
 	}
 
+	Hash makeHash(const void* data, uint64_t size, HashVersion version)
+	{
+		return makeHash(std::string_view((const char*)data, size), version);
+	}
+
+	constexpr Hash makeHash(std::string_view str, HashVersion version)
+	{
+		switch (version)
+		{
+		case HashVersion::Legacy: return makeHashLegacy(str.data(), str.size());
+		case HashVersion::V1: return HashV1::hash(str.data(), str.size());
+		}
+		return 0;
+	}
+
+	constexpr Hash combineHash(Hash seed, Hash value)
+	{
+		return HashV1::mix(seed ^ HashV1::SECRET.lanes[4], value ^ HashV1::SECRET.lanes[5]);
+	}
+
 } // namespace VFS
\ No newline at end of file
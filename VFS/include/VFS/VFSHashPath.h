@@ -1,50 +1,67 @@
 #pragma once
 
 #include <string>
-#include <vector>
+#include <string_view>
+#include <functional>
+#include <algorithm>
 
 #include "VFSPlatform.h"
 #include "VFSHash.h"
+#include "VFSStringPool.h"
+#include "VFSSmallVector.h"
 
 namespace VFS {
 
 	class HashPath
 	{
 	public:
+		// Reference to an interned name, equal names share one StringPool entry
 		struct Element
 		{
 		public:
-			Element(const std::string& name);
+			Element(std::string_view name);
 		public:
-			uint64_t asHash() const { return m_asHash; }
-			const std::string& asString() const { return m_asString; }
+			uint64_t asHash() const { return m_entry->hash; }
+			const std::string& asString() const { return m_entry->str; }
 		public:
 			bool operator==(const Element& other) const;
 			bool operator!=(const Element& other) const;
 		private:
-			uint64_t m_asHash;
-			std::string m_asString;
+			const StringPool::Entry* m_entry;
 		};
+	private:
+		struct Node
+		{
+			Element elem;
+			Hash hash; // Hash of the path up to and including elem
+		};
+	public:
 		class Iterator
 		{
 		public:
-			Iterator(std::vector<Element>::const_iterator it);
+			Iterator(const Node* it);
 		public:
 			bool operator!=(const Iterator& other) const;
 			Iterator& operator++();
 			const Element& operator*() const;
 		private:
-			std::vector<Element>::const_iterator m_it;
+			const Node* m_it;
 		};
 	public:
 		HashPath() = default;
-		HashPath(const std::string& path);
+		// Splits at '/' and '\', skips empty and '.' elements and resolves '..' in a single pass
+		HashPath(std::string_view path);
+		HashPath(const std::string& path) : HashPath(std::string_view(path)) {}
+		HashPath(const char* path) : HashPath(std::string_view(path)) {}
 	public:
 		uint64_t depth() const;
+		// Hash of the whole path, or of its first 'depth' elements. Both are O(1).
+		Hash hash() const;
+		Hash hash(uint64_t depth) const;
 		HashPath parent() const;
 		HashPath child(const Element& elem) const;
 		std::string getRealPath(const std::string& basePath = "") const;
-		static std::string formatPath(std::string path);
+		static std::string formatPath(std::string_view path);
 	public:
 		HashPath operator+(const HashPath& other) const;
 		HashPath& operator+=(const HashPath& other);
@@ -61,19 +78,23 @@ namespace VFS {
 		Iterator begin() const;
 		Iterator end() const;
 	private:
-		std::vector<Element> m_elements;
+		static uint64_t findSeparator(const char* data, uint64_t begin, uint64_t size);
+		static bool isSeparator(char c) { return c == '/' || c == '\\'; }
+	private:
+		static constexpr uint64_t N_INLINE_ELEMENTS = 8; // Deeper paths move to the heap
+		SmallVector<Node, N_INLINE_ELEMENTS> m_nodes;
 	};
 
 	typedef const HashPath& HashPathRef;
 
-	HashPath::Element::Element(const std::string& name)
-		: m_asString(name), m_asHash(makeHash(name))
+	HashPath::Element::Element(std::string_view name)
+		: m_entry(StringPool::intern(name))
 	{
 	}
 
 	bool HashPath::Element::operator==(const Element& other) const
 	{
-		return m_asHash == other.m_asHash;
+		return m_entry == other.m_entry;
 	}
 
 	bool HashPath::Element::operator!=(const Element& other) const
@@ -81,7 +102,7 @@ namespace VFS {
 		return !(*this == other);
 	}
 
-	HashPath::Iterator::Iterator(std::vector<Element>::const_iterator it)
+	HashPath::Iterator::Iterator(const Node* it)
 		: m_it(it)
 	{
 	}
@@ -99,27 +120,34 @@ namespace VFS {
 
 	const HashPath::Element& HashPath::Iterator::operator*() const
 	{
-		return *m_it;
+		return m_it->elem;
 	}
 
-	HashPath::HashPath(const std::string& path)
+	HashPath::HashPath(std::string_view path)
 	{
-		auto formatted = formatPath(path);
 		uint64_t begin = 0;
-		uint64_t end = 0;
-		do
+		while (begin < path.size())
 		{
-			end = formatted.find_first_of("/", begin + 1);
-			uint64_t count = end - begin;
-			if (count > 0)
-				*this += Element(formatted.substr(begin, count));
+			uint64_t end = findSeparator(path.data(), begin, path.size());
+			if (end > begin)
+				*this += Element(path.substr(begin, end - begin));
 			begin = end + 1;
-		} while (end != std::string::npos);
+		}
 	}
 
 	uint64_t HashPath::depth() const
 	{
-		return m_elements.size();
+		return m_nodes.size();
+	}
+
+	Hash HashPath::hash() const
+	{
+		return hash(depth());
+	}
+
+	Hash HashPath::hash(uint64_t depth) const
+	{
+		return depth == 0 ? 0 : m_nodes[depth - 1].hash;
 	}
 
 	HashPath HashPath::parent() const
@@ -134,18 +162,28 @@ namespace VFS {
 
 	std::string HashPath::getRealPath(const std::string& basePath) const
 	{
-		// TODO: Implement getRealPath
-		return "";
+		std::string realPath = basePath;
+		for (auto& node : m_nodes)
+		{
+			if (!realPath.empty() && realPath.back() != '/')
+				realPath.push_back('/');
+			realPath.append(node.elem.asString());
+		}
+		return realPath;
 	}
 
-	std::string HashPath::formatPath(std::string path)
+	std::string HashPath::formatPath(std::string_view path)
 	{
-		uint64_t i = 0;
-		while ((i = path.find('\\')) != std::string::npos)
-			path[i] = '/';
-		while ((i = path.find("//")) != std::string::npos)
-			path.erase(path.begin() + i + 1);
-		return path;
+		std::string formatted;
+		formatted.reserve(path.size());
+		for (char c : path)
+		{
+			if (!isSeparator(c))
+				formatted.push_back(c);
+			else if (formatted.empty() || formatted.back() != '/')
+				formatted.push_back('/');
+		}
+		return formatted;
 	}
 
 	HashPath HashPath::operator+(const HashPath& other) const
@@ -172,12 +210,16 @@ namespace VFS {
 
 	HashPath& HashPath::operator+=(const Element& elem)
 	{
+		static const auto stayElem = Element(".");
 		static const auto stepOutElem = Element("..");
 
+		if (elem == stayElem)
+			return *this;
+
 		if (elem == stepOutElem && depth() > 0)
 			*this -= 1;
 		else
-			m_elements.push_back(elem);
+			m_nodes.push_back({ elem, combineHash(hash(), elem.asHash()) });
 
 		return *this;
 	}
@@ -191,20 +233,45 @@ namespace VFS {
 
 	HashPath& HashPath::operator-=(uint64_t depthDiff)
 	{
-		while (depthDiff-- > 0)
-			m_elements.pop_back();
+		m_nodes.truncate(depth() - std::min(depthDiff, depth()));
 		return *this;
 	}
 
+	uint64_t HashPath::findSeparator(const char* data, uint64_t begin, uint64_t size)
+	{
+		uint64_t i = begin;
+	#ifdef VFS_HAS_SSE2
+		const __m128i slash = _mm_set1_epi8('/');
+		const __m128i backslash = _mm_set1_epi8('\\');
+		for (; i + 16 <= size; i += 16)
+		{
+			__m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+			int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, slash), _mm_cmpeq_epi8(chunk, backslash)));
+			if (mask != 0)
+			{
+				for (; !isSeparator(data[i]); ++i);
+				return i;
+			}
+		}
+	#endif
+		for (; i < size; ++i)
+			if (isSeparator(data[i]))
+				return i;
+		return size;
+	}
+
 	const HashPath::Element& HashPath::operator[](uint64_t index) const
 	{
-		return m_elements[index];
+		return m_nodes[index].elem;
 	}
 
 	bool HashPath::operator==(const HashPath& other) const
 	{
-		uint64_t maxDepth = std::min(depth(), other.depth());
-		for (uint64_t i = 0; i < maxDepth; ++i)
+		if (depth() != other.depth() || hash() != other.hash())
+			return false;
+
+		// Equal hashes are almost always equal paths, the elements have the final say
+		for (uint64_t i = 0; i < depth(); ++i)
 			if ((*this)[i] != other[i])
 				return false;
 
@@ -218,11 +285,20 @@ namespace VFS {
 
 	HashPath::Iterator HashPath::begin() const
 	{
-		return m_elements.begin();
+		return m_nodes.begin();
 	}
 
 	HashPath::Iterator HashPath::end() const
 	{
-		return m_elements.end();
+		return m_nodes.end();
 	}
+}
+
+namespace std {
+
+	template<>
+	struct hash<VFS::HashPath>
+	{
+		size_t operator()(const VFS::HashPath& path) const { return (size_t)path.hash(); }
+	};
 }
\ No newline at end of file
@@ -1,8 +1,17 @@
 #pragma once
 
 #include "VFSAbstractFileIO.h"
+#include "VFSWriteAheadLog.h"
+#include "VFSMappedFile.h"
+#include "VFSBufferPool.h"
+#include "VFSValueCache.h"
+#include "VFSTrace.h"
 #include <set>
 #include <functional>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
 
 namespace VFS {
 
@@ -12,46 +21,99 @@ namespace VFS {
 		class Buffer
 		{
 		public:
-			Buffer(void* buff) : m_buff((char*)buff), m_autoDelete(false) {}
-			explicit Buffer(uint64_t size) : m_buff(new char[size]), m_autoDelete(true) {}
-			Buffer(const Buffer& other) : m_buff(other.m_buff), m_autoDelete(false) {}
-			Buffer(Buffer&& other) noexcept : m_buff(other.m_buff), m_autoDelete(other.m_buff) { other.m_autoDelete = false; }
+			Buffer(void* buff) : m_buff((char*)buff), m_size(0), m_autoDelete(false) {}
+			explicit Buffer(uint64_t size) : m_buff(BufferPool::acquire(size)), m_size(size), m_autoDelete(true) {}
+			Buffer(const Buffer& other) : m_buff(other.m_buff), m_size(other.m_size), m_autoDelete(false) {}
+			Buffer(Buffer&& other) noexcept : m_buff(other.m_buff), m_size(other.m_size), m_autoDelete(other.m_autoDelete) { other.m_autoDelete = false; }
 		public:
 			~Buffer() { doAutoDelete(); }
 		public:
-			Buffer& operator=(const Buffer& other) { doAutoDelete(); m_buff = other.m_buff; m_autoDelete = false; }
-			Buffer& operator=(Buffer&& other) { doAutoDelete(); m_buff = other.m_buff; m_autoDelete = other.m_autoDelete; other.m_buff = nullptr; other.m_autoDelete = false; return *this; }
+			Buffer& operator=(const Buffer& other) { if (this != &other) { doAutoDelete(); m_buff = other.m_buff; m_size = other.m_size; m_autoDelete = false; } return *this; }
+			Buffer& operator=(Buffer&& other) noexcept { if (this != &other) { doAutoDelete(); m_buff = other.m_buff; m_size = other.m_size; m_autoDelete = other.m_autoDelete; other.m_buff = nullptr; other.m_autoDelete = false; } return *this; }
 		public:
 			void* operator*() const { return m_buff; }
 			bool hasAutoDelete() const { return m_autoDelete; }
 		private:
-			void doAutoDelete() { if (m_autoDelete) delete m_buff; m_autoDelete = false; m_buff = nullptr; }
+			void doAutoDelete() { if (m_autoDelete) BufferPool::release(m_buff, m_size); m_autoDelete = false; m_buff = nullptr; }
 		private:
 			char* m_buff;
+			uint64_t m_size;
 			bool m_autoDelete;
 		};
 		typedef Buffer Key, Val;
 		typedef const Buffer ConstBuffer;
 		typedef ConstBuffer ConstKey, ConstVal;
+		// Pins the memory mapping a value lives in, the pointer stays valid while the view is held.
+		// The bytes are only stable as long as the map is not modified.
+		class ValueView
+		{
+		public:
+			ValueView() = default;
+			ValueView(MappedFileRef mapping, const char* data, uint64_t size) : m_mapping(mapping), m_data(data), m_size(size) {}
+		public:
+			const void* data() const { return m_data; }
+			uint64_t size() const { return m_size; }
+			operator bool() const { return m_data != nullptr; }
+		private:
+			MappedFileRef m_mapping;
+			const char* m_data = nullptr;
+			uint64_t m_size = 0;
+		};
 		enum class Location { Unspecified = 0, Sorted, Unsorted };
 		enum class Type { Unspecified = 0, Key, Value, Elem };
 	public:
-		MapStream(const std::string& path, AbstractFileIORef afio, uint64_t& keySize, uint64_t& valSize);
+		// When a write-ahead log is given, every mutating operation is committed to it
+		// before the file is touched, so a crash never leaves a half-applied operation.
+		// optimize() would log the whole map then, it writes the merged map to
+		// '<path>.optimize' instead and renames it over the file once it is durable.
+		// Operations returning bool report false if the log could not commit them,
+		// the map is left as it was before the operation then.
+		MapStream(const std::string& path, AbstractFileIORef afio, uint64_t& keySize, uint64_t& valSize, WriteAheadLogRef wal = nullptr);
 		~MapStream();
 	public:
-		void insert(ConstKey key, ConstVal value);
+		bool insert(ConstKey key, ConstVal value);
+		// False if the key does not exist
+		bool update(ConstKey key, ConstVal value);
+		bool upsert(ConstKey key, ConstVal value);
+		// Returns the number of updated keys, 0 if they could not be committed
+		uint64_t update(const void* keys, const void* values, uint64_t count);
+		bool upsert(const void* keys, const void* values, uint64_t count);
 		uint64_t find(ConstKey key) const;
 		void getValue (uint64_t index, Val valBuff) const;
+		ValueView getValueView(uint64_t index) const;
 		void erase(ConstKey key);
-		void optimize();
+		bool optimize();
 		float currOptimization() const;
-		void flush();
+		// Number of elements, including erased ones that were not flushed yet
+		uint64_t count() const;
+		bool flush();
+	public:
+		// Optional cache of hot keys in front of find()/get(), invalidated by every change of indices or values
+		void enableCache(uint64_t byteBudget, uint64_t nShards = 16);
+		void disableCache();
+		ValueCache::Stats getCacheStats() const;
+		bool get(ConstKey key, Val valBuff) const;
+	public:
+		// Calls func for every element whose key starts with the first prefixSize bytes of prefix.
+		// Matching sorted elements are one contiguous range, so they are read block by block
+		// in key order; the unsorted tail follows. func returns false to stop the scan and
+		// must not modify the map. Returns the number of elements passed to func.
+		typedef std::function<bool(const void* key, const void* value, uint64_t index)> ScanFunc;
+		uint64_t scan(const void* prefix, uint64_t prefixSize, const ScanFunc& func) const;
 	private:
+		uint64_t findUncached(ConstKey key) const;
 		uint64_t findSorted(ConstKey key) const;
 		uint64_t findUnsorted(ConstKey key) const;
+		uint64_t lowerBoundSorted(const void* prefix, uint64_t prefixSize) const;
 		void read(Location location, Type type, uint64_t index, Buffer buff) const;
 		void read(Location location, uint64_t nBytes, uint64_t index, Buffer buff) const;
 		void write(Location location, Type type, uint64_t index, ConstBuffer buff);
+		void writeRaw(const void* buffer, uint64_t size, uint64_t offset);
+		bool mergeIntoCopy(ConstBuffer buff);
+		void append(ConstKey key, ConstVal value);
+		void overwrite(uint64_t index, ConstVal value);
+		std::vector<uint64_t> sortedOrder(const void* keys, uint64_t count) const;
+		bool commit();
 		uint64_t getOffsetInFile(Location location, Type type, uint64_t elemIndex) const;
 		uint64_t getOffsetLocation(Location location) const;
 		uint64_t getOffsetInElem(Type type) const;
@@ -59,12 +121,15 @@ namespace VFS {
 		void eraseFinal();
 	private:
 		bool compare(ConstKey leftKey, ConstKey rightKey) const;
+		static bool compare(const char* leftKey, const char* rightKey, uint64_t keySize);
 	private:
 		Key makeKey() const;
 		Val makeVal() const;
 	private:
 		std::string m_path;
 		AbstractFileIORef m_afio;
+		WriteAheadLogRef m_wal;
+		WriteAheadLog::Transaction m_txn;
 		#pragma pack(push, 1)
 		struct Header
 		{
@@ -77,17 +142,27 @@ namespace VFS {
 		} m_header;
 		#pragma pack(pop)
 		static constexpr uint64_t UNSORTED_INDEX_BIT = (1ull << (sizeof(uint64_t) * 8 - 1));
+		uint64_t m_nSortedCommitted = 0; // Counts of the last header that reached the log
+		uint64_t m_nUnsortedCommitted = 0;
 		std::set<uint64_t> m_toErase;
+		mutable MappedFileRef m_mapping;
+		mutable bool m_mappingDirty = false;
+		std::unique_ptr<ValueCache> m_cache;
+	public:
+		friend class ConcurrentMapStream;
+		friend class MapStreamBuilder;
 	};
 
-	MapStream::MapStream(const std::string& path, AbstractFileIORef afio, uint64_t& keySize, uint64_t& valSize)
-		: m_path(path), m_afio(afio)
+	MapStream::MapStream(const std::string& path, AbstractFileIORef afio, uint64_t& keySize, uint64_t& valSize, WriteAheadLogRef wal)
+		: m_path(path), m_afio(afio), m_wal(wal)
 	{
 		if (m_afio->exists(m_path))
 		{
 			m_afio->read(m_path, &m_header, sizeof(Header), 0);
 			keySize = size(Type::Key);
 			valSize = size(Type::Value);
+			m_nSortedCommitted = m_header.nSorted;
+			m_nUnsortedCommitted = m_header.nUnsorted;
 		}
 		else
 		{
@@ -104,20 +179,118 @@ namespace VFS {
 		flush();
 	}
 
-	void MapStream::insert(ConstKey key, ConstVal value)
+	bool MapStream::insert(ConstKey key, ConstVal value)
 	{
-		if (find(key) != -1)
-			return; // TODO: Implemenent proper handling if key already exists
+		VFS_TRACE_SCOPE("MapStream::insert");
 
-		write(Location::Unsorted, Type::Key, m_header.nUnsorted, key);
-		write(Location::Unsorted, Type::Value, m_header.nUnsorted, value);
-		++m_header.nUnsorted;
+		if (findUncached(key) != -1)
+			return true; // Existing keys are left untouched, use upsert() to overwrite them
+
+		append(key, value);
+		return commit();
+	}
+
+	bool MapStream::update(ConstKey key, ConstVal value)
+	{
+		VFS_TRACE_SCOPE("MapStream::update");
+
+		uint64_t index = findUncached(key);
+		if (index == -1)
+			return false;
+
+		overwrite(index, value);
+		if (m_cache)
+			m_cache->erase(*key);
+		return commit();
+	}
+
+	bool MapStream::upsert(ConstKey key, ConstVal value)
+	{
+		VFS_TRACE_SCOPE("MapStream::upsert");
+
+		uint64_t index = findUncached(key);
+		if (index == -1)
+			append(key, value);
+		else
+			overwrite(index, value);
+
+		if (m_cache)
+			m_cache->erase(*key);
+		return commit();
+	}
+
+	uint64_t MapStream::update(const void* keys, const void* values, uint64_t count)
+	{
+		uint64_t nUpdated = 0;
+
+		// Visiting the keys in order keeps the lookups and writes moving forward through the file
+		for (uint64_t i : sortedOrder(keys, count))
+		{
+			uint64_t index = findUncached((char*)keys + i * size(Type::Key));
+			if (index == -1)
+				continue;
+
+			overwrite(index, (char*)values + i * size(Type::Value));
+			if (m_cache)
+				m_cache->erase((char*)keys + i * size(Type::Key));
+			++nUpdated;
+		}
+
+		return commit() ? nUpdated : 0;
+	}
+
+	bool MapStream::upsert(const void* keys, const void* values, uint64_t count)
+	{
+		auto order = sortedOrder(keys, count);
+
+		// Of keys given more than once the last one wins
+		auto isSameKey = [this, keys](uint64_t left, uint64_t right)
+		{
+			return memcmp((const char*)keys + left * size(Type::Key), (const char*)keys + right * size(Type::Key), size(Type::Key)) == 0;
+		};
+		std::vector<uint64_t> unique;
+		for (uint64_t i = 0; i < order.size(); ++i)
+		{
+			if (i + 1 < order.size() && isSameKey(order[i], order[i + 1]))
+				continue;
+			unique.push_back(order[i]);
+		}
+
+		// Look up everything first, with a write-ahead log the appends are not visible before the commit
+		std::vector<uint64_t> indices(unique.size());
+		for (uint64_t i = 0; i < unique.size(); ++i)
+			indices[i] = findUncached((char*)keys + unique[i] * size(Type::Key));
+
+		for (uint64_t i = 0; i < unique.size(); ++i)
+		{
+			ConstVal value = (char*)values + unique[i] * size(Type::Value);
+			if (indices[i] == -1)
+				append((char*)keys + unique[i] * size(Type::Key), value);
+			else
+				overwrite(indices[i], value);
+
+			if (m_cache)
+				m_cache->erase((char*)keys + unique[i] * size(Type::Key));
+		}
+
+		return commit();
 	}
 
 	uint64_t MapStream::find(ConstKey key) const
+	{
+		VFS_TRACE_SCOPE("MapStream::find");
+
+		uint64_t index = 0;
+		if (m_cache && m_cache->getIndex(*key, index))
+			return index;
+
+		return findUncached(key);
+	}
+
+	uint64_t MapStream::findUncached(ConstKey key) const
 	{
 		uint64_t index = 0;
-		if ((index = findSorted(key)) != -1)
+		if ((index = findSorted(key)) != -1 && !m_toErase.count(index))
 			return index;
 		if ((index = findUnsorted(key)) != -1)
 			return index;
@@ -135,75 +308,101 @@ namespace VFS {
 		);
 	}
 
+	MapStream::ValueView MapStream::getValueView(uint64_t index) const
+	{
+		uint64_t offset = getOffsetInFile(
+			(index & UNSORTED_INDEX_BIT) ? Location::Unsorted : Location::Sorted,
+			Type::Value,
+			(index & ~UNSORTED_INDEX_BIT)
+		);
+
+		if (m_mappingDirty)
+		{
+			// Writes may still sit in the stream buffer
+			m_afio->flush(m_path);
+			m_mappingDirty = false;
+		}
+
+		if (!m_mapping || m_mapping->size() < offset + size(Type::Value))
+			m_mapping = MappedFile::open(m_path);
+
+		if (!m_mapping || m_mapping->size() < offset + size(Type::Value))
+			return ValueView();
+
+		return ValueView(m_mapping, m_mapping->data() + offset, size(Type::Value));
+	}
+
 	void MapStream::erase(ConstKey key)
 	{
-		uint64_t index = find(key);
+		VFS_TRACE_SCOPE("MapStream::erase");
+
+		uint64_t index = findUncached(key);
 
 		if (index == -1)
 			return;
 
 		m_toErase.insert(index);
+		if (m_cache)
+			m_cache->erase(*key);
 	}
 
-	void MapStream::optimize()
+	bool MapStream::optimize()
 	{
-		flush();
+		VFS_TRACE_SCOPE("MapStream::optimize");
+
+		if (!flush())
+			return false;
 
 		if (m_header.nUnsorted == 0)
-			return;
+			return true;
 
 		Buffer buff(m_header.nUnsorted * size(Type::Elem));
 		read(Location::Unsorted, m_header.nUnsorted, 0, buff);
 
 		// Sort the unsorted data
-		for (uint64_t toCheckIndex = m_header.nUnsorted - 1; toCheckIndex != -1; --toCheckIndex)
+		std::vector<uint64_t> order(m_header.nUnsorted);
+		for (uint64_t i = 0; i < order.size(); ++i)
+			order[i] = i;
+		std::sort(order.begin(), order.end(), [this, &buff](uint64_t left, uint64_t right)
+			{
+				return compare((char*)*buff + left * size(Type::Elem), (char*)*buff + right * size(Type::Elem));
+			});
+		Buffer sorted(m_header.nUnsorted * size(Type::Elem));
+		for (uint64_t i = 0; i < order.size(); ++i)
+			memcpy((char*)*sorted + i * size(Type::Elem), (char*)*buff + order[i] * size(Type::Elem), size(Type::Elem));
+		buff = std::move(sorted);
+
+		if (m_wal)
 		{
-			char* baseElem = (char*)*buff + size(Type::Elem) * toCheckIndex;
-			char* biggerElem = baseElem;
+			if (!mergeIntoCopy(buff))
+				return false; // The map stays as it was, with its unsorted region
 
-			// Find an element bigger than the current
-			for (uint64_t tempIndex = 0; tempIndex < toCheckIndex; ++tempIndex)
-			{
-				char* tempElem = (char*)*buff + size(Type::Elem) * tempIndex;
-				if (compare(biggerElem, tempElem))
-					biggerElem = tempElem;
-			}
+			if (m_cache)
+				m_cache->clear();
 
-			if (biggerElem != baseElem)
-			{
-				// Swap both elements
-				for (uint64_t i = 0; i < m_header.elemSize; ++i)
-				{
-					char tc = biggerElem[i];
-					biggerElem[i] = baseElem[i];
-					baseElem[i] = tc;
-				}
-			}
+			return commit();
 		}
 
-
 		// Initialize needed vars for merging
 		uint64_t buffIndex = m_header.nUnsorted - 1;
 		uint64_t sortedIndex = m_header.nSorted - 1;
 
-		Buffer lastElem = makeKey();
+		Buffer lastElem(size(Type::Elem));
 		if (sortedIndex != -1)
 			read(Location::Sorted, Type::Elem, sortedIndex, lastElem);
 
-		Buffer tempElem = (char*)*buff + buffIndex * size(Type::Elem);
-
-		// Merge the sorted buffer with the already sorted data
-		for (uint64_t i = m_header.nUnsorted - 1; i != -1; --i)
+		// Merge the sorted buffer with the already sorted data (back to front, in place)
+		for (uint64_t i = m_header.nSorted + m_header.nUnsorted - 1; buffIndex != -1; --i)
 		{
+			Buffer tempElem = (char*)*buff + buffIndex * size(Type::Elem);
 			if (sortedIndex == -1 || compare(lastElem, tempElem))
 			{
-				write(Location::Unsorted, Type::Elem, i, tempElem);
+				write(Location::Sorted, Type::Elem, i, tempElem);
 				--buffIndex;
-				tempElem = (char*)*buff + buffIndex * size(Type::Elem);
 			}
 			else
 			{
-				write(Location::Unsorted, Type::Elem, i, lastElem);
+				write(Location::Sorted, Type::Elem, i, lastElem);
 				--sortedIndex;
 				if (sortedIndex != -1)
 					read(Location::Sorted, Type::Elem, sortedIndex, lastElem);
@@ -212,51 +411,171 @@ namespace VFS {
 
 		m_header.nSorted += m_header.nUnsorted;
 		m_header.nUnsorted = 0;
+
+		if (m_cache)
+			m_cache->clear();
+
+		return commit();
 	}
 
 	float MapStream::currOptimization() const
 	{
-		return m_header.nSorted / (float)std::max(1ull, m_header.nSorted + m_header.nUnsorted);
+		return m_header.nSorted / (float)std::max<uint64_t>(1, m_header.nSorted + m_header.nUnsorted);
+	}
+
+	uint64_t MapStream::count() const
+	{
+		return m_header.nSorted + m_header.nUnsorted;
+	}
+
+	void MapStream::enableCache(uint64_t byteBudget, uint64_t nShards)
+	{
+		m_cache.reset(new ValueCache(byteBudget, size(Type::Key), size(Type::Value), nShards));
+	}
+
+	void MapStream::disableCache()
+	{
+		m_cache.reset();
+	}
+
+	ValueCache::Stats MapStream::getCacheStats() const
+	{
+		if (!m_cache)
+			return ValueCache::Stats();
+		return m_cache->getStats();
 	}
 
-	void MapStream::flush()
+	bool MapStream::get(ConstKey key, Val valBuff) const
 	{
+		uint64_t index = 0;
+		if (m_cache && m_cache->get(*key, *valBuff, index))
+			return true;
+
+		index = findUncached(key);
+		if (index == -1)
+			return false;
+
+		getValue(index, valBuff);
+		if (m_cache)
+			m_cache->put(*key, *valBuff, index);
+		return true;
+	}
+
+	bool MapStream::flush()
+	{
+		VFS_TRACE_SCOPE("MapStream::flush");
+
+		if (!m_wal)
+		{
+			eraseFinal();
+			m_afio->write(m_path, &m_header, sizeof(Header), 0);
+			return true;
+		}
+
+		// Erased elements stay pending if the compaction cannot be committed
+		std::set<uint64_t> toErase;
+		if (!m_toErase.empty())
+			toErase = m_toErase;
+
 		eraseFinal();
-		m_afio->write(m_path, &m_header, sizeof(Header), 0);
+		if (commit())
+			return true;
+
+		m_toErase = std::move(toErase);
+		return false;
+	}
+
+	uint64_t MapStream::scan(const void* prefix, uint64_t prefixSize, const ScanFunc& func) const
+	{
+		prefixSize = std::min(prefixSize, size(Type::Key));
+
+		constexpr uint64_t minBuffSize = 4096;
+		constexpr uint64_t maxBuffSize = 65536;
+		const uint64_t maxBlockElems = std::max<uint64_t>(1, maxBuffSize / size(Type::Elem));
+		Buffer block(maxBlockElems * size(Type::Elem));
+
+		// Most ranges are short, the sorted blocks start small and grow with the range
+		uint64_t blockElems = std::max<uint64_t>(1, minBuffSize / size(Type::Elem));
+		uint64_t nVisited = 0;
+		bool inRange = true;
+		for (uint64_t index = lowerBoundSorted(prefix, prefixSize); inRange && index < m_header.nSorted; blockElems = std::min(blockElems * 2, maxBlockElems))
+		{
+			uint64_t nElements = std::min(blockElems, m_header.nSorted - index);
+			read(Location::Sorted, nElements, index, block);
+
+			for (uint64_t i = 0; i < nElements; ++i, ++index)
+			{
+				const char* elem = (const char*)*block + i * size(Type::Elem);
+				if (memcmp(elem, prefix, prefixSize) != 0)
+				{
+					inRange = false;
+					break;
+				}
+				if (m_toErase.count(index))
+					continue;
+
+				++nVisited;
+				if (!func(elem, elem + size(Type::Key), index))
+					return nVisited;
+			}
+		}
+
+		for (uint64_t index = 0; index < m_header.nUnsorted; )
+		{
+			uint64_t nElements = std::min(maxBlockElems, m_header.nUnsorted - index);
+			read(Location::Unsorted, nElements, index, block);
+
+			for (uint64_t i = 0; i < nElements; ++i, ++index)
+			{
+				const char* elem = (const char*)*block + i * size(Type::Elem);
+				if (memcmp(elem, prefix, prefixSize) != 0 || m_toErase.count(index | UNSORTED_INDEX_BIT))
+					continue;
+
+				++nVisited;
+				if (!func(elem, elem + size(Type::Key), index | UNSORTED_INDEX_BIT))
+					return nVisited;
+			}
+		}
+
+		return nVisited;
 	}
 
 	uint64_t MapStream::findSorted(ConstKey key) const
 	{
-		uint64_t stepSize = m_header.nSorted - 2;
-		uint64_t index = stepSize;
+		VFS_TRACE_SCOPE("MapStream::findSorted");
 
-		uint64_t result = -1;
+		uint64_t low = 0;
+		uint64_t high = m_header.nSorted;
 
 		Key temp = makeKey();
-		do
+		while (low < high)
 		{
+			uint64_t index = low + (high - low) / 2;
+			read(Location::Sorted, Type::Key, index, temp);
+
 			if (compare(temp, key))
-				index += stepSize;
+				low = index + 1;
 			else if (compare(key, temp))
-				index -= stepSize;
+				high = index;
 			else
-				result = index;
-
-			stepSize /= 2;
-		} while (stepSize > 0 && result == -1);
+				return index;
+		}
 
-		return result;
+		return -1;
 	}
 
 	uint64_t MapStream::findUnsorted(ConstKey key) const
 	{
+		VFS_TRACE_SCOPE("MapStream::findUnsorted");
+
 		uint64_t index = -1;
 		Key temp = makeKey();
 		for (uint64_t i = 0; i < m_header.nUnsorted; ++i)
 		{
 			read(Location::Unsorted, Type::Key, i, temp);
 			if (!compare(temp, key) &&
-				!compare(key, temp))
+				!compare(key, temp) &&
+				!m_toErase.count(i | UNSORTED_INDEX_BIT))
 			{
 				index = i;
 				break;
@@ -266,6 +585,26 @@ namespace VFS {
 		return index | UNSORTED_INDEX_BIT;
 	}
 
+	uint64_t MapStream::lowerBoundSorted(const void* prefix, uint64_t prefixSize) const
+	{
+		uint64_t low = 0;
+		uint64_t high = m_header.nSorted;
+
+		Key temp = makeKey();
+		while (low < high)
+		{
+			uint64_t index = low + (high - low) / 2;
+			read(Location::Sorted, Type::Key, index, temp);
+
+			if (memcmp(*temp, prefix, prefixSize) < 0)
+				low = index + 1;
+			else
+				high = index;
+		}
+
+		return low;
+	}
+
 	void MapStream::read(Location location, Type type, uint64_t index, Buffer buff) const
 	{
 		m_afio->read(
@@ -296,8 +635,7 @@ namespace VFS {
 
 	void MapStream::write(Location location, Type type, uint64_t index, ConstBuffer buff)
 	{
-		m_afio->write(
-			m_path,
+		writeRaw(
 			*buff,
 			size(type),
 			getOffsetInFile(
@@ -308,6 +646,155 @@ namespace VFS {
 		);
 	}
 
+	void MapStream::writeRaw(const void* buffer, uint64_t size, uint64_t offset)
+	{
+		m_mappingDirty = true;
+
+		if (m_wal)
+			m_txn.write(m_path, buffer, size, offset);
+		else
+			m_afio->write(m_path, buffer, size, offset);
+	}
+
+	bool MapStream::mergeIntoCopy(ConstBuffer buff)
+	{
+		VFS_TRACE_SCOPE("MapStream::mergeIntoCopy");
+
+		// The file is replaced as a whole, nothing logged for it may still be missing
+		m_wal->checkpoint();
+
+		std::string copyPath = m_path + ".optimize";
+		if (m_afio->make(copyPath).code != AbstractFileIO::ErrCode::Success)
+			return false;
+		auto copy = m_afio->open(copyPath);
+
+		Header header = m_header;
+		header.nSorted += header.nUnsorted;
+		header.nUnsorted = 0;
+		bool isWritten = m_afio->write(copy, &header, sizeof(Header), 0).code == AbstractFileIO::ErrCode::Success;
+
+		// Merge front to back, both the sorted region and the output go through one block each
+		constexpr uint64_t maxBuffSize = 65536;
+		const uint64_t elemSize = size(Type::Elem);
+		const uint64_t blockElems = std::max<uint64_t>(1, maxBuffSize / elemSize);
+		Buffer block(blockElems * elemSize);
+		Buffer output(blockElems * elemSize);
+		uint64_t blockBegin = 0;
+		uint64_t blockEnd = 0;
+		uint64_t sortedIndex = 0;
+		uint64_t buffIndex = 0;
+		uint64_t nOutput = 0;
+		uint64_t outputOffset = sizeof(Header);
+		while (isWritten && (sortedIndex < m_header.nSorted || buffIndex < m_header.nUnsorted))
+		{
+			if (sortedIndex < m_header.nSorted && sortedIndex == blockEnd)
+			{
+				blockBegin = sortedIndex;
+				blockEnd = std::min(m_header.nSorted, blockBegin + blockElems);
+				read(Location::Sorted, blockEnd - blockBegin, blockBegin, block);
+			}
+
+			const char* sortedElem = sortedIndex < m_header.nSorted ? (const char*)*block + (sortedIndex - blockBegin) * elemSize : nullptr;
+			const char* buffElem = buffIndex < m_header.nUnsorted ? (const char*)*buff + buffIndex * elemSize : nullptr;
+			const char* elem = nullptr;
+			if (!buffElem || (sortedElem && compare(sortedElem, buffElem, size(Type::Key))))
+			{
+				elem = sortedElem;
+				++sortedIndex;
+			}
+			else
+			{
+				elem = buffElem;
+				++buffIndex;
+			}
+
+			memcpy((char*)*output + nOutput * elemSize, elem, elemSize);
+			if (++nOutput == blockElems || (sortedIndex == m_header.nSorted && buffIndex == m_header.nUnsorted))
+			{
+				isWritten = m_afio->write(copy, *output, nOutput * elemSize, outputOffset).code == AbstractFileIO::ErrCode::Success;
+				outputOffset += nOutput * elemSize;
+				nOutput = 0;
+			}
+		}
+
+		isWritten = isWritten && m_afio->sync(copyPath).code == AbstractFileIO::ErrCode::Success;
+		copy = nullptr;
+		m_afio->closeMatchingStreams(copyPath);
+
+		std::error_code ec;
+		if (isWritten)
+		{
+			m_afio->closeMatchingStreams(m_path);
+			std::filesystem::rename(copyPath, m_path, ec);
+		}
+		if (!isWritten || ec)
+		{
+			m_afio->remove(copyPath);
+			return false;
+		}
+
+		m_header.nSorted = header.nSorted;
+		m_header.nUnsorted = header.nUnsorted;
+		m_nSortedCommitted = header.nSorted; // Durable in the file itself
+		m_nUnsortedCommitted = header.nUnsorted;
+		m_mappingDirty = true;
+		return true;
+	}
+
+	void MapStream::append(ConstKey key, ConstVal value)
+	{
+		write(Location::Unsorted, Type::Key, m_header.nUnsorted, key);
+		write(Location::Unsorted, Type::Value, m_header.nUnsorted, value);
+		++m_header.nUnsorted;
+	}
+
+	void MapStream::overwrite(uint64_t index, ConstVal value)
+	{
+		write(
+			(index & UNSORTED_INDEX_BIT) ? Location::Unsorted : Location::Sorted,
+			Type::Value,
+			(index & ~UNSORTED_INDEX_BIT),
+			value
+		);
+	}
+
+	std::vector<uint64_t> MapStream::sortedOrder(const void* keys, uint64_t count) const
+	{
+		std::vector<uint64_t> order(count);
+		for (uint64_t i = 0; i < count; ++i)
+			order[i] = i;
+
+		std::stable_sort(order.begin(), order.end(), [this, keys](uint64_t left, uint64_t right)
+			{
+				return compare((const char*)keys + left * size(Type::Key), (const char*)keys + right * size(Type::Key), size(Type::Key));
+			}
+		);
+		return order;
+	}
+
+	bool MapStream::commit()
+	{
+		if (!m_wal)
+			return true;
+
+		// The header is part of every transaction so a replay always restores matching counts
+		writeRaw(&m_header, sizeof(Header), 0);
+		if (m_wal->commit(m_txn))
+		{
+			m_nSortedCommitted = m_header.nSorted;
+			m_nUnsortedCommitted = m_header.nUnsorted;
+			return true;
+		}
+
+		// Not applied, the file keeps the state of the last commit and so does the map
+		m_txn.clear();
+		m_header.nSorted = m_nSortedCommitted;
+		m_header.nUnsorted = m_nUnsortedCommitted;
+		if (m_cache)
+			m_cache->clear();
+		return false;
+	}
+
 	uint64_t MapStream::getOffsetInFile(Location location, Type type, uint64_t elemIndex) const
 	{
 		return
@@ -350,12 +837,18 @@ namespace VFS {
 
 	void MapStream::eraseFinal()
 	{
+		VFS_TRACE_SCOPE("MapStream::eraseFinal");
+
 		uint64_t nErasedSorted = 0;
 		uint64_t nErasedUnsorted = 0;
 
 		if (m_toErase.empty())
 			return;
 
+		// Erasing shifts the indices of everything behind the erased elements
+		if (m_cache)
+			m_cache->clear();
+
 		uint64_t endIndex = (m_header.nUnsorted | UNSORTED_INDEX_BIT);
 		m_toErase.insert(endIndex);
 
@@ -377,7 +870,7 @@ namespace VFS {
 				break;
 
 			uint64_t blockSize = getOffsetInFile(
-				isUnsorted ? Location::Unsorted : Location::Sorted,
+				(*nextIt & UNSORTED_INDEX_BIT) ? Location::Unsorted : Location::Sorted,
 				Type::Key,
 				(*nextIt & ~UNSORTED_INDEX_BIT)
 			) - blockBegin;
@@ -390,7 +883,7 @@ namespace VFS {
 			{
 				uint64_t nToMove = std::min(maxBuffSize, nRemaining);
 				m_afio->read(m_path, *buffer, nToMove, blockBegin);
-				m_afio->write(m_path, *buffer, nToMove, blockBeginShifted);
+				writeRaw(*buffer, nToMove, blockBeginShifted);
 
 				blockBegin += nToMove;
 				blockBeginShifted += nToMove;
@@ -407,16 +900,13 @@ namespace VFS {
 
 	bool MapStream::compare(ConstKey leftKey, ConstKey rightKey) const
 	{
-		auto l = (const char*)*leftKey;
-		auto r = (const char*)*rightKey;
-
-		for (uint64_t i = 0; i < size(Type::Key); ++i)
-		{
-			if (l[i] != r[i])
-				return l[i] < r[i];
-		}
+		return compare((const char*)*leftKey, (const char*)*rightKey, size(Type::Key));
+	}
 
-		return false;
+	bool MapStream::compare(const char* l, const char* r, uint64_t keySize)
+	{
+		// Keys are ordered by their unsigned bytes, so big-endian integers and strings sort naturally
+		return memcmp(l, r, keySize) < 0;
 	}
 
 	MapStream::Key MapStream::makeKey() const
@@ -0,0 +1,292 @@
+#pragma once
+
+#include "VFSMapStream.h"
+
+#include <vector>
+#include <queue>
+#include <numeric>
+#include <algorithm>
+
+namespace VFS {
+
+	// Writes a complete MapStream file in one sequential pass, with all elements in the sorted region.
+	//
+	// Mode::Presorted expects the records in strictly ascending key order and rejects
+	// any record that breaks it. Mode::Unsorted accepts any order: records are sorted
+	// in runs of at most memoryBudget bytes, spilled to '<path>.run<N>' and merged while
+	// writing. Of duplicate keys the first one added is kept, as MapStream::insert does.
+	class MapStreamBuilder
+	{
+	public:
+		enum class Mode { Presorted = 0, Unsorted };
+		enum class ErrCode
+		{
+			Success = 0,
+			CannotAccessFile,
+			KeyOrderViolation,
+			AlreadyFinished
+		};
+	public:
+		MapStreamBuilder(const std::string& path, AbstractFileIORef afio, uint64_t keySize, uint64_t valSize, Mode mode = Mode::Presorted, uint64_t memoryBudget = 64ull << 20);
+		~MapStreamBuilder();
+	public:
+		ErrCode add(MapStream::ConstKey key, MapStream::ConstVal value);
+		ErrCode finish();
+		uint64_t count() const { return m_nElements; }
+	private:
+		ErrCode append(const char* elem);
+		ErrCode flushOutput();
+		ErrCode spillRun();
+		ErrCode mergeRuns();
+		void sortRun(std::vector<uint64_t>& order) const;
+	private:
+		static constexpr uint64_t OUTPUT_BUFFER_SIZE = 1ull << 20;
+	private:
+		std::string m_path;
+		AbstractFileIORef m_afio;
+		const Mode m_mode;
+		const uint64_t m_keySize;
+		const uint64_t m_valSize;
+		const uint64_t m_elemSize;
+		const uint64_t m_memoryBudget;
+		std::vector<char> m_output;
+		uint64_t m_outputOffset = sizeof(MapStream::Header);
+		std::vector<char> m_lastKey;
+		bool m_hasLastKey = false;
+		uint64_t m_nElements = 0;
+		std::vector<char> m_run;
+		std::vector<std::pair<std::string, uint64_t>> m_runs; // Path and number of elements
+		bool m_isFinished = false;
+	};
+
+	MapStreamBuilder::MapStreamBuilder(const std::string& path, AbstractFileIORef afio, uint64_t keySize, uint64_t valSize, Mode mode, uint64_t memoryBudget)
+		: m_path(path), m_afio(afio), m_mode(mode), m_keySize(keySize), m_valSize(valSize), m_elemSize(keySize + valSize),
+		m_memoryBudget(std::max(memoryBudget, 2 * OUTPUT_BUFFER_SIZE)), m_lastKey(keySize)
+	{
+		// A stream still open on an earlier file at path could write its buffer over the new one
+		m_afio->closeMatchingStreams(m_path);
+		m_afio->make(m_path);
+		m_output.reserve(OUTPUT_BUFFER_SIZE + m_elemSize);
+	}
+
+	MapStreamBuilder::~MapStreamBuilder()
+	{
+		if (!m_isFinished)
+			finish();
+	}
+
+	MapStreamBuilder::ErrCode MapStreamBuilder::add(MapStream::ConstKey key, MapStream::ConstVal value)
+	{
+		if (m_isFinished)
+			return ErrCode::AlreadyFinished;
+
+		if (m_mode == Mode::Presorted)
+		{
+			if (m_hasLastKey && !MapStream::compare(m_lastKey.data(), (const char*)*key, m_keySize))
+				return ErrCode::KeyOrderViolation;
+
+			m_output.insert(m_output.end(), (const char*)*key, (const char*)*key + m_keySize);
+			m_output.insert(m_output.end(), (const char*)*value, (const char*)*value + m_valSize);
+			memcpy(m_lastKey.data(), *key, m_keySize);
+			m_hasLastKey = true;
+			++m_nElements;
+
+			if (m_output.size() >= OUTPUT_BUFFER_SIZE)
+				return flushOutput();
+			return ErrCode::Success;
+		}
+
+		m_run.insert(m_run.end(), (const char*)*key, (const char*)*key + m_keySize);
+		m_run.insert(m_run.end(), (const char*)*value, (const char*)*value + m_valSize);
+
+		if (m_run.size() >= m_memoryBudget / 2)
+			return spillRun();
+		return ErrCode::Success;
+	}
+
+	MapStreamBuilder::ErrCode MapStreamBuilder::finish()
+	{
+		if (m_isFinished)
+			return ErrCode::AlreadyFinished;
+		m_isFinished = true;
+
+		ErrCode ec = ErrCode::Success;
+		if (m_mode == Mode::Unsorted)
+		{
+			if (m_runs.empty())
+			{
+				// Everything fit into memory, no need for a merge pass
+				std::vector<uint64_t> order;
+				sortRun(order);
+				for (uint64_t i = 0; i < order.size() && ec == ErrCode::Success; ++i)
+					ec = append(m_run.data() + order[i] * m_elemSize);
+				m_run.clear();
+			}
+			else
+			{
+				ec = spillRun();
+				if (ec == ErrCode::Success)
+					ec = mergeRuns();
+			}
+		}
+
+		if (ec == ErrCode::Success)
+			ec = flushOutput();
+
+		if (ec == ErrCode::Success)
+		{
+			MapStream::Header header;
+			header.keySize = m_keySize;
+			header.valSize = m_valSize;
+			header.elemSize = m_elemSize;
+			header.nSorted = m_nElements;
+			header.nUnsorted = 0;
+			if (m_afio->write(m_path, &header, sizeof(header), 0).code != AbstractFileIO::ErrCode::Success)
+				ec = ErrCode::CannotAccessFile;
+		}
+
+		return ec;
+	}
+
+	MapStreamBuilder::ErrCode MapStreamBuilder::append(const char* elem)
+	{
+		// Runs may hold the same key more than once, the first one wins
+		if (m_hasLastKey && !MapStream::compare(m_lastKey.data(), elem, m_keySize))
+			return MapStream::compare(elem, m_lastKey.data(), m_keySize) ? ErrCode::KeyOrderViolation : ErrCode::Success;
+
+		m_output.insert(m_output.end(), elem, elem + m_elemSize);
+		memcpy(m_lastKey.data(), elem, m_keySize);
+		m_hasLastKey = true;
+		++m_nElements;
+
+		if (m_output.size() >= OUTPUT_BUFFER_SIZE)
+			return flushOutput();
+		return ErrCode::Success;
+	}
+
+	MapStreamBuilder::ErrCode MapStreamBuilder::flushOutput()
+	{
+		if (m_output.empty())
+			return ErrCode::Success;
+
+		if (m_afio->write(m_path, m_output.data(), m_output.size(), m_outputOffset).code != AbstractFileIO::ErrCode::Success)
+			return ErrCode::CannotAccessFile;
+
+		m_outputOffset += m_output.size();
+		m_output.clear();
+		return ErrCode::Success;
+	}
+
+	MapStreamBuilder::ErrCode MapStreamBuilder::spillRun()
+	{
+		std::vector<uint64_t> order;
+		sortRun(order);
+
+		std::string runPath = m_path + ".run" + std::to_string(m_runs.size());
+		if (m_afio->make(runPath).code != AbstractFileIO::ErrCode::Success)
+			return ErrCode::CannotAccessFile;
+
+		std::vector<char> block;
+		block.reserve(OUTPUT_BUFFER_SIZE + m_elemSize);
+		uint64_t offset = 0;
+		for (uint64_t i = 0; i < order.size(); ++i)
+		{
+			const char* elem = m_run.data() + order[i] * m_elemSize;
+			block.insert(block.end(), elem, elem + m_elemSize);
+
+			if (block.size() >= OUTPUT_BUFFER_SIZE || i + 1 == order.size())
+			{
+				if (m_afio->write(runPath, block.data(), block.size(), offset).code != AbstractFileIO::ErrCode::Success)
+					return ErrCode::CannotAccessFile;
+				offset += block.size();
+				block.clear();
+			}
+		}
+
+		m_runs.push_back(std::make_pair(runPath, order.size()));
+		m_run.clear();
+		return ErrCode::Success;
+	}
+
+	MapStreamBuilder::ErrCode MapStreamBuilder::mergeRuns()
+	{
+		struct RunReader
+		{
+			std::string path;
+			uint64_t nElements;
+			uint64_t nRead = 0;
+			std::vector<char> block;
+			uint64_t blockPos = 0;
+			uint64_t blockCount = 0;
+		};
+
+		uint64_t blockElems = std::max<uint64_t>(1, (m_memoryBudget / 2 / m_runs.size()) / m_elemSize);
+
+		std::vector<RunReader> readers(m_runs.size());
+		auto refill = [this, blockElems](RunReader& reader)
+		{
+			reader.blockCount = std::min(blockElems, reader.nElements - reader.nRead);
+			reader.block.resize(reader.blockCount * m_elemSize);
+			m_afio->read(reader.path, reader.block.data(), reader.block.size(), reader.nRead * m_elemSize);
+			reader.nRead += reader.blockCount;
+			reader.blockPos = 0;
+		};
+		auto current = [this, &readers](uint64_t run) { return readers[run].block.data() + readers[run].blockPos * m_elemSize; };
+
+		// Ties go to the earlier run, so the first added duplicate is the one kept
+		auto greater = [this, &current](uint64_t left, uint64_t right)
+		{
+			if (MapStream::compare(current(right), current(left), m_keySize))
+				return true;
+			if (MapStream::compare(current(left), current(right), m_keySize))
+				return false;
+			return left > right;
+		};
+		std::priority_queue<uint64_t, std::vector<uint64_t>, decltype(greater)> heap(greater);
+
+		for (uint64_t run = 0; run < m_runs.size(); ++run)
+		{
+			readers[run].path = m_runs[run].first;
+			readers[run].nElements = m_runs[run].second;
+			if (readers[run].nElements == 0)
+				continue;
+			refill(readers[run]);
+			heap.push(run);
+		}
+
+		ErrCode ec = ErrCode::Success;
+		while (!heap.empty() && ec == ErrCode::Success)
+		{
+			uint64_t run = heap.top();
+			heap.pop();
+
+			ec = append(current(run));
+
+			auto& reader = readers[run];
+			if (++reader.blockPos == reader.blockCount)
+			{
+				if (reader.nRead == reader.nElements)
+					continue;
+				refill(reader);
+			}
+			heap.push(run);
+		}
+
+		for (auto& run : m_runs)
+			m_afio->remove(run.first);
+		m_runs.clear();
+
+		return ec;
+	}
+
+	void MapStreamBuilder::sortRun(std::vector<uint64_t>& order) const
+	{
+		order.resize(m_run.size() / m_elemSize);
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [this](uint64_t left, uint64_t right)
+			{
+				return MapStream::compare(m_run.data() + left * m_elemSize, m_run.data() + right * m_elemSize, m_keySize);
+			}
+		);
+	}
+}
\ No newline at end of file
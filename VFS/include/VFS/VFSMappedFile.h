@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <memory>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace VFS {
+
+	class MappedFile;
+
+	typedef std::shared_ptr<const MappedFile> MappedFileRef;
+
+	// Read-only memory mapping of a whole file.
+	class MappedFile
+	{
+	private:
+		MappedFile() = default;
+	public:
+		~MappedFile();
+	public:
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+	public:
+		static MappedFileRef open(const std::string& path);
+	public:
+		const char* data() const { return m_data; }
+		uint64_t size() const { return m_size; }
+	private:
+		const char* m_data = nullptr;
+		uint64_t m_size = 0;
+	#ifdef _WIN32
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		HANDLE m_mapping = NULL;
+	#endif
+	};
+
+	MappedFile::~MappedFile()
+	{
+	#ifdef _WIN32
+		if (m_data)
+			UnmapViewOfFile(m_data);
+		if (m_mapping)
+			CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+	#else
+		if (m_data)
+			munmap((void*)m_data, m_size);
+	#endif
+	}
+
+	MappedFileRef MappedFile::open(const std::string& path)
+	{
+		std::shared_ptr<MappedFile> mf(new MappedFile());
+
+	#ifdef _WIN32
+		mf->m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (mf->m_file == INVALID_HANDLE_VALUE)
+			return nullptr;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(mf->m_file, &size) || size.QuadPart == 0)
+			return nullptr;
+
+		mf->m_mapping = CreateFileMappingA(mf->m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!mf->m_mapping)
+			return nullptr;
+
+		mf->m_data = (const char*)MapViewOfFile(mf->m_mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!mf->m_data)
+			return nullptr;
+		mf->m_size = size.QuadPart;
+	#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return nullptr;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			close(fd);
+			return nullptr;
+		}
+
+		void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd); // The mapping keeps its own reference to the file
+		if (data == MAP_FAILED)
+			return nullptr;
+
+		mf->m_data = (const char*)data;
+		mf->m_size = st.st_size;
+	#endif
+
+		return mf;
+	}
+}
\ No newline at end of file
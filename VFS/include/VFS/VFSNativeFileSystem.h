@@ -0,0 +1,423 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <filesystem>
+#include <atomic>
+#include <shared_mutex>
+
+#include "VFSFileSystem.h"
+#include "VFSAbstractFileIO.h"
+#include "VFSDirectoryTrie.h"
+#include "VFSFileWatcher.h"
+
+namespace VFS {
+
+	// FileSystem backed by a directory of the host file system.
+	//
+	// Existence checks go through a DirectoryTrie that is filled by lookups, listings and the
+	// create/delete calls of this object, so repeated checks and handle lookups of known or
+	// known missing paths never reach the kernel. Changes made to the directory from outside
+	// are not seen until invalidate() is called, or right away while watching() is enabled.
+	class NativeFileSystem : public FileSystem
+	{
+	public:
+		NativeFileSystem(const std::string& basePath, AbstractFileIORef afio, uint64_t maxNegativeEntries = 4096);
+	public:
+		ErrCode createFile(HashPathRef path) override;
+		ErrCode deleteFile(HashPathRef path) override;
+		ErrCode createDirectory(HashPathRef path) override;
+		ErrCode deleteDirectory(HashPathRef path) override;
+		ErrCode stat(HashPathRef path, Entry& entry) override;
+		ErrCode listDirectory(HashPathRef path, std::vector<Entry>& entries) override;
+		EntryType typeOf(HashPathRef path) override;
+	public:
+		ErrCode readFile(HashPathRef path, void* buffer, uint64_t count, uint64_t offset) override;
+		ErrCode writeFile(HashPathRef path, const void* buffer, uint64_t count, uint64_t offset) override;
+		ErrCode resizeFile(HashPathRef path, uint64_t newSize) override;
+		ErrCode setLastModTime(HashPathRef path, uint64_t modTime) override;
+		ErrCode openFile(HashPathRef path, bool forWriting, FileToken& token) override;
+	public:
+		// Drops everything known about the directory
+		void invalidate();
+		// Keeps the trie and the open streams in sync with changes made by other processes.
+		// Returns false if the platform has no FileWatcher support.
+		bool startWatching();
+		void stopWatching();
+		bool isWatching() const { return m_watcher != nullptr; }
+		const DirectoryTrie& getTrie() const { return m_trie; }
+	protected:
+		std::string getRealPath(HashPathRef path) override;
+	private:
+		ErrCode checkCreate(HashPathRef path);
+		static bool isContained(HashPathRef path);
+		void cacheType(HashPathRef path, EntryType type, uint64_t hostGeneration);
+		static EntryType toEntryType(std::filesystem::file_type type);
+		static uint64_t toModTime(std::filesystem::file_time_type time);
+		void onHostChange(HashPathRef path, FileWatcher::Event event, bool isDirectory);
+	private:
+		AbstractFileIORef m_afio;
+		DirectoryTrie m_trie;
+		std::unique_ptr<FileWatcher> m_watcher;
+		// Bumped by every change reported by the watcher, results of host lookups that
+		// overlapped a change are not cached
+		std::atomic<uint64_t> m_hostGeneration = 0;
+		std::shared_mutex m_mtxHost;
+	};
+
+	NativeFileSystem::NativeFileSystem(const std::string& basePath, AbstractFileIORef afio, uint64_t maxNegativeEntries)
+		: FileSystem(basePath), m_afio(afio), m_trie(maxNegativeEntries)
+	{
+	}
+
+	ErrCode NativeFileSystem::createFile(HashPathRef path)
+	{
+		if (!isContained(path))
+			return ErrCode::PathNotFound;
+
+		ErrCode ec = checkCreate(path);
+		if (ec != ErrCode::Success)
+			return ec;
+
+		if (m_afio->make(getRealPath(path)).code != AbstractFileIO::ErrCode::Success)
+			return ErrCode::IOError;
+
+		m_trie.insert(path, EntryType::File);
+		return ErrCode::Success;
+	}
+
+	ErrCode NativeFileSystem::deleteFile(HashPathRef path)
+	{
+		if (!isContained(path))
+			return ErrCode::PathNotFound;
+
+		EntryType type = typeOf(path);
+		if (type == EntryType::None)
+			return ErrCode::PathNotFound;
+		if (type != EntryType::File)
+			return ErrCode::NotAFile;
+
+		if (m_afio->remove(getRealPath(path)).code != AbstractFileIO::ErrCode::Success)
+			return ErrCode::IOError;
+
+		m_trie.erase(path);
+		return ErrCode::Success;
+	}
+
+	ErrCode NativeFileSystem::createDirectory(HashPathRef path)
+	{
+		if (!isContained(path))
+			return ErrCode::PathNotFound;
+
+		ErrCode ec = checkCreate(path);
+		if (ec != ErrCode::Success)
+			return ec;
+
+		std::error_code fsErr;
+		if (!std::filesystem::create_directory(getRealPath(path), fsErr))
+			return ErrCode::IOError;
+
+		m_trie.insert(path, EntryType::Directory);
+		m_trie.markComplete(path); // Nothing in it yet
+		return ErrCode::Success;
+	}
+
+	ErrCode NativeFileSystem::deleteDirectory(HashPathRef path)
+	{
+		if (!isContained(path))
+			return ErrCode::PathNotFound;
+
+		EntryType type = typeOf(path);
+		if (type == EntryType::None)
+			return ErrCode::PathNotFound;
+		if (type != EntryType::Directory)
+			return ErrCode::NotADirectory;
+
+		std::error_code fsErr;
+		if (!std::filesystem::is_empty(getRealPath(path), fsErr))
+			return fsErr ? ErrCode::IOError : ErrCode::DirectoryNotEmpty;
+		if (!std::filesystem::remove(getRealPath(path), fsErr))
+			return ErrCode::IOError;
+
+		m_trie.erase(path);
+		return ErrCode::Success;
+	}
+
+	ErrCode NativeFileSystem::stat(HashPathRef path, Entry& entry)
+	{
+		if (!isContained(path))
+			return ErrCode::PathNotFound;
+
+		// Size and modification time are not cached, but known missing paths are still answered here
+		if (m_trie.lookup(path) == DirectoryTrie::Lookup::Missing)
+			return ErrCode::PathNotFound;
+
+		uint64_t hostGeneration = m_hostGeneration;
+		std::error_code fsErr;
+		std::string realPath = getRealPath(path);
+		auto status = std::filesystem::status(realPath, fsErr);
+		entry.type = toEntryType(status.type());
+		cacheType(path, entry.type, hostGeneration);
+		if (entry.type == EntryType::None)
+			return ErrCode::PathNotFound;
+
+		entry.size = entry.type == EntryType::File ? std::filesystem::file_size(realPath, fsErr) : 0;
+		entry.modTime = toModTime(std::filesystem::last_write_time(realPath, fsErr));
+		entry.name = path.depth() > 0 ? path[path.depth() - 1].asString() : "";
+		return ErrCode::Success;
+	}
+
+	ErrCode NativeFileSystem::listDirectory(HashPathRef path, std::vector<Entry>& entries)
+	{
+		if (!isContained(path))
+			return ErrCode::PathNotFound;
+
+		if (typeOf(path) != EntryType::Directory)
+			return ErrCode::NotADirectory;
+
+		entries.clear();
+		uint64_t hostGeneration = m_hostGeneration;
+		std::error_code fsErr;
+		for (auto& dirEntry : std::filesystem::directory_iterator(getRealPath(path), fsErr))
+		{
+			Entry entry;
+			entry.type = toEntryType(dirEntry.status(fsErr).type());
+			if (entry.type == EntryType::None)
+				continue;
+			entry.size = entry.type == EntryType::File ? dirEntry.file_size(fsErr) : 0;
+			entry.modTime = toModTime(dirEntry.last_write_time(fsErr));
+			entry.name = dirEntry.path().filename().string();
+			entries.push_back(std::move(entry));
+		}
+		if (fsErr)
+			return ErrCode::IOError;
+
+		std::shared_lock lock(m_mtxHost);
+		if (m_hostGeneration != hostGeneration)
+			return ErrCode::Success;
+		for (auto& entry : entries)
+			m_trie.insert(path.child(HashPath::Element(entry.name)), entry.type);
+		m_trie.markComplete(path);
+		return ErrCode::Success;
+	}
+
+	NativeFileSystem::EntryType NativeFileSystem::typeOf(HashPathRef path)
+	{
+		if (!isContained(path))
+			return EntryType::None;
+
+		EntryType type = EntryType::None;
+		switch (m_trie.lookup(path, &type))
+		{
+		case DirectoryTrie::Lookup::Exists:
+			return type;
+		case DirectoryTrie::Lookup::Missing:
+			return EntryType::None;
+		default:
+			break;
+		}
+
+		uint64_t hostGeneration = m_hostGeneration;
+		std::error_code fsErr;
+		type = toEntryType(std::filesystem::status(getRealPath(path), fsErr).type());
+		cacheType(path, type, hostGeneration);
+		return type;
+	}
+
+	ErrCode NativeFileSystem::readFile(HashPathRef path, void* buffer, uint64_t count, uint64_t offset)
+	{
+		if (!isContained(path))
+			return ErrCode::PathNotFound;
+
+		if (typeOf(path) != EntryType::File)
+			return ErrCode::NotAFile;
+
+		std::error_code fsErr;
+		std::string realPath = getRealPath(path);
+		if (offset + count > std::filesystem::file_size(realPath, fsErr))
+			return fsErr ? ErrCode::IOError : ErrCode::EndOfFile;
+		if (count == 0)
+			return ErrCode::Success;
+
+		if (m_afio->read(realPath, buffer, count, offset).code != AbstractFileIO::ErrCode::Success)
+			return ErrCode::IOError;
+		return ErrCode::Success;
+	}
+
+	ErrCode NativeFileSystem::writeFile(HashPathRef path, const void* buffer, uint64_t count, uint64_t offset)
+	{
+		if (!isContained(path))
+			return ErrCode::PathNotFound;
+
+		if (typeOf(path) != EntryType::File)
+			return ErrCode::NotAFile;
+
+		// Flushed right away, stat() and readFile() check the size on the host
+		std::string realPath = getRealPath(path);
+		if (m_afio->write(realPath, buffer, count, offset).code != AbstractFileIO::ErrCode::Success)
+			return ErrCode::IOError;
+		if (m_afio->flush(realPath).code != AbstractFileIO::ErrCode::Success)
+			return ErrCode::IOError;
+		return ErrCode::Success;
+	}
+
+	ErrCode NativeFileSystem::resizeFile(HashPathRef path, uint64_t newSize)
+	{
+		if (!isContained(path))
+			return ErrCode::PathNotFound;
+
+		if (typeOf(path) != EntryType::File)
+			return ErrCode::NotAFile;
+
+		if (m_afio->resize(getRealPath(path), newSize).code != AbstractFileIO::ErrCode::Success)
+			return ErrCode::IOError;
+		return ErrCode::Success;
+	}
+
+	ErrCode NativeFileSystem::setLastModTime(HashPathRef path, uint64_t modTime)
+	{
+		if (!isContained(path))
+			return ErrCode::PathNotFound;
+
+		if (typeOf(path) == EntryType::None)
+			return ErrCode::PathNotFound;
+
+		std::error_code fsErr;
+		auto time = std::filesystem::file_time_type(std::chrono::duration_cast<std::filesystem::file_time_type::duration>(std::chrono::nanoseconds(modTime)));
+		std::filesystem::last_write_time(getRealPath(path), time, fsErr);
+		return fsErr ? ErrCode::IOError : ErrCode::Success;
+	}
+
+	ErrCode NativeFileSystem::openFile(HashPathRef path, bool forWriting, FileToken& token)
+	{
+		if (!isContained(path))
+			return ErrCode::PathNotFound;
+
+		if (typeOf(path) != EntryType::File)
+			return ErrCode::NotAFile;
+
+		std::error_code fsErr;
+		std::string realPath = getRealPath(path);
+		token.afio = m_afio;
+		token.stream = m_afio->open(realPath);
+		token.size = std::filesystem::file_size(realPath, fsErr);
+		if (!token.stream || fsErr)
+			return ErrCode::IOError;
+		token.offset = 0;
+		token.capacity = UINT64_MAX; // The host grows the file
+		token.isWritable = forWriting;
+		return ErrCode::Success;
+	}
+
+	void NativeFileSystem::invalidate()
+	{
+		{
+			std::unique_lock lock(m_mtxHost);
+			++m_hostGeneration;
+			m_trie.clear();
+		}
+		m_afio->closeMatchingStreams(getBasePath());
+	}
+
+	bool NativeFileSystem::startWatching()
+	{
+		if (m_watcher)
+			return true;
+
+		auto watcher = std::make_unique<FileWatcher>(getBasePath(),
+			[this](HashPathRef path, FileWatcher::Event event, bool isDirectory) { onHostChange(path, event, isDirectory); }
+		);
+		if (!watcher->isActive())
+			return false;
+
+		// Anything learned before the watch started may already be stale
+		m_watcher = std::move(watcher);
+		invalidate();
+		return true;
+	}
+
+	void NativeFileSystem::stopWatching()
+	{
+		m_watcher.reset();
+	}
+
+	void NativeFileSystem::onHostChange(HashPathRef path, FileWatcher::Event event, bool isDirectory)
+	{
+		std::unique_lock lock(m_mtxHost);
+		++m_hostGeneration;
+		switch (event)
+		{
+		case FileWatcher::Event::Created:
+			m_trie.insert(path, isDirectory ? EntryType::Directory : EntryType::File);
+			break;
+		case FileWatcher::Event::Deleted:
+			m_trie.erase(path);
+			lock.unlock();
+			// Open streams would keep reading the unlinked file
+			m_afio->closeMatchingStreams(getRealPath(path));
+			break;
+		case FileWatcher::Event::Overflow:
+			lock.unlock();
+			invalidate();
+			break;
+		}
+	}
+
+	std::string NativeFileSystem::getRealPath(HashPathRef path)
+	{
+		return path.getRealPath(getBasePath());
+	}
+
+	void NativeFileSystem::cacheType(HashPathRef path, EntryType type, uint64_t hostGeneration)
+	{
+		// Held shared so that no host change can slip in between the check and the update
+		std::shared_lock lock(m_mtxHost);
+		if (m_hostGeneration != hostGeneration)
+			return;
+
+		if (type == EntryType::None)
+			m_trie.addMissing(path);
+		else
+			m_trie.insert(path, type);
+	}
+
+	ErrCode NativeFileSystem::checkCreate(HashPathRef path)
+	{
+		if (path.depth() == 0 || typeOf(path) != EntryType::None)
+			return ErrCode::AlreadyExists;
+		if (typeOf(path.parent()) != EntryType::Directory)
+			return ErrCode::PathNotFound;
+		return ErrCode::Success;
+	}
+
+	bool NativeFileSystem::isContained(HashPathRef path)
+	{
+		// HashPath keeps a leading '..' and appended elements are not split, either would leave the base directory
+		for (auto& elem : path)
+		{
+			auto& name = elem.asString();
+			if (name == ".." || name.find_first_of("/\\") != std::string::npos)
+				return false;
+		}
+		return true;
+	}
+
+	NativeFileSystem::EntryType NativeFileSystem::toEntryType(std::filesystem::file_type type)
+	{
+		switch (type)
+		{
+		case std::filesystem::file_type::regular:
+			return EntryType::File;
+		case std::filesystem::file_type::directory:
+			return EntryType::Directory;
+		default:
+			return EntryType::None;
+		}
+	}
+
+	uint64_t NativeFileSystem::toModTime(std::filesystem::file_time_type time)
+	{
+		// Nanoseconds since the epoch of the file clock
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,502 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <shared_mutex>
+#include <mutex>
+#include <cstring>
+#include <stdexcept>
+
+#include "VFSFileSystem.h"
+
+namespace VFS {
+
+	// Union view of an ordered stack of FileSystems.
+	//
+	// Layers are given bottom to top, upper layers win and only the top layer is written to.
+	// Files from lower layers are copied up before they are modified. A file named '.wh.<name>'
+	// hides <name> of all lower layers, a '.wh..wh..opq' file hides all lower content of the
+	// directory it is in. Mounting walks all layers once and builds an index of path hash ->
+	// winning layer, every lookup after that is a single probe of that index.
+	class OverlayFileSystem : public FileSystem
+	{
+	public:
+		// Throws std::invalid_argument if there is no layer or a layer is null
+		OverlayFileSystem(const std::vector<FileSystemRef>& layers);
+	public:
+		// Adds a new top layer and rebuilds the index. Throws std::invalid_argument if the layer is null.
+		void mount(FileSystemRef layer);
+		uint64_t nLayers() const;
+		uint64_t indexSize() const;
+	public:
+		ErrCode createFile(HashPathRef path) override;
+		ErrCode deleteFile(HashPathRef path) override;
+		ErrCode createDirectory(HashPathRef path) override;
+		ErrCode deleteDirectory(HashPathRef path) override;
+		ErrCode stat(HashPathRef path, Entry& entry) override;
+		ErrCode listDirectory(HashPathRef path, std::vector<Entry>& entries) override;
+		EntryType typeOf(HashPathRef path) override;
+	public:
+		ErrCode readFile(HashPathRef path, void* buffer, uint64_t count, uint64_t offset) override;
+		ErrCode writeFile(HashPathRef path, const void* buffer, uint64_t count, uint64_t offset) override;
+		ErrCode resizeFile(HashPathRef path, uint64_t newSize) override;
+		ErrCode setLastModTime(HashPathRef path, uint64_t modTime) override;
+		// Files opened for writing are copied up first
+		ErrCode openFile(HashPathRef path, bool forWriting, FileToken& token) override;
+	protected:
+		std::string getRealPath(HashPathRef path) override;
+	private:
+		struct Resolution
+		{
+			uint32_t layer;
+			EntryType type;
+		};
+		typedef std::unordered_set<Hash> HashSet;
+		static constexpr const char* WHITEOUT_PREFIX = ".wh.";
+		static constexpr const char* OPAQUE_MARKER = ".wh..wh..opq";
+	private:
+		static const std::vector<FileSystemRef>& checkLayers(const std::vector<FileSystemRef>& layers);
+		void rebuildIndex();
+		void indexDirectory(uint32_t layer, HashPathRef dir, const HashSet& whiteouts, const HashSet& opaque, HashSet& newWhiteouts, HashSet& newOpaque);
+		bool resolve(HashPathRef path, Resolution& res) const;
+		ErrCode create(HashPathRef path, EntryType type);
+		ErrCode ensureTopDirectories(HashPathRef dir);
+		ErrCode copyUp(HashPathRef path);
+		ErrCode whiteout(HashPathRef path);
+		bool isInLowerLayer(HashPathRef path) const;
+		FileSystem& top() const { return *m_layers.back(); }
+		uint32_t topIndex() const { return (uint32_t)m_layers.size() - 1; }
+		static bool isWhiteout(const std::string& name);
+		static HashPath whiteoutPath(HashPathRef path);
+	private:
+		mutable std::shared_mutex m_mtx;
+		std::vector<FileSystemRef> m_layers;
+		std::unordered_map<Hash, Resolution> m_index;
+	};
+
+	OverlayFileSystem::OverlayFileSystem(const std::vector<FileSystemRef>& layers)
+		: FileSystem(checkLayers(layers).back()->getBasePath()), m_layers(layers)
+	{
+		rebuildIndex();
+	}
+
+	void OverlayFileSystem::mount(FileSystemRef layer)
+	{
+		if (!layer)
+			throw std::invalid_argument("OverlayFileSystem layers must not be null");
+
+		std::unique_lock lock(m_mtx);
+		m_layers.push_back(layer);
+		setBasePath(layer->getBasePath());
+		rebuildIndex();
+	}
+
+	uint64_t OverlayFileSystem::nLayers() const
+	{
+		std::shared_lock lock(m_mtx);
+		return m_layers.size();
+	}
+
+	uint64_t OverlayFileSystem::indexSize() const
+	{
+		std::shared_lock lock(m_mtx);
+		return m_index.size();
+	}
+
+	ErrCode OverlayFileSystem::createFile(HashPathRef path)
+	{
+		std::unique_lock lock(m_mtx);
+		return create(path, EntryType::File);
+	}
+
+	ErrCode OverlayFileSystem::deleteFile(HashPathRef path)
+	{
+		std::unique_lock lock(m_mtx);
+
+		Resolution res;
+		if (!resolve(path, res))
+			return ErrCode::PathNotFound;
+		if (res.type != EntryType::File)
+			return ErrCode::NotAFile;
+
+		if (res.layer == topIndex())
+		{
+			ErrCode ec = top().deleteFile(path);
+			if (ec != ErrCode::Success)
+				return ec;
+		}
+		if (res.layer != topIndex() || isInLowerLayer(path))
+		{
+			ErrCode ec = whiteout(path);
+			if (ec != ErrCode::Success)
+				return ec;
+		}
+
+		m_index.erase(path.hash());
+		return ErrCode::Success;
+	}
+
+	ErrCode OverlayFileSystem::createDirectory(HashPathRef path)
+	{
+		std::unique_lock lock(m_mtx);
+		return create(path, EntryType::Directory);
+	}
+
+	ErrCode OverlayFileSystem::deleteDirectory(HashPathRef path)
+	{
+		std::unique_lock lock(m_mtx);
+
+		Resolution res;
+		if (!resolve(path, res))
+			return ErrCode::PathNotFound;
+		if (res.type != EntryType::Directory)
+			return ErrCode::NotADirectory;
+
+		// Empty in the merged view, whiteouts in the top layer do not count
+		std::vector<Entry> topEntries;
+		bool isInTop = top().listDirectory(path, topEntries) == ErrCode::Success;
+		for (auto& layer : m_layers)
+		{
+			std::vector<Entry> entries;
+			if (layer->listDirectory(path, entries) != ErrCode::Success)
+				continue;
+			for (auto& entry : entries)
+				if (!isWhiteout(entry.name) && m_index.find(path.child(HashPath::Element(entry.name)).hash()) != m_index.end())
+					return ErrCode::DirectoryNotEmpty;
+		}
+
+		if (isInTop)
+		{
+			for (auto& entry : topEntries)
+				top().deleteFile(path.child(HashPath::Element(entry.name)));
+			ErrCode ec = top().deleteDirectory(path);
+			if (ec != ErrCode::Success)
+				return ec;
+		}
+		if (isInLowerLayer(path))
+		{
+			ErrCode ec = whiteout(path);
+			if (ec != ErrCode::Success)
+				return ec;
+		}
+
+		m_index.erase(path.hash());
+		return ErrCode::Success;
+	}
+
+	ErrCode OverlayFileSystem::stat(HashPathRef path, Entry& entry)
+	{
+		Resolution res;
+		{
+			std::shared_lock lock(m_mtx);
+			if (!resolve(path, res))
+				return ErrCode::PathNotFound;
+		}
+		return m_layers[res.layer]->stat(path, entry);
+	}
+
+	ErrCode OverlayFileSystem::listDirectory(HashPathRef path, std::vector<Entry>& entries)
+	{
+		std::shared_lock lock(m_mtx);
+
+		Resolution res;
+		if (!resolve(path, res) || res.type != EntryType::Directory)
+			return ErrCode::NotADirectory;
+
+		// Every child is taken from the layer the index resolves it to, so none shows up twice
+		entries.clear();
+		std::vector<Entry> layerEntries;
+		for (uint32_t layer = 0; layer < m_layers.size(); ++layer)
+		{
+			if (m_layers[layer]->listDirectory(path, layerEntries) != ErrCode::Success)
+				continue;
+			for (auto& entry : layerEntries)
+			{
+				if (isWhiteout(entry.name))
+					continue;
+				auto it = m_index.find(path.child(HashPath::Element(entry.name)).hash());
+				if (it != m_index.end() && it->second.layer == layer)
+					entries.push_back(std::move(entry));
+			}
+		}
+		return ErrCode::Success;
+	}
+
+	OverlayFileSystem::EntryType OverlayFileSystem::typeOf(HashPathRef path)
+	{
+		std::shared_lock lock(m_mtx);
+
+		Resolution res;
+		if (!resolve(path, res))
+			return EntryType::None;
+		return res.type;
+	}
+
+	ErrCode OverlayFileSystem::readFile(HashPathRef path, void* buffer, uint64_t count, uint64_t offset)
+	{
+		Resolution res;
+		{
+			std::shared_lock lock(m_mtx);
+			if (!resolve(path, res))
+				return ErrCode::PathNotFound;
+		}
+		return m_layers[res.layer]->readFile(path, buffer, count, offset);
+	}
+
+	ErrCode OverlayFileSystem::writeFile(HashPathRef path, const void* buffer, uint64_t count, uint64_t offset)
+	{
+		std::unique_lock lock(m_mtx);
+
+		ErrCode ec = copyUp(path);
+		if (ec != ErrCode::Success)
+			return ec;
+		return top().writeFile(path, buffer, count, offset);
+	}
+
+	ErrCode OverlayFileSystem::resizeFile(HashPathRef path, uint64_t newSize)
+	{
+		std::unique_lock lock(m_mtx);
+
+		ErrCode ec = copyUp(path);
+		if (ec != ErrCode::Success)
+			return ec;
+		return top().resizeFile(path, newSize);
+	}
+
+	ErrCode OverlayFileSystem::setLastModTime(HashPathRef path, uint64_t modTime)
+	{
+		std::unique_lock lock(m_mtx);
+
+		ErrCode ec = copyUp(path);
+		if (ec != ErrCode::Success)
+			return ec;
+		return top().setLastModTime(path, modTime);
+	}
+
+	ErrCode OverlayFileSystem::openFile(HashPathRef path, bool forWriting, FileToken& token)
+	{
+		Resolution res;
+		if (forWriting)
+		{
+			std::unique_lock lock(m_mtx);
+			ErrCode ec = copyUp(path);
+			if (ec != ErrCode::Success)
+				return ec;
+			res.layer = topIndex();
+		}
+		else
+		{
+			std::shared_lock lock(m_mtx);
+			if (!resolve(path, res))
+				return ErrCode::PathNotFound;
+		}
+		return m_layers[res.layer]->openFile(path, forWriting, token);
+	}
+
+	std::string OverlayFileSystem::getRealPath(HashPathRef path)
+	{
+		Resolution res;
+		{
+			std::shared_lock lock(m_mtx);
+			if (!resolve(path, res))
+				res.layer = topIndex();
+		}
+		return m_layers[res.layer]->getRealPath(path);
+	}
+
+	const std::vector<FileSystemRef>& OverlayFileSystem::checkLayers(const std::vector<FileSystemRef>& layers)
+	{
+		// topIndex() and top() need a layer to write to
+		if (layers.empty())
+			throw std::invalid_argument("OverlayFileSystem needs at least one layer");
+		for (auto& layer : layers)
+			if (!layer)
+				throw std::invalid_argument("OverlayFileSystem layers must not be null");
+		return layers;
+	}
+
+	void OverlayFileSystem::rebuildIndex()
+	{
+		m_index.clear();
+
+		// Whiteouts and opaque directories of a layer only apply to the layers below it
+		HashSet whiteouts;
+		HashSet opaque;
+		for (uint32_t layer = (uint32_t)m_layers.size(); layer-- > 0; )
+		{
+			HashSet newWhiteouts;
+			HashSet newOpaque;
+			indexDirectory(layer, HashPath(), whiteouts, opaque, newWhiteouts, newOpaque);
+			whiteouts.insert(newWhiteouts.begin(), newWhiteouts.end());
+			opaque.insert(newOpaque.begin(), newOpaque.end());
+		}
+	}
+
+	void OverlayFileSystem::indexDirectory(uint32_t layer, HashPathRef dir, const HashSet& whiteouts, const HashSet& opaque, HashSet& newWhiteouts, HashSet& newOpaque)
+	{
+		if (opaque.find(dir.hash()) != opaque.end())
+			return;
+
+		std::vector<Entry> entries;
+		if (m_layers[layer]->listDirectory(dir, entries) != ErrCode::Success)
+			return;
+
+		for (auto& entry : entries)
+		{
+			if (entry.name == OPAQUE_MARKER)
+			{
+				newOpaque.insert(dir.hash());
+				continue;
+			}
+			if (isWhiteout(entry.name))
+			{
+				newWhiteouts.insert(dir.child(HashPath::Element(entry.name.substr(strlen(WHITEOUT_PREFIX)))).hash());
+				continue;
+			}
+
+			HashPath path = dir.child(HashPath::Element(entry.name));
+			if (whiteouts.find(path.hash()) != whiteouts.end())
+				continue;
+
+			auto it = m_index.find(path.hash());
+			if (it == m_index.end())
+				m_index.insert({ path.hash(), { layer, entry.type } });
+			else if (it->second.type != EntryType::Directory || entry.type != EntryType::Directory)
+				continue; // Hidden by an upper entry, only directories are merged
+
+			if (entry.type == EntryType::Directory)
+				indexDirectory(layer, path, whiteouts, opaque, newWhiteouts, newOpaque);
+		}
+	}
+
+	bool OverlayFileSystem::resolve(HashPathRef path, Resolution& res) const
+	{
+		if (path.depth() == 0)
+		{
+			res = { topIndex(), EntryType::Directory };
+			return true;
+		}
+
+		auto it = m_index.find(path.hash());
+		if (it == m_index.end())
+			return false;
+		res = it->second;
+		return true;
+	}
+
+	ErrCode OverlayFileSystem::create(HashPathRef path, EntryType type)
+	{
+		Resolution res;
+		if (resolve(path, res))
+			return ErrCode::AlreadyExists;
+		if (!resolve(path.parent(), res) || res.type != EntryType::Directory)
+			return ErrCode::PathNotFound;
+
+		ErrCode ec = ensureTopDirectories(path.parent());
+		if (ec != ErrCode::Success)
+			return ec;
+
+		HashPath whiteoutFile = whiteoutPath(path);
+		bool wasWhiteout = top().typeOf(whiteoutFile) == EntryType::File;
+		if (wasWhiteout)
+			top().deleteFile(whiteoutFile);
+
+		ec = type == EntryType::File ? top().createFile(path) : top().createDirectory(path);
+		if (ec != ErrCode::Success)
+			return ec;
+
+		// A recreated directory must not show the content of the one it replaced
+		if (wasWhiteout && type == EntryType::Directory)
+			top().createFile(path.child(HashPath::Element(OPAQUE_MARKER)));
+
+		m_index[path.hash()] = { topIndex(), type };
+		return ErrCode::Success;
+	}
+
+	ErrCode OverlayFileSystem::ensureTopDirectories(HashPathRef dir)
+	{
+		for (uint64_t depth = 1; depth <= dir.depth(); ++depth)
+		{
+			HashPath sub = dir - (dir.depth() - depth);
+			if (top().typeOf(sub) == EntryType::Directory)
+				continue;
+
+			ErrCode ec = top().createDirectory(sub);
+			if (ec != ErrCode::Success)
+				return ec;
+			m_index[sub.hash()] = { topIndex(), EntryType::Directory };
+		}
+		return ErrCode::Success;
+	}
+
+	ErrCode OverlayFileSystem::copyUp(HashPathRef path)
+	{
+		Resolution res;
+		if (!resolve(path, res))
+			return ErrCode::PathNotFound;
+		if (res.type != EntryType::File)
+			return ErrCode::NotAFile;
+		if (res.layer == topIndex())
+			return ErrCode::Success;
+
+		FileSystem& lower = *m_layers[res.layer];
+		Entry entry;
+		ErrCode ec = lower.stat(path, entry);
+		if (ec != ErrCode::Success)
+			return ec;
+
+		ec = ensureTopDirectories(path.parent());
+		if (ec != ErrCode::Success)
+			return ec;
+		ec = top().createFile(path);
+		if (ec != ErrCode::Success)
+			return ec;
+
+		constexpr uint64_t maxBuffSize = 65536;
+		std::vector<char> buffer(std::min(maxBuffSize, std::max<uint64_t>(1, entry.size)));
+		for (uint64_t copied = 0; copied < entry.size; )
+		{
+			uint64_t nToCopy = std::min<uint64_t>(buffer.size(), entry.size - copied);
+			if ((ec = lower.readFile(path, buffer.data(), nToCopy, copied)) != ErrCode::Success)
+				return ec;
+			if ((ec = top().writeFile(path, buffer.data(), nToCopy, copied)) != ErrCode::Success)
+				return ec;
+			copied += nToCopy;
+		}
+		top().setLastModTime(path, entry.modTime);
+
+		m_index[path.hash()] = { topIndex(), EntryType::File };
+		return ErrCode::Success;
+	}
+
+	ErrCode OverlayFileSystem::whiteout(HashPathRef path)
+	{
+		ErrCode ec = ensureTopDirectories(path.parent());
+		if (ec != ErrCode::Success)
+			return ec;
+
+		HashPath whiteoutFile = whiteoutPath(path);
+		if (top().typeOf(whiteoutFile) == EntryType::File)
+			return ErrCode::Success;
+		return top().createFile(whiteoutFile);
+	}
+
+	bool OverlayFileSystem::isInLowerLayer(HashPathRef path) const
+	{
+		for (uint32_t layer = 0; layer < topIndex(); ++layer)
+			if (m_layers[layer]->typeOf(path) != EntryType::None)
+				return true;
+		return false;
+	}
+
+	bool OverlayFileSystem::isWhiteout(const std::string& name)
+	{
+		return name.compare(0, strlen(WHITEOUT_PREFIX), WHITEOUT_PREFIX) == 0;
+	}
+
+	HashPath OverlayFileSystem::whiteoutPath(HashPathRef path)
+	{
+		return path.parent().child(HashPath::Element(WHITEOUT_PREFIX + path[path.depth() - 1].asString()));
+	}
+}
\ No newline at end of file
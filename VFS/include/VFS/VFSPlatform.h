@@ -1,5 +1,16 @@
 #pragma once
 
+#include <cstdio>
+#include <string>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 namespace VFS {
 
 	enum class Platform
@@ -24,4 +35,35 @@ namespace VFS {
 		return PlatformManager::s_platform;
 	}
 
+	// Flushes the C stream and forces its data down to the storage device.
+	static inline bool syncFile(FILE* file)
+	{
+		if (std::fflush(file) != 0)
+			return false;
+	#ifdef _WIN32
+		return _commit(_fileno(file)) == 0;
+	#else
+		return fsync(fileno(file)) == 0;
+	#endif
+	}
+
+	// Forces all written data of the file at 'path' down to the storage device.
+	static inline bool syncFile(const std::string& path)
+	{
+	#ifdef _WIN32
+		int fd = _open(path.c_str(), _O_RDWR | _O_BINARY);
+		if (fd < 0)
+			return false;
+		bool success = _commit(fd) == 0;
+		_close(fd);
+	#else
+		int fd = open(path.c_str(), O_RDWR);
+		if (fd < 0)
+			return false;
+		bool success = fsync(fd) == 0;
+		close(fd);
+	#endif
+		return success;
+	}
+
 }
\ No newline at end of file
@@ -4,7 +4,7 @@
 #include <limits.h>
 
 namespace VFS {
-	static inline uint64_t rotaryShiftLeft64(uint64_t n, unsigned int c)
+	static constexpr inline uint64_t rotaryShiftLeft64(uint64_t n, unsigned int c)
 	{
 		const uint64_t mask = (CHAR_BIT * sizeof(n) - 1);  // assumes width is a power of 2.
 
@@ -13,7 +13,7 @@ namespace VFS {
 		return (n << c) | (n >> ((-c) & mask));
 	}
 
-	static inline uint64_t rotaryShiftRight64(uint64_t n, unsigned int c)
+	static constexpr inline uint64_t rotaryShiftRight64(uint64_t n, unsigned int c)
 	{
 		const uint64_t mask = (CHAR_BIT * sizeof(n) - 1);
 
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "VFSMapStream.h"
+#include "VFSThreadPool.h"
+#include "VFSHash.h"
+
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <stdexcept>
+#include <cassert>
+
+namespace VFS {
+
+	// Partitions the keys by hash across nShards MapStream files ('<path>.<shard>').
+	//
+	// Every shard has its own lock, so callers working on different shards never wait
+	// for each other. The batched operations split their input by shard and process all
+	// shards in parallel on the internal thread pool, optimize() and flush() do the same.
+	// The AbstractFileIO should allow at least nShards concurrent streams.
+	// Indices carry the shard in bits 48..62, nShards must be within 1..MAX_SHARDS.
+	// The shard of a key depends on hashVersion, a store has to be reopened with the version it was created with.
+	class ShardedMapStream
+	{
+	public:
+		ShardedMapStream(const std::string& path, AbstractFileIORef afio, uint64_t nShards, uint64_t& keySize, uint64_t& valSize, uint64_t nThreads = std::thread::hardware_concurrency(), HashVersion hashVersion = HashVersion::Current);
+	public:
+		void insert(MapStream::ConstKey key, MapStream::ConstVal value);
+		bool update(MapStream::ConstKey key, MapStream::ConstVal value);
+		void upsert(MapStream::ConstKey key, MapStream::ConstVal value);
+		uint64_t find(MapStream::ConstKey key) const;
+		void getValue(uint64_t index, MapStream::Val valBuff) const;
+		void erase(MapStream::ConstKey key);
+		void optimize();
+		float currOptimization() const;
+		void flush();
+	public:
+		void insert(const void* keys, const void* values, uint64_t count);
+		uint64_t update(const void* keys, const void* values, uint64_t count);
+		void upsert(const void* keys, const void* values, uint64_t count);
+		void find(const void* keys, uint64_t* indices, uint64_t count) const;
+		void erase(const void* keys, uint64_t count);
+	public:
+		uint64_t nShards() const { return m_shards.size(); }
+		uint64_t shardOf(MapStream::ConstKey key) const;
+	private:
+		static uint64_t checkShardCount(uint64_t nShards);
+		static uint64_t toShardedIndex(uint64_t shard, uint64_t index);
+		void forEachShard(const std::function<void(uint64_t shard)>& func) const;
+		std::vector<std::vector<uint64_t>> partition(const void* keys, uint64_t count) const;
+		void gather(const std::vector<uint64_t>& part, const void* keys, const void* values, std::vector<char>& shardKeys, std::vector<char>& shardValues) const;
+	private:
+		static constexpr uint64_t SHARD_SHIFT = 48;
+		static constexpr uint64_t SHARD_MASK = 0x7FFFull << SHARD_SHIFT;
+	public:
+		static constexpr uint64_t MAX_SHARDS = (SHARD_MASK >> SHARD_SHIFT) + 1;
+	private:
+		uint64_t m_keySize;
+		uint64_t m_valSize;
+		HashVersion m_hashVersion;
+		std::vector<std::unique_ptr<MapStream>> m_shards;
+		std::unique_ptr<std::mutex[]> m_mtxShards;
+		mutable ThreadPool m_pool;
+	};
+
+	ShardedMapStream::ShardedMapStream(const std::string& path, AbstractFileIORef afio, uint64_t nShards, uint64_t& keySize, uint64_t& valSize, uint64_t nThreads, HashVersion hashVersion)
+		: m_hashVersion(hashVersion), m_mtxShards(new std::mutex[checkShardCount(nShards)]), m_pool(std::min(nShards, nThreads))
+	{
+		for (uint64_t i = 0; i < nShards; ++i)
+			m_shards.emplace_back(new MapStream(path + "." + std::to_string(i), afio, keySize, valSize));
+
+		m_keySize = keySize;
+		m_valSize = valSize;
+	}
+
+	void ShardedMapStream::insert(MapStream::ConstKey key, MapStream::ConstVal value)
+	{
+		uint64_t shard = shardOf(key);
+		std::lock_guard lock(m_mtxShards[shard]);
+		m_shards[shard]->insert(key, value);
+	}
+
+	bool ShardedMapStream::update(MapStream::ConstKey key, MapStream::ConstVal value)
+	{
+		uint64_t shard = shardOf(key);
+		std::lock_guard lock(m_mtxShards[shard]);
+		return m_shards[shard]->update(key, value);
+	}
+
+	void ShardedMapStream::upsert(MapStream::ConstKey key, MapStream::ConstVal value)
+	{
+		uint64_t shard = shardOf(key);
+		std::lock_guard lock(m_mtxShards[shard]);
+		m_shards[shard]->upsert(key, value);
+	}
+
+	uint64_t ShardedMapStream::find(MapStream::ConstKey key) const
+	{
+		uint64_t shard = shardOf(key);
+		std::lock_guard lock(m_mtxShards[shard]);
+
+		uint64_t index = m_shards[shard]->find(key);
+		if (index == -1)
+			return -1;
+
+		return toShardedIndex(shard, index);
+	}
+
+	void ShardedMapStream::getValue(uint64_t index, MapStream::Val valBuff) const
+	{
+		uint64_t shard = (index & SHARD_MASK) >> SHARD_SHIFT;
+		std::lock_guard lock(m_mtxShards[shard]);
+		m_shards[shard]->getValue(index & ~SHARD_MASK, valBuff);
+	}
+
+	void ShardedMapStream::erase(MapStream::ConstKey key)
+	{
+		uint64_t shard = shardOf(key);
+		std::lock_guard lock(m_mtxShards[shard]);
+		m_shards[shard]->erase(key);
+	}
+
+	void ShardedMapStream::optimize()
+	{
+		forEachShard([this](uint64_t shard) { m_shards[shard]->optimize(); });
+	}
+
+	float ShardedMapStream::currOptimization() const
+	{
+		float sum = 0.0f;
+		for (uint64_t shard = 0; shard < nShards(); ++shard)
+		{
+			std::lock_guard lock(m_mtxShards[shard]);
+			sum += m_shards[shard]->currOptimization();
+		}
+		return sum / nShards();
+	}
+
+	void ShardedMapStream::flush()
+	{
+		forEachShard([this](uint64_t shard) { m_shards[shard]->flush(); });
+	}
+
+	void ShardedMapStream::insert(const void* keys, const void* values, uint64_t count)
+	{
+		auto parts = partition(keys, count);
+		forEachShard([&](uint64_t shard)
+			{
+				for (uint64_t i : parts[shard])
+					m_shards[shard]->insert((char*)keys + i * m_keySize, (char*)values + i * m_valSize);
+			}
+		);
+	}
+
+	uint64_t ShardedMapStream::update(const void* keys, const void* values, uint64_t count)
+	{
+		auto parts = partition(keys, count);
+		std::atomic<uint64_t> nUpdated = 0;
+		forEachShard([&](uint64_t shard)
+			{
+				std::vector<char> shardKeys, shardValues;
+				gather(parts[shard], keys, values, shardKeys, shardValues);
+				nUpdated += m_shards[shard]->update(shardKeys.data(), shardValues.data(), parts[shard].size());
+			}
+		);
+		return nUpdated;
+	}
+
+	void ShardedMapStream::upsert(const void* keys, const void* values, uint64_t count)
+	{
+		auto parts = partition(keys, count);
+		forEachShard([&](uint64_t shard)
+			{
+				std::vector<char> shardKeys, shardValues;
+				gather(parts[shard], keys, values, shardKeys, shardValues);
+				m_shards[shard]->upsert(shardKeys.data(), shardValues.data(), parts[shard].size());
+			}
+		);
+	}
+
+	void ShardedMapStream::find(const void* keys, uint64_t* indices, uint64_t count) const
+	{
+		auto parts = partition(keys, count);
+		forEachShard([&](uint64_t shard)
+			{
+				for (uint64_t i : parts[shard])
+				{
+					uint64_t index = m_shards[shard]->find((char*)keys + i * m_keySize);
+					indices[i] = (index == -1) ? -1 : toShardedIndex(shard, index);
+				}
+			}
+		);
+	}
+
+	void ShardedMapStream::erase(const void* keys, uint64_t count)
+	{
+		auto parts = partition(keys, count);
+		forEachShard([&](uint64_t shard)
+			{
+				for (uint64_t i : parts[shard])
+					m_shards[shard]->erase((char*)keys + i * m_keySize);
+			}
+		);
+	}
+
+	uint64_t ShardedMapStream::shardOf(MapStream::ConstKey key) const
+	{
+		return makeHash(*key, m_keySize, m_hashVersion) % nShards();
+	}
+
+	void ShardedMapStream::forEachShard(const std::function<void(uint64_t shard)>& func) const
+	{
+		std::vector<std::future<void>> futures;
+		for (uint64_t shard = 0; shard < nShards(); ++shard)
+		{
+			futures.push_back(m_pool.submit([this, &func, shard]()
+				{
+					std::lock_guard lock(m_mtxShards[shard]);
+					func(shard);
+				}
+			));
+		}
+
+		for (auto& future : futures)
+			future.get();
+	}
+
+	std::vector<std::vector<uint64_t>> ShardedMapStream::partition(const void* keys, uint64_t count) const
+	{
+		std::vector<std::vector<uint64_t>> parts(nShards());
+		for (uint64_t i = 0; i < count; ++i)
+			parts[shardOf((char*)keys + i * m_keySize)].push_back(i);
+		return parts;
+	}
+
+	void ShardedMapStream::gather(const std::vector<uint64_t>& part, const void* keys, const void* values, std::vector<char>& shardKeys, std::vector<char>& shardValues) const
+	{
+		shardKeys.resize(part.size() * m_keySize);
+		shardValues.resize(part.size() * m_valSize);
+		for (uint64_t i = 0; i < part.size(); ++i)
+		{
+			memcpy(shardKeys.data() + i * m_keySize, (const char*)keys + part[i] * m_keySize, m_keySize);
+			memcpy(shardValues.data() + i * m_valSize, (const char*)values + part[i] * m_valSize, m_valSize);
+		}
+	}
+
+	uint64_t ShardedMapStream::checkShardCount(uint64_t nShards)
+	{
+		if (nShards == 0 || nShards > MAX_SHARDS)
+			throw std::invalid_argument("ShardedMapStream needs 1 to " + std::to_string(MAX_SHARDS) + " shards");
+		return nShards;
+	}
+
+	uint64_t ShardedMapStream::toShardedIndex(uint64_t shard, uint64_t index)
+	{
+		// The index within a shard must stay below 2^48, apart from the unsorted bit
+		assert((index & SHARD_MASK) == 0);
+		return index | (shard << SHARD_SHIFT);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <algorithm>
+
+namespace VFS {
+
+	// Vector of trivially copyable elements that keeps up to N of them inline
+	// and only touches the heap once it grows beyond that.
+	template<typename T, uint64_t N>
+	class SmallVector
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "SmallVector only holds trivially copyable types");
+	public:
+		SmallVector() = default;
+		SmallVector(const SmallVector& other);
+		SmallVector(SmallVector&& other) noexcept;
+		~SmallVector();
+	public:
+		SmallVector& operator=(const SmallVector& other);
+		SmallVector& operator=(SmallVector&& other) noexcept;
+	public:
+		uint64_t size() const { return m_size; }
+		uint64_t capacity() const { return m_heap ? m_capacity : N; }
+		bool empty() const { return m_size == 0; }
+		T* data() { return m_heap ? m_heap : (T*)m_inline; }
+		const T* data() const { return m_heap ? m_heap : (const T*)m_inline; }
+		T& operator[](uint64_t index) { return data()[index]; }
+		const T& operator[](uint64_t index) const { return data()[index]; }
+		T& back() { return data()[m_size - 1]; }
+		const T& back() const { return data()[m_size - 1]; }
+		const T* begin() const { return data(); }
+		const T* end() const { return data() + m_size; }
+	public:
+		void push_back(const T& value);
+		void pop_back() { --m_size; }
+		void truncate(uint64_t newSize) { m_size = std::min(m_size, newSize); }
+		void clear() { m_size = 0; }
+		void reserve(uint64_t newCapacity);
+	private:
+		void release();
+	private:
+		alignas(T) unsigned char m_inline[N * sizeof(T)];
+		T* m_heap = nullptr;
+		uint64_t m_capacity = N;
+		uint64_t m_size = 0;
+	};
+
+	template<typename T, uint64_t N>
+	SmallVector<T, N>::SmallVector(const SmallVector& other)
+	{
+		*this = other;
+	}
+
+	template<typename T, uint64_t N>
+	SmallVector<T, N>::SmallVector(SmallVector&& other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	template<typename T, uint64_t N>
+	SmallVector<T, N>::~SmallVector()
+	{
+		release();
+	}
+
+	template<typename T, uint64_t N>
+	SmallVector<T, N>& SmallVector<T, N>::operator=(const SmallVector& other)
+	{
+		if (this == &other)
+			return *this;
+
+		m_size = 0;
+		reserve(other.m_size);
+		memcpy((void*)data(), other.data(), other.m_size * sizeof(T));
+		m_size = other.m_size;
+		return *this;
+	}
+
+	template<typename T, uint64_t N>
+	SmallVector<T, N>& SmallVector<T, N>::operator=(SmallVector&& other) noexcept
+	{
+		if (this == &other)
+			return *this;
+
+		if (!other.m_heap)
+			return *this = other;
+
+		// Steal the heap buffer
+		release();
+		m_heap = other.m_heap;
+		m_capacity = other.m_capacity;
+		m_size = other.m_size;
+		other.m_heap = nullptr;
+		other.m_capacity = N;
+		other.m_size = 0;
+		return *this;
+	}
+
+	template<typename T, uint64_t N>
+	void SmallVector<T, N>::push_back(const T& value)
+	{
+		if (m_size == capacity())
+			reserve(capacity() * 2);
+		data()[m_size++] = value;
+	}
+
+	template<typename T, uint64_t N>
+	void SmallVector<T, N>::reserve(uint64_t newCapacity)
+	{
+		if (newCapacity <= capacity())
+			return;
+
+		T* heap = (T*)::operator new(newCapacity * sizeof(T));
+		memcpy((void*)heap, data(), m_size * sizeof(T));
+		release();
+		m_heap = heap;
+		m_capacity = newCapacity;
+	}
+
+	template<typename T, uint64_t N>
+	void SmallVector<T, N>::release()
+	{
+		if (m_heap)
+			::operator delete(m_heap);
+		m_heap = nullptr;
+		m_capacity = N;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <string_view>
+#include <stdexcept>
+
+#include "VFSHashPath.h"
+
+namespace VFS {
+
+	// Path that is tokenized and hashed in a constant expression.
+	//
+	// Follows the same rules as the HashPath constructor, so depth() and hash() match those
+	// of HashPath(path) and can be compared against it or used as switch labels. The
+	// elements are views into the given string, which has to outlive the StaticHashPath.
+	template<uint64_t MaxDepth = 16>
+	class StaticHashPath
+	{
+	public:
+		constexpr StaticHashPath(std::string_view path);
+	public:
+		constexpr uint64_t depth() const { return m_depth; }
+		constexpr Hash hash() const { return hash(m_depth); }
+		constexpr Hash hash(uint64_t depth) const { return depth == 0 ? 0 : m_hashes[depth - 1]; }
+		constexpr Hash elementHash(uint64_t index) const { return m_elemHashes[index]; }
+		constexpr std::string_view operator[](uint64_t index) const { return m_path.substr(m_begins[index], m_sizes[index]); }
+	public:
+		// Compares depth and path hash only, the element names are not checked
+		bool matches(HashPathRef path) const;
+		HashPath toHashPath() const;
+	private:
+		constexpr void push(uint64_t begin, uint64_t size);
+		static constexpr bool isSeparator(char c) { return c == '/' || c == '\\'; }
+	private:
+		std::string_view m_path;
+		uint64_t m_depth = 0;
+		uint64_t m_begins[MaxDepth] = {};
+		uint64_t m_sizes[MaxDepth] = {};
+		Hash m_elemHashes[MaxDepth] = {};
+		Hash m_hashes[MaxDepth] = {};
+	};
+
+	namespace Literals {
+
+		// "config/root"_hashpath
+		constexpr StaticHashPath<> operator""_hashpath(const char* str, size_t size);
+		// switch (path.hash()) { case "config/root"_pathhash: ... }
+		constexpr Hash operator""_pathhash(const char* str, size_t size);
+	}
+
+	template<uint64_t MaxDepth>
+	constexpr StaticHashPath<MaxDepth>::StaticHashPath(std::string_view path)
+		: m_path(path)
+	{
+		uint64_t begin = 0;
+		while (begin < path.size())
+		{
+			uint64_t end = begin;
+			while (end < path.size() && !isSeparator(path[end]))
+				++end;
+
+			std::string_view elem = path.substr(begin, end - begin);
+			if (elem == "..")
+			{
+				if (m_depth > 0)
+					--m_depth;
+				else
+					push(begin, end - begin);
+			}
+			else if (!elem.empty() && elem != ".")
+			{
+				push(begin, end - begin);
+			}
+
+			begin = end + 1;
+		}
+	}
+
+	template<uint64_t MaxDepth>
+	bool StaticHashPath<MaxDepth>::matches(HashPathRef path) const
+	{
+		return path.depth() == depth() && path.hash() == hash();
+	}
+
+	template<uint64_t MaxDepth>
+	HashPath StaticHashPath<MaxDepth>::toHashPath() const
+	{
+		HashPath path;
+		for (uint64_t i = 0; i < depth(); ++i)
+			path += HashPath::Element((*this)[i]);
+		return path;
+	}
+
+	template<uint64_t MaxDepth>
+	constexpr void StaticHashPath<MaxDepth>::push(uint64_t begin, uint64_t size)
+	{
+		// Fails the constant evaluation when used at compile time
+		if (m_depth == MaxDepth)
+			throw std::length_error("StaticHashPath is deeper than MaxDepth");
+
+		m_begins[m_depth] = begin;
+		m_sizes[m_depth] = size;
+		m_elemHashes[m_depth] = makeHash(m_path.substr(begin, size));
+		m_hashes[m_depth] = combineHash(hash(m_depth), m_elemHashes[m_depth]);
+		++m_depth;
+	}
+
+	constexpr StaticHashPath<> Literals::operator""_hashpath(const char* str, size_t size)
+	{
+		return StaticHashPath<>(std::string_view(str, size));
+	}
+
+	constexpr Hash Literals::operator""_pathhash(const char* str, size_t size)
+	{
+		return StaticHashPath<>(std::string_view(str, size)).hash();
+	}
+}
\ No newline at end of file
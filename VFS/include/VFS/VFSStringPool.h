@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+
+#include "VFSHash.h"
+
+namespace VFS {
+
+	// Process wide table of interned strings.
+	//
+	// Every distinct string is stored exactly once and never freed, so the returned entries
+	// can be compared by address and carry their hash. Lookups of known strings only take
+	// a shared lock on one of N_SHARDS shards and do not allocate.
+	class StringPool
+	{
+	public:
+		struct Entry
+		{
+			Hash hash;
+			std::string str;
+		};
+	public:
+		static const Entry* intern(std::string_view str);
+		static const Entry* intern(std::string_view str, Hash hash);
+		static uint64_t size();
+	private:
+		struct IdentityHash
+		{
+			size_t operator()(Hash hash) const { return (size_t)hash; }
+		};
+		struct Shard
+		{
+			std::shared_mutex mtx;
+			std::deque<Entry> entries;
+			std::unordered_multimap<Hash, const Entry*, IdentityHash> lookup;
+		};
+		static constexpr uint64_t N_SHARDS = 64;
+	private:
+		static Shard* shards();
+		static const Entry* find(const Shard& shard, std::string_view str, Hash hash);
+	};
+
+	const StringPool::Entry* StringPool::intern(std::string_view str)
+	{
+		return intern(str, makeHash(str.data(), str.size()));
+	}
+
+	const StringPool::Entry* StringPool::intern(std::string_view str, Hash hash)
+	{
+		auto& shard = shards()[(hash >> 32) % N_SHARDS];
+
+		{
+			std::shared_lock lock(shard.mtx);
+			if (auto entry = find(shard, str, hash))
+				return entry;
+		}
+
+		std::unique_lock lock(shard.mtx);
+		if (auto entry = find(shard, str, hash))
+			return entry; // Interned by another thread in the meantime
+
+		shard.entries.push_back({ hash, std::string(str) });
+		const Entry* entry = &shard.entries.back();
+		shard.lookup.insert(std::make_pair(hash, entry));
+		return entry;
+	}
+
+	uint64_t StringPool::size()
+	{
+		uint64_t count = 0;
+		for (uint64_t i = 0; i < N_SHARDS; ++i)
+		{
+			std::shared_lock lock(shards()[i].mtx);
+			count += shards()[i].entries.size();
+		}
+		return count;
+	}
+
+	StringPool::Shard* StringPool::shards()
+	{
+		static Shard s_shards[N_SHARDS];
+		return s_shards;
+	}
+
+	const StringPool::Entry* StringPool::find(const Shard& shard, std::string_view str, Hash hash)
+	{
+		auto range = shard.lookup.equal_range(hash);
+		for (auto it = range.first; it != range.second; ++it)
+			if (it->second->str == str)
+				return it->second;
+		return nullptr;
+	}
+}
\ No newline at end of file
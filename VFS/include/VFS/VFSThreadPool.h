@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+namespace VFS {
+
+	class ThreadPool
+	{
+	public:
+		ThreadPool(uint64_t nThreads = std::thread::hardware_concurrency());
+		~ThreadPool();
+	public:
+		template <typename Func>
+		std::future<void> submit(Func&& task);
+		uint64_t size() const { return m_threads.size(); }
+	private:
+		void work();
+	private:
+		std::vector<std::thread> m_threads;
+		std::queue<std::function<void()>> m_tasks;
+		std::mutex m_mtxTasks;
+		std::condition_variable m_cvTasks;
+		bool m_stop = false;
+	};
+
+	ThreadPool::ThreadPool(uint64_t nThreads)
+	{
+		nThreads = std::max<uint64_t>(1, nThreads);
+		for (uint64_t i = 0; i < nThreads; ++i)
+			m_threads.emplace_back(&ThreadPool::work, this);
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard lock(m_mtxTasks);
+			m_stop = true;
+		}
+		m_cvTasks.notify_all();
+
+		for (auto& thread : m_threads)
+			thread.join();
+	}
+
+	template <typename Func>
+	std::future<void> ThreadPool::submit(Func&& task)
+	{
+		auto packaged = std::make_shared<std::packaged_task<void()>>(std::forward<Func>(task));
+		auto future = packaged->get_future();
+		{
+			std::lock_guard lock(m_mtxTasks);
+			m_tasks.push([packaged]() { (*packaged)(); });
+		}
+		m_cvTasks.notify_one();
+		return future;
+	}
+
+	void ThreadPool::work()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock lock(m_mtxTasks);
+				m_cvTasks.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+				if (m_tasks.empty())
+					return;
+				task = std::move(m_tasks.front());
+				m_tasks.pop();
+			}
+			task();
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+namespace VFS {
+
+	// Timed scopes recorded into per-thread ring buffers and written as Chrome trace JSON
+	// (chrome://tracing, Perfetto).
+	//
+	// The VFS_TRACE_* macros only do something if VFS_ENABLE_TRACING is defined, otherwise
+	// they compile to nothing and dump() writes an empty trace. Every thread that records
+	// gets a ring of RING_SIZE events, older events are overwritten. The ring of an exited
+	// thread stays dumpable until a new thread takes it over, so there are only as many
+	// rings as threads ever recorded at the same time. Locks taken with
+	// VFS_TRACE_LOCK record the time spent waiting for them if they were contended.
+	class Trace
+	{
+	public:
+		struct Event
+		{
+			const char* name;
+			const char* category;
+			uint64_t begin; // Nanoseconds since the start of the process
+			uint64_t duration;
+		};
+		class Scope
+		{
+		public:
+			Scope(const char* name, const char* category) : m_name(name), m_category(category), m_begin(now()) {}
+			~Scope() { record(m_name, m_category, m_begin, now()); }
+			Scope(const Scope&) = delete;
+			Scope& operator=(const Scope&) = delete;
+		private:
+			const char* m_name;
+			const char* m_category;
+			uint64_t m_begin;
+		};
+		static constexpr uint64_t RING_SIZE = 1 << 16;
+	public:
+		static uint64_t now();
+		// name and category must outlive the trace, usually they are string literals
+		static void record(const char* name, const char* category, uint64_t begin, uint64_t end);
+		template <typename Mutex>
+		static void lock(Mutex& mtx, const char* name);
+		static bool dump(const std::string& path);
+		static void clear();
+	private:
+		struct ThreadBuffer
+		{
+			std::mutex mtx; // Only contended while dumping
+			std::vector<Event> events;
+			uint64_t nRecorded = 0;
+			uint64_t threadId = 0;
+			bool isExited = false; // Guarded by s_mtxBuffers
+		};
+		// Hands the thread's buffer back when the thread exits
+		struct LocalBuffer
+		{
+			std::shared_ptr<ThreadBuffer> buffer;
+			~LocalBuffer();
+		};
+	private:
+		static ThreadBuffer& local();
+	private:
+		static inline const std::chrono::steady_clock::time_point s_start = std::chrono::steady_clock::now();
+		static inline std::mutex s_mtxBuffers;
+		static inline std::vector<std::shared_ptr<ThreadBuffer>> s_buffers;
+		static inline uint64_t s_lastThreadId = 0;
+	};
+
+	#define VFS_TRACE_CONCAT_INNER(a, b) a##b
+	#define VFS_TRACE_CONCAT(a, b) VFS_TRACE_CONCAT_INNER(a, b)
+	#ifdef VFS_ENABLE_TRACING
+	#define VFS_TRACE_SCOPE(name) ::VFS::Trace::Scope VFS_TRACE_CONCAT(vfsTraceScope, __LINE__)(name, "vfs")
+	#define VFS_TRACE_LOCK(mtx, name) ::VFS::Trace::lock(mtx, name)
+	#else
+	#define VFS_TRACE_SCOPE(name) ((void)0)
+	#define VFS_TRACE_LOCK(mtx, name) (mtx).lock()
+	#endif
+
+	uint64_t Trace::now()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - s_start).count();
+	}
+
+	void Trace::record(const char* name, const char* category, uint64_t begin, uint64_t end)
+	{
+		auto& buffer = local();
+		std::lock_guard lock(buffer.mtx);
+		if (buffer.events.empty())
+			buffer.events.resize(RING_SIZE);
+		buffer.events[buffer.nRecorded++ % RING_SIZE] = { name, category, begin, end - begin };
+	}
+
+	template <typename Mutex>
+	void Trace::lock(Mutex& mtx, const char* name)
+	{
+		if (mtx.try_lock())
+			return;
+
+		uint64_t begin = now();
+		mtx.lock();
+		record(name, "lock", begin, now());
+	}
+
+	bool Trace::dump(const std::string& path)
+	{
+		std::ostringstream json;
+		json << std::fixed << std::setprecision(3);
+		json << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+		bool isFirst = true;
+		std::lock_guard lock(s_mtxBuffers);
+		for (auto& buffer : s_buffers)
+		{
+			std::lock_guard bufferLock(buffer->mtx);
+			uint64_t nEvents = std::min(buffer->nRecorded, RING_SIZE);
+			for (uint64_t i = buffer->nRecorded - nEvents; i < buffer->nRecorded; ++i)
+			{
+				auto& event = buffer->events[i % RING_SIZE];
+				json << (isFirst ? "\n" : ",\n")
+					<< "{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category << "\",\"ph\":\"X\""
+					<< ",\"ts\":" << event.begin / 1000.0 << ",\"dur\":" << event.duration / 1000.0
+					<< ",\"pid\":1,\"tid\":" << buffer->threadId << "}";
+				isFirst = false;
+			}
+		}
+		json << "\n]}\n";
+
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		file << json.str();
+		return file.good();
+	}
+
+	void Trace::clear()
+	{
+		std::lock_guard lock(s_mtxBuffers);
+		for (auto& buffer : s_buffers)
+		{
+			std::lock_guard bufferLock(buffer->mtx);
+			buffer->nRecorded = 0;
+		}
+	}
+
+	Trace::ThreadBuffer& Trace::local()
+	{
+		thread_local LocalBuffer local;
+		if (!local.buffer)
+		{
+			std::lock_guard lock(s_mtxBuffers);
+			auto it = std::find_if(s_buffers.begin(), s_buffers.end(), [](auto& buffer) { return buffer->isExited; });
+			if (it != s_buffers.end())
+			{
+				// The events of the exited thread are dropped with its id
+				local.buffer = *it;
+				std::lock_guard bufferLock(local.buffer->mtx);
+				local.buffer->nRecorded = 0;
+				local.buffer->isExited = false;
+			}
+			else
+			{
+				local.buffer = std::make_shared<ThreadBuffer>();
+				s_buffers.push_back(local.buffer);
+			}
+			local.buffer->threadId = ++s_lastThreadId;
+		}
+		return *local.buffer;
+	}
+
+	Trace::LocalBuffer::~LocalBuffer()
+	{
+		if (!buffer)
+			return;
+
+		std::lock_guard lock(s_mtxBuffers);
+		buffer->isExited = true;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+#include "VFSHash.h"
+
+namespace VFS {
+
+	// Sharded, byte bounded cache of key -> (index, value) using the 2Q replacement policy.
+	//
+	// New entries enter a small FIFO (A1in). Only keys that are requested again after
+	// dropping out of it (remembered in the ghost list A1out) are promoted to the main
+	// LRU (Am), so a single scan over many keys cannot push out the hot entries.
+	class ValueCache
+	{
+	public:
+		struct Stats
+		{
+			uint64_t nHits = 0;
+			uint64_t nMisses = 0;
+			uint64_t nInsertions = 0;
+			uint64_t nEvictions = 0;
+			uint64_t nInvalidations = 0;
+			uint64_t nBytes = 0;
+		public:
+			double hitRatio() const { return nHits / (double)std::max<uint64_t>(1, nHits + nMisses); }
+		};
+	public:
+		ValueCache(uint64_t byteBudget, uint64_t keySize, uint64_t valSize, uint64_t nShards = 16);
+	public:
+		bool get(const void* key, void* value, uint64_t& index);
+		bool getIndex(const void* key, uint64_t& index);
+		void put(const void* key, const void* value, uint64_t index);
+		void erase(const void* key);
+		void clear();
+	public:
+		Stats getStats() const;
+		void resetStats();
+	private:
+		enum class Queue { In, Main };
+		struct Entry
+		{
+			Hash hash;
+			uint64_t index;
+			std::unique_ptr<char[]> data; // Key followed by value
+		};
+		struct Slot
+		{
+			Queue queue;
+			std::list<Entry>::iterator it;
+		};
+		struct Shard
+		{
+			std::mutex mtx;
+			std::list<Entry> in;
+			std::list<Entry> main;
+			std::list<Hash> out;
+			std::unordered_map<Hash, Slot> slots;
+			std::unordered_map<Hash, std::list<Hash>::iterator> ghosts;
+			Stats stats;
+		};
+	private:
+		Shard& shardOf(Hash hash) { return m_shards[hash % m_nShards]; }
+		Entry* lookup(Shard& shard, Hash hash, const void* key);
+		void remove(Shard& shard, Hash hash);
+		void reclaim(Shard& shard);
+	private:
+		static constexpr uint64_t ENTRY_OVERHEAD = 64;
+	private:
+		const uint64_t m_keySize;
+		const uint64_t m_valSize;
+		const uint64_t m_nShards;
+		const uint64_t m_shardBudget;
+		const uint64_t m_entrySize;
+		std::unique_ptr<Shard[]> m_shards;
+	};
+
+	ValueCache::ValueCache(uint64_t byteBudget, uint64_t keySize, uint64_t valSize, uint64_t nShards)
+		: m_keySize(keySize), m_valSize(valSize), m_nShards(std::max<uint64_t>(1, nShards)),
+		m_shardBudget(byteBudget / std::max<uint64_t>(1, nShards)), m_entrySize(keySize + valSize + ENTRY_OVERHEAD),
+		m_shards(new Shard[std::max<uint64_t>(1, nShards)])
+	{
+	}
+
+	bool ValueCache::get(const void* key, void* value, uint64_t& index)
+	{
+		Hash hash = makeHash(key, m_keySize);
+		auto& shard = shardOf(hash);
+		std::lock_guard lock(shard.mtx);
+
+		Entry* entry = lookup(shard, hash, key);
+		if (!entry)
+			return false;
+
+		memcpy(value, entry->data.get() + m_keySize, m_valSize);
+		index = entry->index;
+		return true;
+	}
+
+	bool ValueCache::getIndex(const void* key, uint64_t& index)
+	{
+		Hash hash = makeHash(key, m_keySize);
+		auto& shard = shardOf(hash);
+		std::lock_guard lock(shard.mtx);
+
+		Entry* entry = lookup(shard, hash, key);
+		if (!entry)
+			return false;
+
+		index = entry->index;
+		return true;
+	}
+
+	void ValueCache::put(const void* key, const void* value, uint64_t index)
+	{
+		Hash hash = makeHash(key, m_keySize);
+		auto& shard = shardOf(hash);
+		std::lock_guard lock(shard.mtx);
+
+		remove(shard, hash);
+
+		Entry entry = { hash, index, std::unique_ptr<char[]>(new char[m_keySize + m_valSize]) };
+		memcpy(entry.data.get(), key, m_keySize);
+		memcpy(entry.data.get() + m_keySize, value, m_valSize);
+
+		// Keys seen again shortly after leaving A1in are hot, everything else starts out in A1in
+		auto ghost = shard.ghosts.find(hash);
+		if (ghost != shard.ghosts.end())
+		{
+			shard.out.erase(ghost->second);
+			shard.ghosts.erase(ghost);
+			shard.main.push_front(std::move(entry));
+			shard.slots[hash] = { Queue::Main, shard.main.begin() };
+		}
+		else
+		{
+			shard.in.push_front(std::move(entry));
+			shard.slots[hash] = { Queue::In, shard.in.begin() };
+		}
+
+		++shard.stats.nInsertions;
+		reclaim(shard);
+	}
+
+	void ValueCache::erase(const void* key)
+	{
+		Hash hash = makeHash(key, m_keySize);
+		auto& shard = shardOf(hash);
+		std::lock_guard lock(shard.mtx);
+
+		if (shard.slots.count(hash))
+			++shard.stats.nInvalidations;
+		remove(shard, hash);
+	}
+
+	void ValueCache::clear()
+	{
+		for (uint64_t i = 0; i < m_nShards; ++i)
+		{
+			auto& shard = m_shards[i];
+			std::lock_guard lock(shard.mtx);
+
+			shard.stats.nInvalidations += shard.slots.size();
+			shard.slots.clear();
+			shard.in.clear();
+			shard.main.clear();
+		}
+	}
+
+	ValueCache::Stats ValueCache::getStats() const
+	{
+		Stats stats;
+		for (uint64_t i = 0; i < m_nShards; ++i)
+		{
+			auto& shard = m_shards[i];
+			std::lock_guard lock(shard.mtx);
+
+			stats.nHits += shard.stats.nHits;
+			stats.nMisses += shard.stats.nMisses;
+			stats.nInsertions += shard.stats.nInsertions;
+			stats.nEvictions += shard.stats.nEvictions;
+			stats.nInvalidations += shard.stats.nInvalidations;
+			stats.nBytes += shard.slots.size() * m_entrySize;
+		}
+		return stats;
+	}
+
+	void ValueCache::resetStats()
+	{
+		for (uint64_t i = 0; i < m_nShards; ++i)
+		{
+			auto& shard = m_shards[i];
+			std::lock_guard lock(shard.mtx);
+			shard.stats = Stats();
+		}
+	}
+
+	ValueCache::Entry* ValueCache::lookup(Shard& shard, Hash hash, const void* key)
+	{
+		auto it = shard.slots.find(hash);
+		if (it == shard.slots.end() || memcmp(it->second.it->data.get(), key, m_keySize) != 0)
+		{
+			++shard.stats.nMisses;
+			return nullptr;
+		}
+
+		++shard.stats.nHits;
+
+		// A1in is a plain FIFO, only entries in Am move on access
+		if (it->second.queue == Queue::Main)
+			shard.main.splice(shard.main.begin(), shard.main, it->second.it);
+
+		return &*it->second.it;
+	}
+
+	void ValueCache::remove(Shard& shard, Hash hash)
+	{
+		auto it = shard.slots.find(hash);
+		if (it == shard.slots.end())
+			return;
+
+		(it->second.queue == Queue::In ? shard.in : shard.main).erase(it->second.it);
+		shard.slots.erase(it);
+	}
+
+	void ValueCache::reclaim(Shard& shard)
+	{
+		uint64_t maxEntries = std::max<uint64_t>(1, m_shardBudget / m_entrySize);
+		uint64_t maxIn = std::max<uint64_t>(1, maxEntries / 4);
+		uint64_t maxOut = std::max<uint64_t>(1, maxEntries / 2);
+
+		while (shard.slots.size() > maxEntries)
+		{
+			if (shard.in.size() > maxIn || shard.main.empty())
+			{
+				// Remember the key, it gets promoted to Am if it is requested again soon
+				Hash hash = shard.in.back().hash;
+				shard.slots.erase(hash);
+				shard.in.pop_back();
+
+				shard.out.push_front(hash);
+				shard.ghosts[hash] = shard.out.begin();
+				if (shard.out.size() > maxOut)
+				{
+					shard.ghosts.erase(shard.out.back());
+					shard.out.pop_back();
+				}
+			}
+			else
+			{
+				shard.slots.erase(shard.main.back().hash);
+				shard.main.pop_back();
+			}
+
+			++shard.stats.nEvictions;
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+
+#include "VFSAbstractFileIO.h"
+#include "VFSPlatform.h"
+
+namespace VFS {
+
+	class WriteAheadLog;
+
+	typedef std::shared_ptr<WriteAheadLog> WriteAheadLogRef;
+
+	// Redo log for in-place file updates done through an AbstractFileIO.
+	//
+	// Writers collect their writes in a Transaction and hand it to commit().
+	// The transaction is appended to the log, made durable and only then
+	// applied to the target files. Concurrent commits are grouped: one thread
+	// becomes the leader, optionally waits for the group commit window to
+	// collect more transactions and covers the whole batch with a single sync.
+	//
+	// Transactions touching the same file must be committed by one writer at a time,
+	// otherwise their order in the log may differ from the order they are applied in.
+	//
+	// If appending or syncing a batch fails, none of its transactions are applied and
+	// commit() returns false for each of them. A failed sync may have dropped the log's
+	// dirty pages, so the log stays failed and every later commit fails as well. The
+	// target files then keep the state of the last durable commit.
+	class WriteAheadLog
+	{
+	public:
+		class Transaction
+		{
+		public:
+			void write(const std::string& path, const void* buffer, uint64_t size, uint64_t offset);
+			bool empty() const { return m_nWrites == 0; }
+			void clear() { m_data.clear(); m_nWrites = 0; }
+		private:
+			std::vector<char> m_data;
+			uint64_t m_nWrites = 0;
+		public:
+			friend WriteAheadLog;
+		};
+		struct Stats
+		{
+			uint64_t nCommits = 0;
+			uint64_t nSyncs = 0;
+			uint64_t nBytesLogged = 0;
+			uint64_t nCheckpoints = 0;
+			uint64_t nReplayed = 0;
+		};
+	private:
+		WriteAheadLog(const std::string& path, AbstractFileIORef afio, uint64_t groupCommitWindowUs, uint64_t checkpointSize);
+	public:
+		~WriteAheadLog();
+	public:
+		static WriteAheadLogRef create(const std::string& path, AbstractFileIORef afio, uint64_t groupCommitWindowUs = 0, uint64_t checkpointSize = 64ull << 20);
+	public:
+		// Returns false if the transaction could not be made durable, it is not applied then
+		bool commit(Transaction& txn);
+		void checkpoint();
+		Stats getStats() const;
+		AbstractFileIORef getFileIO() const { return m_afio; }
+	private:
+		uint64_t replay();
+		void apply(const std::vector<char>& data);
+		void truncate();
+		static uint64_t checksum(const char* data, uint64_t size);
+	private:
+		#pragma pack(push, 1)
+		struct RecordHeader
+		{
+			uint64_t size;
+			uint64_t checksum;
+		};
+		#pragma pack(pop)
+		static constexpr uint64_t NO_LSN = -1;
+	private:
+		std::string m_path;
+		AbstractFileIORef m_afio;
+		FILE* m_file = nullptr;
+		const uint64_t m_groupCommitWindowUs;
+		const uint64_t m_checkpointSize;
+	private:
+		mutable std::mutex m_mtx;
+		std::condition_variable m_cvDurable;
+		std::vector<char> m_pending;
+		uint64_t m_lastLsn = 0;
+		uint64_t m_durableLsn = 0; // Also covers failed batches, see m_failedLsn
+		uint64_t m_failedLsn = NO_LSN; // First LSN of the first batch that failed
+		uint64_t m_logSize = 0;
+		bool m_isSyncing = false;
+		std::set<std::string> m_dirtyPaths;
+		Stats m_stats;
+	private:
+		std::shared_mutex m_mtxCheckpoint;
+	};
+
+	void WriteAheadLog::Transaction::write(const std::string& path, const void* buffer, uint64_t size, uint64_t offset)
+	{
+		auto append = [this](const void* data, uint64_t size)
+		{
+			m_data.insert(m_data.end(), (const char*)data, (const char*)data + size);
+		};
+
+		uint64_t pathSize = path.size();
+		append(&pathSize, sizeof(pathSize));
+		append(path.data(), pathSize);
+		append(&offset, sizeof(offset));
+		append(&size, sizeof(size));
+		append(buffer, size);
+
+		++m_nWrites;
+	}
+
+	WriteAheadLog::WriteAheadLog(const std::string& path, AbstractFileIORef afio, uint64_t groupCommitWindowUs, uint64_t checkpointSize)
+		: m_path(path), m_afio(afio), m_groupCommitWindowUs(groupCommitWindowUs), m_checkpointSize(checkpointSize)
+	{
+		m_stats.nReplayed = replay();
+		truncate();
+	}
+
+	WriteAheadLog::~WriteAheadLog()
+	{
+		checkpoint();
+		if (m_file)
+			std::fclose(m_file);
+	}
+
+	WriteAheadLogRef WriteAheadLog::create(const std::string& path, AbstractFileIORef afio, uint64_t groupCommitWindowUs, uint64_t checkpointSize)
+	{
+		WriteAheadLogRef wal;
+		wal.reset(new WriteAheadLog(path, afio, groupCommitWindowUs, checkpointSize));
+		return wal;
+	}
+
+	bool WriteAheadLog::commit(Transaction& txn)
+	{
+		if (txn.empty())
+			return true;
+
+		bool needsCheckpoint = false;
+		{
+			std::shared_lock checkpointLock(m_mtxCheckpoint);
+			{
+				std::unique_lock lock(m_mtx);
+
+				if (m_failedLsn != NO_LSN)
+					return false;
+
+				RecordHeader header = { txn.m_data.size(), checksum(txn.m_data.data(), txn.m_data.size()) };
+				m_pending.insert(m_pending.end(), (const char*)&header, (const char*)&header + sizeof(header));
+				m_pending.insert(m_pending.end(), txn.m_data.begin(), txn.m_data.end());
+				uint64_t lsn = ++m_lastLsn;
+
+				while (m_durableLsn < lsn)
+				{
+					if (m_isSyncing)
+					{
+						m_cvDurable.wait(lock);
+						continue;
+					}
+
+					// Become the leader of the next group
+					m_isSyncing = true;
+					if (m_groupCommitWindowUs > 0)
+					{
+						lock.unlock();
+						std::this_thread::sleep_for(std::chrono::microseconds(m_groupCommitWindowUs));
+						lock.lock();
+					}
+
+					std::vector<char> batch;
+					batch.swap(m_pending);
+					uint64_t firstLsn = m_durableLsn + 1;
+					uint64_t batchLsn = m_lastLsn;
+					bool isLogFailed = m_failedLsn != NO_LSN;
+
+					// Nothing is appended behind a failed batch, a replay would skip over the gap
+					lock.unlock();
+					bool isDurable = !isLogFailed
+						&& std::fwrite(batch.data(), 1, batch.size(), m_file) == batch.size()
+						&& syncFile(m_file);
+					lock.lock();
+
+					if (isDurable)
+					{
+						m_logSize += batch.size();
+						m_stats.nBytesLogged += batch.size();
+						++m_stats.nSyncs;
+					}
+					else if (!isLogFailed)
+					{
+						m_failedLsn = firstLsn;
+					}
+					m_durableLsn = batchLsn;
+					m_isSyncing = false;
+					m_cvDurable.notify_all();
+				}
+
+				if (lsn >= m_failedLsn)
+					return false;
+
+				++m_stats.nCommits;
+			}
+
+			apply(txn.m_data);
+
+			std::lock_guard lock(m_mtx);
+			needsCheckpoint = m_logSize >= m_checkpointSize;
+		}
+
+		txn.clear();
+
+		if (needsCheckpoint)
+			checkpoint();
+		return true;
+	}
+
+	void WriteAheadLog::checkpoint()
+	{
+		std::unique_lock checkpointLock(m_mtxCheckpoint);
+		std::lock_guard lock(m_mtx);
+
+		if (m_logSize == 0)
+			return;
+
+		// The log is only dropped once everything it redoes is durable in the target files
+		bool isSynced = true;
+		for (auto& path : m_dirtyPaths)
+			isSynced &= m_afio->sync(path).code == AbstractFileIO::ErrCode::Success;
+		if (!isSynced)
+			return;
+		m_dirtyPaths.clear();
+
+		truncate();
+		++m_stats.nCheckpoints;
+	}
+
+	WriteAheadLog::Stats WriteAheadLog::getStats() const
+	{
+		std::lock_guard lock(m_mtx);
+		return m_stats;
+	}
+
+	uint64_t WriteAheadLog::replay()
+	{
+		FILE* file = std::fopen(m_path.c_str(), "rb");
+		if (!file)
+			return 0;
+
+		std::error_code ec;
+		uint64_t nRemaining = std::filesystem::file_size(m_path, ec);
+		if (ec)
+			nRemaining = 0;
+
+		uint64_t nReplayed = 0;
+		RecordHeader header;
+		std::vector<char> data;
+		while (nRemaining >= sizeof(header) && std::fread(&header, sizeof(header), 1, file) == 1)
+		{
+			// The size of a torn record is garbage, it must not be trusted before it fits into the file
+			nRemaining -= sizeof(header);
+			if (header.size > nRemaining)
+				break;
+			nRemaining -= header.size;
+
+			data.resize(header.size);
+			if (std::fread(data.data(), 1, header.size, file) != header.size)
+				break; // Torn record at the end of the log
+			if (checksum(data.data(), data.size()) != header.checksum)
+				break;
+
+			apply(data);
+			++nReplayed;
+		}
+		std::fclose(file);
+
+		for (auto& path : m_dirtyPaths)
+			m_afio->sync(path);
+		m_dirtyPaths.clear();
+
+		return nReplayed;
+	}
+
+	void WriteAheadLog::apply(const std::vector<char>& data)
+	{
+		std::set<std::string> paths;
+
+		const char* it = data.data();
+		const char* end = it + data.size();
+		while (it < end)
+		{
+			uint64_t pathSize, offset, size;
+			memcpy(&pathSize, it, sizeof(pathSize)); it += sizeof(pathSize);
+			std::string path(it, pathSize); it += pathSize;
+			memcpy(&offset, it, sizeof(offset)); it += sizeof(offset);
+			memcpy(&size, it, sizeof(size)); it += sizeof(size);
+
+			m_afio->write(path, it, size, offset);
+			it += size;
+
+			paths.insert(std::move(path));
+		}
+
+		std::lock_guard lock(m_mtx);
+		m_dirtyPaths.insert(paths.begin(), paths.end());
+	}
+
+	void WriteAheadLog::truncate()
+	{
+		if (m_file)
+			std::fclose(m_file);
+		m_file = std::fopen(m_path.c_str(), "wb");
+		m_logSize = 0;
+
+		// Without a log nothing can be made durable, every commit fails from now on
+		if (!m_file || !syncFile(m_file))
+			m_failedLsn = std::min(m_failedLsn, m_lastLsn + 1);
+	}
+
+	uint64_t WriteAheadLog::checksum(const char* data, uint64_t size)
+	{
+		// FNV-1a
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for (uint64_t i = 0; i < size; ++i)
+		{
+			hash ^= (unsigned char)data[i];
+			hash *= 0x100000001b3ull;
+		}
+		return hash;
+	}
+}
\ No newline at end of file